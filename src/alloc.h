@@ -45,8 +45,10 @@ struct Alloc
 
         if (ptr + size > end)
         {
-            if (size + alignment - 1 > BLOCK_SIZE)
-                alloc_block(size + alignment); // some extra space for aligning
+            // NOTE: The block starts with the Block header.
+            unsigned needed = sizeof(Block) + size + alignment - 1;
+            if (needed > BLOCK_SIZE)
+                alloc_block(needed); // some extra space for aligning
             else
                 alloc_block(BLOCK_SIZE);
             ptr = align(current, alignment);
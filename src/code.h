@@ -4,6 +4,7 @@
 #include "list.h"
 
 #include <cinttypes>
+#include <cstdio>
 
 #define PASTE_INSTRS        \
     PASTE_INSTR(STORE)      \
@@ -16,10 +17,16 @@
     PASTE_INSTR(CQO)        \
     PASTE_INSTR(MUL)        \
     PASTE_INSTR(IMUL)       \
+    PASTE_INSTR(IMUL_REG)   \
+    PASTE_INSTR(IMUL_IM)    \
     PASTE_INSTR(DIV)        \
     PASTE_INSTR(IDIV)       \
     PASTE_INSTR(ADD)        \
     PASTE_INSTR(SUB)        \
+    PASTE_INSTR(SHL)        \
+    PASTE_INSTR(SHR)        \
+    PASTE_INSTR(SAR)        \
+    PASTE_INSTR(LEA_MUL)    \
     PASTE_INSTR(CMP_IM)     \
     PASTE_INSTR(CMP)        \
     PASTE_INSTR(CMOVE)      \
@@ -37,8 +44,20 @@
     PASTE_INSTR(JMP)        \
     PASTE_INSTR(JE)         \
     PASTE_INSTR(JNE)        \
+    PASTE_INSTR(JL)         \
+    PASTE_INSTR(JB)         \
+    PASTE_INSTR(JG)         \
+    PASTE_INSTR(JA)         \
+    PASTE_INSTR(JLE)        \
+    PASTE_INSTR(JBE)        \
+    PASTE_INSTR(JGE)        \
+    PASTE_INSTR(JAE)        \
     PASTE_INSTR(SET_ARG)    \
-    PASTE_INSTR(CALL)
+    PASTE_INSTR(CALL)       \
+    PASTE_INSTR(TAIL_CALL)  \
+    PASTE_INSTR(LEA)        \
+    PASTE_INSTR(LEA_COUNTER) \
+    PASTE_INSTR(COUNT)
 
 /**
  * A single instruction.
@@ -66,12 +85,31 @@ struct Instr
     Type type;
     Operand oper1;
     Operand oper2;
+    Operand oper3; // Only the immediate of IMUL_IM.
 };
 
+// Symbol of the table of 64 bit counters of instrumented code (.bss).
+#define COUNTERS_SYMBOL "mug.counters"
+
 /**
  * Contains a list of instructions that are to be written to the output file.
  * When write_routine() is called, the instructions are written and the
  * list of instructions is emptied.
+ *
+ * TAIL_CALL leaves the routine like its epilogue does and jumps to
+ * the called routine, which returns straight to the caller.
+ *
+ * LEA loads the address of a routine (or of data placed like one) and
+ * LEA_COUNTER the address of a counter in the counter table. COUNT adds
+ * one to a counter.
+ *
+ * SHL, SHR and SAR shift a register by a constant. LEA_MUL multiplies
+ * a register by 3, 5 or 9 with lea r, [r + r * scale].
+ *
+ * MUL and IMUL are the one operand forms that multiply rax and leave
+ * the high half of the product in rdx. IMUL_REG (imul r64, r/m64) and
+ * IMUL_IM (imul r64, r/m64, imm32) compute only the low half, which is
+ * the same for signed and unsigned operands.
  */
 struct Code
 {
@@ -79,9 +117,11 @@ struct Code
     List<Instr> instructions;
 
     FILE *f;
+    bool plt_calls; // Calls go through the PLT (nasm -f elf64).
 
-    Code(FILE *out)
+    Code(FILE *out, bool plt_calls_ = false)
     : f(out)
+    , plt_calls(plt_calls_)
     {}
 
     void routine(Str name)
@@ -89,6 +129,15 @@ struct Code
         routines.push(name);
     }
 
+    /**
+     * Writes a zero terminated string that is addressed like a routine.
+     */
+    void string(Str name, const char *value)
+    {
+        fprintf(f, "%s:\n", name.data);
+        fprintf(f, "\t" "db \"%s\", 0\n\n", value);
+    }
+
 #define CASE_REG(Type, name) \
     case Instr::Type: \
         fprintf(f, "\t" #name " %s\n", \
@@ -100,6 +149,10 @@ struct Code
                 Register::get_str(instr.oper1.reg_id), \
                 Register::get_str(instr.oper2.reg_id)); \
         break
+#define CASE_LABEL(Type, name) \
+    case Instr::Type: \
+        fprintf(f, "\t" #name " .l%u\n", instr.oper1.label); \
+        break
 #define CASE_REG_VAL(Type, name) \
     case Instr::Type: \
         fprintf(f, "\t" #name " %s, %" PRIu64 "\n", \
@@ -107,11 +160,19 @@ struct Code
                 instr.oper2.value); \
         break
 
-    void write_routine(Str routine_name, uint32_t stack_bytes)
+    /**
+     * Writes the routine with a prologue and an epilogue.
+     * The saved registers are pushed after rbp and popped in reverse order.
+     */
+    void write_routine(Str routine_name, uint32_t stack_bytes, List<RegID> &saved_regs)
     {
+        int saved_count = saved_regs.get_size();
+
         fprintf(f, "%s:\n", routine_name.data);
         fprintf(f, "\t" "push rbp\n");
         fprintf(f, "\t" "mov rbp, rsp\n");
+        for (int i = 0; i < saved_count; i++)
+            fprintf(f, "\t" "push %s\n", Register::get_str(saved_regs[i]));
         fprintf(f, "\t" "sub rsp, %u\n", stack_bytes);
         fprintf(f, "\n");
 
@@ -141,10 +202,27 @@ struct Code
                     break;
                 CASE_REG(MUL, mul);
                 CASE_REG(IMUL, imul);
+                CASE_REG_REG(IMUL_REG, imul);
+                case Instr::IMUL_IM:
+                    fprintf(f, "\t" "imul %s, %s, %" PRId64 "\n",
+                            Register::get_str(instr.oper1.reg_id),
+                            Register::get_str(instr.oper2.reg_id),
+                            (int64_t)instr.oper3.value);
+                    break;
                 CASE_REG(DIV, div);
                 CASE_REG(IDIV, idiv);
                 CASE_REG_REG(ADD, add);
                 CASE_REG_REG(SUB, sub);
+                CASE_REG_VAL(SHL, shl);
+                CASE_REG_VAL(SHR, shr);
+                CASE_REG_VAL(SAR, sar);
+                case Instr::LEA_MUL:
+                    fprintf(f, "\t" "lea %s, [%s + %s*%" PRIu64 "]\n",
+                            Register::get_str(instr.oper1.reg_id),
+                            Register::get_str(instr.oper1.reg_id),
+                            Register::get_str(instr.oper1.reg_id),
+                            instr.oper2.value);
+                    break;
                 CASE_REG_VAL(CMP_IM, cmp);
                 CASE_REG_REG(CMP, cmp);
                 CASE_REG_REG(CMOVE, cmove);
@@ -163,34 +241,76 @@ struct Code
                 case Instr::JMP_EPI:
                     fprintf(f, "\t" "jmp .epi\n");
                     break;
-                case Instr::JMP:
-                    fprintf(f, "\t" "jmp .l%u\n", instr.oper1.label);
-                    break;
-                case Instr::JE:
-                    fprintf(f, "\t" "je .l%u\n", instr.oper1.label);
-                    break;
-                case Instr::JNE:
-                    fprintf(f, "\t" "jne .l%u\n", instr.oper1.label);
-                    break;
+                CASE_LABEL(JMP, jmp);
+                CASE_LABEL(JE, je);
+                CASE_LABEL(JNE, jne);
+                CASE_LABEL(JL, jl);
+                CASE_LABEL(JB, jb);
+                CASE_LABEL(JG, jg);
+                CASE_LABEL(JA, ja);
+                CASE_LABEL(JLE, jle);
+                CASE_LABEL(JBE, jbe);
+                CASE_LABEL(JGE, jge);
+                CASE_LABEL(JAE, jae);
                 case Instr::SET_ARG:
                     fprintf(f, "\t" "mov [rsp%+d], %s\n",
                             instr.oper1.offset,
                             Register::get_str(instr.oper2.reg_id));
                     break;
                 case Instr::CALL:
-                    fprintf(f, "\t" "call %s\n", routines[instr.oper1.routine].data);
+                    fprintf(f, "\t" "call %s%s\n", routines[instr.oper1.routine].data,
+                            plt_calls ? " wrt ..plt" : "");
+                    break;
+                case Instr::TAIL_CALL:
+                    write_epilogue(stack_bytes, saved_regs);
+                    fprintf(f, "\t" "jmp %s%s\n", routines[instr.oper1.routine].data,
+                            plt_calls ? " wrt ..plt" : "");
+                    break;
+                case Instr::LEA:
+                    fprintf(f, "\t" "lea %s, [rel %s]\n",
+                            Register::get_str(instr.oper1.reg_id),
+                            routines[instr.oper2.routine].data);
+                    break;
+                case Instr::LEA_COUNTER:
+                    fprintf(f, "\t" "lea %s, [rel " COUNTERS_SYMBOL " + %" PRIu64 "]\n",
+                            Register::get_str(instr.oper1.reg_id),
+                            8 * instr.oper2.value);
+                    break;
+                case Instr::COUNT:
+                    fprintf(f, "\t" "inc qword [rel " COUNTERS_SYMBOL " + %" PRIu64 "]\n",
+                            8 * instr.oper1.value);
                     break;
             }
         }
 
         fprintf(f, ".epi:\n");
-        fprintf(f, "\t" "mov rsp, rbp\n");
-        fprintf(f, "\t" "pop rbp\n");
+        write_epilogue(stack_bytes, saved_regs);
         fprintf(f, "\t" "ret\n\n");
 
         instructions.resize(0);
     }
 
+    /**
+     * Restores the saved registers and the stack of the caller.
+     */
+    void write_epilogue(uint32_t stack_bytes, List<RegID> &saved_regs)
+    {
+        int saved_count = saved_regs.get_size();
+        if (saved_count > 0)
+        {
+            // NOTE: rsp doesn't change in the body so the saved
+            // registers are right above the stack slots.
+            fprintf(f, "\t" "add rsp, %u\n", stack_bytes);
+            for (int i = saved_count - 1; i >= 0; i--)
+                fprintf(f, "\t" "pop %s\n", Register::get_str(saved_regs[i]));
+        }
+        else
+        {
+            fprintf(f, "\t" "mov rsp, rbp\n");
+        }
+        fprintf(f, "\t" "pop rbp\n");
+    }
+
 #define ADD0(Type) \
     Instr i; \
     i.type = Instr::Type; \
@@ -232,6 +352,42 @@ struct Code
         ADD2(CMP_IM, reg_id = reg.id, value = value);
     }
 
+    void shl(Register reg, uint64_t count)
+    {
+        ADD2(SHL, reg_id = reg.id, value = count);
+    }
+
+    void shr(Register reg, uint64_t count)
+    {
+        ADD2(SHR, reg_id = reg.id, value = count);
+    }
+
+    void sar(Register reg, uint64_t count)
+    {
+        ADD2(SAR, reg_id = reg.id, value = count);
+    }
+
+    /**
+     * reg = reg + reg * scale where scale is 2, 4 or 8.
+     */
+    void lea_mul(Register reg, uint64_t scale)
+    {
+        ADD2(LEA_MUL, reg_id = reg.id, value = scale);
+    }
+
+    /**
+     * dest = source * value where value fits in 32 bits sign extended.
+     */
+    void imul(Register dest, Register source, uint64_t value)
+    {
+        Instr i;
+        i.type = Instr::IMUL_IM;
+        i.oper1.reg_id = dest.id;
+        i.oper2.reg_id = source.id;
+        i.oper3.value = value;
+        instructions.push(i);
+    }
+
     void zero(Register reg)
     {
         ADD2(XOR, reg_id = reg.id, reg_id = reg.id);
@@ -252,29 +408,51 @@ struct Code
         ADD0(JMP_EPI);
     }
 
-    void jmp(uint32_t label)
+#define JUMP(instr_name, Type) \
+    void instr_name(uint32_t label) { \
+        ADD1(Type, label = label); \
+    }
+
+    JUMP(jmp, JMP)
+    JUMP(je, JE)
+    JUMP(jne, JNE)
+    JUMP(jl, JL)
+    JUMP(jb, JB)
+    JUMP(jg, JG)
+    JUMP(ja, JA)
+    JUMP(jle, JLE)
+    JUMP(jbe, JBE)
+    JUMP(jge, JGE)
+    JUMP(jae, JAE)
+
+    void set_arg(int32_t stack_offset, Register reg)
     {
-        ADD1(JMP, label = label);
+        ADD2(SET_ARG, offset = stack_offset, reg_id = reg.id);
     }
 
-    void je(uint32_t label)
+    void call(uint32_t routine_id)
     {
-        ADD1(JE, label = label);
+        ADD1(CALL, routine = routine_id);
     }
 
-    void jne(uint32_t label)
+    void tail_call(uint32_t routine_id)
     {
-        ADD1(JNE, label = label);
+        ADD1(TAIL_CALL, routine = routine_id);
     }
 
-    void set_arg(int32_t stack_offset, Register reg)
+    void lea(Register dest, uint32_t routine_id)
     {
-        ADD2(SET_ARG, offset = stack_offset, reg_id = reg.id);
+        ADD2(LEA, reg_id = dest.id, routine = routine_id);
     }
 
-    void call(uint32_t routine_id)
+    void lea_counter(Register dest, uint32_t counter)
     {
-        ADD1(CALL, routine = routine_id);
+        ADD2(LEA_COUNTER, reg_id = dest.id, value = counter);
+    }
+
+    void count(uint32_t counter)
+    {
+        ADD1(COUNT, value = counter);
     }
 
 #define INSTRUCTION(instr_name, Type) \
@@ -296,6 +474,7 @@ struct Code
     INSTRUCTION2(mov, MOV)
     INSTRUCTION2(add, ADD)
     INSTRUCTION2(sub, SUB)
+    INSTRUCTION2(imul, IMUL_REG)
     INSTRUCTION2(cmp, CMP)
     INSTRUCTION2(cmove, CMOVE)
     INSTRUCTION2(cmovne, CMOVNE)
@@ -1,107 +1,437 @@
 #include "code_gen.h"
 #include "ir.h"
+#include "liveness.h"
 #include "register_alloc.h"
 #include "code.h"
+#include "encoder.h"
+#include "elf_writer.h"
+#include "profile.h"
+
+static bool is_comparison(IR::Type op)
+{
+    switch (op)
+    {
+        case IR::EQ: case IR::NE:
+        case IR::LT: case IR::BELOW:
+        case IR::GT: case IR::ABOVE:
+        case IR::LE: case IR::BE:
+        case IR::GE: case IR::AE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Returns the comparison that is true when the given one is false.
+ */
+static IR::Type invert_comparison(IR::Type op)
+{
+    switch (op)
+    {
+        case IR::EQ:    return IR::NE;
+        case IR::NE:    return IR::EQ;
+        case IR::LT:    return IR::GE;
+        case IR::BELOW: return IR::AE;
+        case IR::GT:    return IR::LE;
+        case IR::ABOVE: return IR::BE;
+        case IR::LE:    return IR::GT;
+        case IR::BE:    return IR::ABOVE;
+        case IR::GE:    return IR::LT;
+        case IR::AE:    return IR::BELOW;
+        InvalidDefaultCase;
+    }
+    return op;
+}
+
+/**
+ * Returns s if value is 2^s or -1 otherwise.
+ */
+static int log2_exact(uint64_t value)
+{
+    if (value == 0 || (value & (value - 1)) != 0)
+        return -1;
+    int s = 0;
+    while ((value >> s) != 1)
+        s++;
+    return s;
+}
+
+/**
+ * Splits a multiplier into (2^s + 1) * 2^shift, (2^s - 1) * 2^shift or
+ * m * 2^shift with m = 3, 5 or 9 (lea) or 1. The sign of the multiplier
+ * is handled by the caller. Returns false if it's none of these.
+ */
+static bool split_multiplier(uint64_t k, uint64_t *m, int *shift, int *s, bool *minus)
+{
+    if (k == 0)
+        return false;
+
+    *shift = 0;
+    while ((k & 1) == 0)
+    {
+        k >>= 1;
+        (*shift)++;
+    }
+
+    *m = k;
+    *s = 0;
+    *minus = false;
+    if (k == 1 || k == 3 || k == 5 || k == 9)
+        return true;
+
+    *s = log2_exact(k - 1);
+    if (*s > 0)
+        return true;
+    *s = log2_exact(k + 1);
+    *minus = true;
+    return *s > 0;
+}
+
+/**
+ * Magic number for signed division by d (Hacker's Delight 10-1):
+ * x / d is the high half of x * magic, plus x if d > 0 and the magic is
+ * negative or minus x if d < 0 and the magic is positive, shifted right
+ * arithmetically by shift and plus one if that is negative.
+ * d must not be -1, 0 or 1.
+ */
+static void signed_magic(int64_t d, uint64_t *magic, int *shift)
+{
+    const uint64_t two63 = (uint64_t)1 << 63;
+    uint64_t ad = (d < 0) ? 0 - (uint64_t)d : (uint64_t)d;
+    uint64_t t = two63 + ((uint64_t)d >> 63);
+    uint64_t anc = t - 1 - t % ad;
+    int p = 63;
+    uint64_t q1 = two63 / anc;
+    uint64_t r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad;
+    uint64_t r2 = two63 - q2 * ad;
+    uint64_t delta;
+    do
+    {
+        p++;
+        q1 = 2 * q1;
+        r1 = 2 * r1;
+        if (r1 >= anc)
+        {
+            q1++;
+            r1 -= anc;
+        }
+        q2 = 2 * q2;
+        r2 = 2 * r2;
+        if (r2 >= ad)
+        {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *magic = q2 + 1;
+    if (d < 0)
+        *magic = 0 - *magic;
+    *shift = p - 64;
+}
+
+/**
+ * Magic number for unsigned division by d (Hacker's Delight 10-2):
+ * x / d is the high half of x * magic shifted right by shift. If the
+ * magic needs 65 bits, true is returned and x / d is instead
+ * ((x - high) / 2 + high) shifted right by shift - 1.
+ * d must not be 0 or a power of two.
+ */
+static bool unsigned_magic(uint64_t d, uint64_t *magic, int *shift)
+{
+    const uint64_t two63 = (uint64_t)1 << 63;
+    bool add = false;
+    uint64_t nc = UINT64_MAX - (0 - d) % d;
+    int p = 63;
+    uint64_t q1 = two63 / nc;
+    uint64_t r1 = two63 - q1 * nc;
+    uint64_t q2 = (two63 - 1) / d;
+    uint64_t r2 = (two63 - 1) - q2 * d;
+    uint64_t delta;
+    do
+    {
+        p++;
+        if (r1 >= nc - r1)
+        {
+            q1 = 2 * q1 + 1;
+            r1 = 2 * r1 - nc;
+        }
+        else
+        {
+            q1 = 2 * q1;
+            r1 = 2 * r1;
+        }
+        if (r2 + 1 >= d - r2)
+        {
+            if (q2 >= two63 - 1)
+                add = true;
+            q2 = 2 * q2 + 1;
+            r2 = 2 * r2 + 1 - d;
+        }
+        else
+        {
+            if (q2 >= two63)
+                add = true;
+            q2 = 2 * q2;
+            r2 = 2 * r2 + 1;
+        }
+        delta = d - 1 - r2;
+    } while (p < 128 && (q1 < delta || (q1 == delta && r1 == 0)));
+
+    *magic = q2 + 1;
+    *shift = p - 64;
+    return add;
+}
+
+static bool fits_int32(uint64_t value)
+{
+    return (int64_t)value == (int32_t)value;
+}
+
+/**
+ * Multiplication or division by the constant k that doesn't need the
+ * constant in a register: shifts, lea, imul with an immediate or a
+ * multiplication by a magic number. Divisions by 0 are left to trap and
+ * signed divisions by -1 to trap on the smallest number. Unsigned
+ * divisors above 2^63 would need a compare instead.
+ */
+static bool is_reducible(IR::Type op, uint64_t k)
+{
+    uint64_t m;
+    int shift, s;
+    bool minus;
+    switch (op)
+    {
+        case IR::MUL:
+        case IR::IMUL:
+            return k == 0 || fits_int32(k) ||
+                   split_multiplier(((int64_t)k < 0) ? 0 - k : k, &m, &shift, &s, &minus);
+        case IR::DIV:
+            return k != 0 && k <= ((uint64_t)1 << 63);
+        case IR::IDIV:
+            return k != 0 && k != UINT64_MAX;
+        default:
+            return false;
+    }
+}
+
+// Routines and strings of the runtime of instrumented programs.
+// They get the routine ids after the routines of the IR.
+#define PASTE_PROFILE_SYMBOLS                                \
+    PASTE_PROFILE_SYMBOL(FOPEN, "fopen", true)               \
+    PASTE_PROFILE_SYMBOL(FWRITE, "fwrite", true)             \
+    PASTE_PROFILE_SYMBOL(FCLOSE, "fclose", true)             \
+    PASTE_PROFILE_SYMBOL(ATEXIT, "atexit", true)             \
+    PASTE_PROFILE_SYMBOL(INIT, "mug.profile.init", false)    \
+    PASTE_PROFILE_SYMBOL(DUMP, "mug.profile.dump", false)    \
+    PASTE_PROFILE_SYMBOL(FILE, "mug.profile.file", false)    \
+    PASTE_PROFILE_SYMBOL(MODE, "mug.profile.mode", false)
+
+#define PASTE_PROFILE_SYMBOL(x, name, external) Prof_##x,
+
+enum ProfileSymbol
+{
+    PASTE_PROFILE_SYMBOLS
+
+    Prof_COUNT
+};
+
+#undef PASTE_PROFILE_SYMBOL
 
 /**
  * The actual code generator.
+ *
+ * Registers are allocated for the whole routine before any code is
+ * generated (see RegisterAlloc). Each temp either stays in its register
+ * or in its stack slot for its whole live range so nothing has to be
+ * spilled or reloaded at the basic block boundaries.
  */
 struct CodeGen
 {
     struct Temp
     {
-        RegID reg_id; // Register that has the temp in it or Reg_NONE.
-        int32_t base_offset;
+        RegID reg_id; // Register allocated for the temp or Reg_NONE.
+        int32_t base_offset; // Stack slot of the temp (if spilled).
         bool spilled;
     };
 
+    /**
+     * Register to register move. Used for moving parameters and arguments
+     * to where they belong.
+     */
+    struct Move
+    {
+        RegID dest;
+        RegID src;
+    };
+
     uint32_t spilled_count;
     uint32_t max_arg_count;
     RegisterAlloc regs;
+    Liveness liveness;
+    List<LiveRange> ranges;
+    List<Interval> intervals;
     List<Temp> temps;
     List<int32_t> args;
+    List<Move> moves;
+    List<RegID> saved_regs; // Callee save registers used by the routine.
+    List<bool> fused; // Comparisons that are fused into the jump after them.
+    List<bool> constant; // Temps whose only definition is a MOV_IM.
+    List<uint64_t> constant_value;
+    List<uint32_t> order; // Blocks in the order their code is placed.
     Code &code;
+    Encoder *encoder; // If not null, the routines are encoded instead of written as text.
+    Target target;
 
-    CodeGen(Code &code_)
+    // Instrumentation. The counters of the routines are one after
+    // another in one table. counter_of and counter_at are the ones
+    // given by place_counters() for the current routine.
+    bool instrument;
+    uint32_t counter_base;  // First counter of the current routine.
+    uint32_t counter_count; // Counters of the routines so far.
+    List<uint32_t> counter_of;
+    List<uint32_t> counter_at;
+    uint32_t profile_symbols[Prof_COUNT]; // Routine ids.
+
+    Profile *profile;
+    RoutineProfile *counts; // Counts of the current routine or null if it never ran.
+
+    CodeGen(Code &code_, Encoder *encoder_, Target target_)
     : code(code_)
+    , encoder(encoder_)
+    , target(target_)
+    , instrument(false)
+    , counter_base()
+    , counter_count()
+    , profile()
+    , counts()
     {}
 
-    void spill(Register reg, bool no_reset_to_none = false)
+    /**
+     * Windows x64 convention needs 32 bytes of shadow space for the
+     * register parameters. System V has none.
+     */
+    int shadow_slots()
     {
-        if (reg.temp_id == Reg_NONE)
-            return;
+        return (target == Target_WIN64) ? regs.param_reg_count : 0;
+    }
 
-        Temp &temp = temps[reg.temp_id];
+    /**
+     * Returns a register that has the value of the temp.
+     * Spilled temps are loaded into the given scratch register.
+     */
+    Register use(uint32_t temp_id, RegID scratch)
+    {
+        Temp temp = temps[temp_id];
         if (!temp.spilled)
-        {
-            if (temp.base_offset == 0) // Parameters have offset even if they are not spilled yet.
-                temp.base_offset = -8 - 8 * spilled_count++;
-            temp.spilled = true;
-        }
-        code.store(temp.base_offset, reg);
-        if (!no_reset_to_none)
-            temp.reg_id = Reg_NONE;
+            return Register::make(temp.reg_id);
+
+        Register reg = Register::make(scratch);
+        code.load(reg, temp.base_offset);
+        return reg;
     }
 
-    Register get_register(RegID reg_id)
+    /**
+     * Returns the register where the value of the temp should be computed.
+     * For spilled temps it is the given scratch register and
+     * the value must be stored with finish_def().
+     */
+    Register def(uint32_t temp_id, RegID scratch)
     {
-        Register reg = regs.alloc_register(reg_id, -1);
-        spill(reg);
-        return reg;
+        Temp temp = temps[temp_id];
+        if (!temp.spilled)
+            return Register::make(temp.reg_id);
+        return Register::make(scratch);
     }
 
-    Register get_register_for(RegID reg_id, int32_t temp_id, bool load_spilled)
+    void finish_def(uint32_t temp_id, Register reg)
     {
-        Register reg = regs.alloc_register(reg_id, temp_id);
+        Temp temp = temps[temp_id];
+        if (temp.spilled)
+            code.store(temp.base_offset, reg);
+    }
+
+    /**
+     * Moves the value from the register to the temp.
+     */
+    void move_to(uint32_t temp_id, Register reg)
+    {
+        Temp temp = temps[temp_id];
+        if (temp.spilled)
+            code.store(temp.base_offset, reg);
+        else if (temp.reg_id != reg.id)
+            code.mov(Register::make(temp.reg_id), reg);
+    }
+
+    /**
+     * Moves the value of the temp to the register.
+     */
+    void move_from(Register reg, uint32_t temp_id)
+    {
+        Temp temp = temps[temp_id];
+        if (temp.spilled)
+            code.load(reg, temp.base_offset);
+        else if (temp.reg_id != reg.id)
+            code.mov(reg, Register::make(temp.reg_id));
+    }
+
+    /**
+     * Does the moves in the list as if they all happened at the same time.
+     * The scratch register is used for breaking cycles.
+     */
+    void parallel_move(RegID scratch)
+    {
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < moves.get_size(); i++)
+        {
+            if (moves[i].dest != moves[i].src)
+                moves[count++] = moves[i];
+        }
+        moves.resize(count);
 
-        if (reg.temp_id != temp_id)
+        while (moves.get_size() > 0)
         {
-            spill(reg);
+            count = moves.get_size();
 
-            if (load_spilled)
+            // A move can be done if nobody needs its destination anymore.
+            bool done = false;
+            for (uint32_t i = 0; i < count && !done; i++)
             {
-                Temp temp = temps[temp_id];
-                if (temp.reg_id != Reg_NONE)
+                bool blocked = false;
+                for (uint32_t k = 0; k < count; k++)
                 {
-                    Register old = regs.get_register_by_id(temp.reg_id);
-                    code.mov(reg, old);
-                    regs.dealloc_register(old.id);
+                    if (k != i && moves[k].src == moves[i].dest)
+                    {
+                        blocked = true;
+                        break;
+                    }
                 }
-                else if (temp.spilled)
+
+                if (!blocked)
                 {
-                    code.load(reg, temp.base_offset);
+                    code.mov(Register::make(moves[i].dest), Register::make(moves[i].src));
+                    moves[i] = moves[count - 1];
+                    moves.resize(count - 1);
+                    done = true;
                 }
             }
 
-            temps[temp_id].reg_id = reg.id;
-        }
-        else
-        {
-            assert(temps[temp_id].reg_id == reg.id);
+            if (!done)
+            {
+                // Only cycles left. Save the destination of the first
+                // move and let the others read it from the scratch register.
+                RegID dest = moves[0].dest;
+                code.mov(Register::make(scratch), Register::make(dest));
+                for (uint32_t k = 0; k < count; k++)
+                {
+                    if (moves[k].src == dest)
+                        moves[k].src = scratch;
+                }
+            }
         }
-
-        return reg;
-    }
-
-    Register get_any_register()
-    {
-        Register reg = regs.alloc_any_register(-1);
-        spill(reg);
-        return reg;
-    }
-
-    Register get_any_register_for(int32_t temp_id, bool load_spilled)
-    {
-        Temp temp = temps[temp_id];
-        if (temp.reg_id != Reg_NONE)
-            return regs.alloc_register(temp.reg_id, temp_id);
-
-        Register reg = regs.alloc_any_register(temp_id);
-        spill(reg);
-        if (temp.spilled && load_spilled)
-            code.load(reg, temp.base_offset);
-        temps[temp_id].reg_id = reg.id;
-        return reg;
     }
 
     void gen_code(Quad q)
@@ -110,49 +440,86 @@ struct CodeGen
         {
             case IR::MOV_IM:
             {
-                Register reg = get_any_register_for(q.target.temp_id, false);
-                code.mov(reg, q.left.int_value);
+                // Constants that are only multiplied or divided by
+                // (see is_reduced()) are never loaded.
+                if (ranges[q.target.temp_id].start < 0)
+                    break;
+                Register target = def(q.target.temp_id, Reg_r11);
+                code.mov(target, q.left.int_value);
+                finish_def(q.target.temp_id, target);
                 break;
             }
             case IR::MOV:
             {
-                Register target = get_any_register_for(q.target.temp_id, false);
-                Register left = get_any_register_for(q.left.temp_id, true);
-                code.mov(target, left);
+                Temp target = temps[q.target.temp_id];
+                Temp left = temps[q.left.temp_id];
+                if (!target.spilled)
+                    move_from(Register::make(target.reg_id), q.left.temp_id);
+                else if (!left.spilled)
+                    move_to(q.target.temp_id, Register::make(left.reg_id));
+                else if (target.base_offset != left.base_offset)
+                {
+                    Register scratch = use(q.left.temp_id, Reg_r11);
+                    code.store(target.base_offset, scratch);
+                }
                 break;
             }
             case IR::NOT:
+            case IR::NEG:
             {
-                Register target = get_any_register_for(q.target.temp_id, false);
-                Register left = get_any_register_for(q.left.temp_id, true);
-                code.mov(target, left);
-                code.xor_(target, 1);
+                Register left = use(q.left.temp_id, Reg_r11);
+                Register target = def(q.target.temp_id, Reg_r11);
+                if (target.id != left.id)
+                    code.mov(target, left);
+                if (q.op == IR::NOT)
+                    code.xor_(target, 1);
+                else
+                    code.neg(target);
+                finish_def(q.target.temp_id, target);
                 break;
             }
-            case IR::NEG:
+            case IR::MUL: case IR::IMUL:
             {
-                Register target = get_any_register_for(q.target.temp_id, false);
-                Register left = get_any_register_for(q.left.temp_id, true);
-                code.mov(target, left);
-                code.neg(target);
+                uint32_t operand;
+                uint64_t k;
+                if (is_reduced(q, &operand, &k))
+                {
+                    gen_by_constant(q, operand, k);
+                    break;
+                }
+
+                // NOTE: The low half of the product is the same for
+                // signed and unsigned operands.
+                Register left = use(q.left.temp_id, Reg_r11);
+                Register right = use(q.right.temp_id, Reg_rax);
+                Register target = def(q.target.temp_id, Reg_r11);
+                if (target.id == right.id && target.id != left.id)
+                    code.imul(target, left);
+                else
+                {
+                    if (target.id != left.id)
+                        code.mov(target, left);
+                    code.imul(target, right);
+                }
+                finish_def(q.target.temp_id, target);
                 break;
             }
-            case IR::MUL: case IR::IMUL:
             case IR::DIV: case IR::IDIV:
             {
-                Register rax = get_register_for(Reg_rax, q.target.temp_id, false);
-                Register rdx = get_register(Reg_rdx);
-                Register left = get_any_register_for(q.left.temp_id, true);
-                Register right = get_any_register_for(q.right.temp_id, true);
-                code.mov(rax, left);
+                uint32_t operand;
+                uint64_t k;
+                if (is_reduced(q, &operand, &k))
+                {
+                    gen_by_constant(q, operand, k);
+                    break;
+                }
+
+                Register rax = Register::make(Reg_rax);
+                Register rdx = Register::make(Reg_rdx);
+                move_from(rax, q.left.temp_id);
+                Register right = use(q.right.temp_id, Reg_r11);
                 switch (q.op)
                 {
-                    case IR::MUL:
-                        code.mul(right);
-                        break;
-                    case IR::IMUL:
-                        code.imul(right);
-                        break;
                     case IR::DIV:
                         code.zero(rdx);
                         code.div(right);
@@ -163,21 +530,34 @@ struct CodeGen
                         break;
                     InvalidDefaultCase;
                 }
+                move_to(q.target.temp_id, rax);
                 break;
             }
             case IR::ADD:
             case IR::SUB:
             {
-                Register target = get_any_register_for(q.target.temp_id, false);
-                Register left = get_any_register_for(q.left.temp_id, true);
-                Register right = get_any_register_for(q.right.temp_id, true);
-                code.mov(target, left);
-                switch (q.op)
+                Register left = use(q.left.temp_id, Reg_r11);
+                Register right = use(q.right.temp_id, Reg_rax);
+                Register target = def(q.target.temp_id, Reg_r11);
+                if (target.id == right.id && target.id != left.id)
                 {
-                    case IR::ADD: code.add(target, right); break;
-                    case IR::SUB: code.sub(target, right); break;
-                    InvalidDefaultCase;
+                    // NOTE: The target got the register of the right operand.
+                    if (q.op == IR::SUB)
+                        code.neg(target); // left - right == -right + left
+                    code.add(target, left);
+                }
+                else
+                {
+                    if (target.id != left.id)
+                        code.mov(target, left);
+                    switch (q.op)
+                    {
+                        case IR::ADD: code.add(target, right); break;
+                        case IR::SUB: code.sub(target, right); break;
+                        InvalidDefaultCase;
+                    }
                 }
+                finish_def(q.target.temp_id, target);
                 break;
             }
             case IR::EQ: case IR::NE:
@@ -186,67 +566,61 @@ struct CodeGen
             case IR::LE: case IR::BE:
             case IR::GE: case IR::AE:
             {
-                Register left = get_any_register_for(q.left.temp_id, true);
-                Register right = get_any_register_for(q.right.temp_id, true);
-                Register target = get_any_register_for(q.target.temp_id, false);
-                Register temp = get_any_register();
-                code.zero(target);
-                code.mov(temp, 1);
+                Register left = use(q.left.temp_id, Reg_r11);
+                Register right = use(q.right.temp_id, Reg_rax);
                 code.cmp(left, right);
+                // NOTE: The target can be the same register as an operand
+                // so it is written after the comparison. Movs don't touch flags.
+                Register target = def(q.target.temp_id, Reg_r11);
+                Register one = Register::make(Reg_rax);
+                code.mov(target, 0);
+                code.mov(one, 1);
                 switch (q.op)
                 {
-                    case IR::EQ:    code.cmove(target, temp);   break;
-                    case IR::NE:    code.cmovne(target, temp);  break;
-                    case IR::LT:    code.cmovl(target, temp);   break;
-                    case IR::BELOW: code.cmovb(target, temp);   break;
-                    case IR::GT:    code.cmovg(target, temp);   break;
-                    case IR::ABOVE: code.cmova(target, temp);   break;
-                    case IR::LE:    code.cmovle(target, temp);  break;
-                    case IR::BE:    code.cmovbe(target, temp);  break;
-                    case IR::GE:    code.cmovge(target, temp);  break;
-                    case IR::AE:    code.cmovae(target, temp);  break;
+                    case IR::EQ:    code.cmove(target, one);   break;
+                    case IR::NE:    code.cmovne(target, one);  break;
+                    case IR::LT:    code.cmovl(target, one);   break;
+                    case IR::BELOW: code.cmovb(target, one);   break;
+                    case IR::GT:    code.cmovg(target, one);   break;
+                    case IR::ABOVE: code.cmova(target, one);   break;
+                    case IR::LE:    code.cmovle(target, one);  break;
+                    case IR::BE:    code.cmovbe(target, one);  break;
+                    case IR::GE:    code.cmovge(target, one);  break;
+                    case IR::AE:    code.cmovae(target, one);  break;
                     InvalidDefaultCase;
                 }
+                finish_def(q.target.temp_id, target);
                 break;
             }
             case IR::JMP:
             {
-                end_basic_block();
                 code.jmp(q.target.label);
-                begin_basic_block();
                 break;
             }
             case IR::JZ:
             case IR::JNZ:
             {
-                Register left = get_any_register_for(q.left.temp_id, true);
+                Register left = use(q.left.temp_id, Reg_r11);
                 code.cmp(left, 0);
-                end_basic_block();
                 switch (q.op)
                 {
                     case IR::JZ:  code.je(q.target.label);  break;
                     case IR::JNZ: code.jne(q.target.label); break;
                     InvalidDefaultCase;
                 }
-                begin_basic_block();
                 break;
             }
             case IR::LABEL:
             {
-                end_basic_block();
                 code.label(q.target.label);
-                begin_basic_block();
                 break;
             }
+            case IR::NOP:
+                break;
             case IR::RET:
             {
                 if (q.target.returns_something)
-                {
-                    Register rax = regs.get_register_by_id(Reg_rax);
-                    Register reg = get_any_register_for(q.left.temp_id, true);
-                    if (rax.id != reg.id)
-                        code.mov(rax, reg);
-                }
+                    move_from(Register::make(Reg_rax), q.left.temp_id);
                 code.jmp_epi();
                 break;
             }
@@ -260,95 +634,662 @@ struct CodeGen
             }
             case IR::CALL:
             {
-                end_basic_block();
+                gen_call(q, false);
+                break;
+            }
+        }
+    }
 
-                int arg_count = args.get_size();
-                if (arg_count > (int)max_arg_count)
-                    max_arg_count = arg_count;
+    /**
+     * The quad multiplies or divides by a constant without mul, imul, div
+     * or idiv (see is_reducible()). operand gets the other operand and
+     * k the constant.
+     */
+    bool is_reduced(Quad q, uint32_t *operand, uint64_t *k)
+    {
+        if (q.op != IR::MUL && q.op != IR::IMUL && q.op != IR::DIV && q.op != IR::IDIV)
+            return false;
 
-                for (int i = arg_count - 1; i >= 0; i--)
-                {
-                    int32_t temp_id = args[i];
+        uint32_t left = q.left.temp_id;
+        uint32_t right = q.right.temp_id;
+        if (constant[right] && is_reducible(q.op, constant_value[right]))
+        {
+            *operand = left;
+            *k = constant_value[right];
+            return true;
+        }
+        if ((q.op == IR::MUL || q.op == IR::IMUL) && constant[left] && is_reducible(q.op, constant_value[left]))
+        {
+            *operand = right;
+            *k = constant_value[left];
+            return true;
+        }
+        return false;
+    }
 
-                    Register reg;
-                    if (regs.get_param_register(i, &reg))
-                    {
-                        get_register_for(reg.id, temp_id, true);
-                    }
+    /**
+     * Multiplies or divides the operand by the constant k.
+     *
+     * Multiplications are shifts, lea and one add or sub, negated for
+     * negative k, if that takes at most two instructions besides a mov.
+     * Other multipliers are the immediate of an imul. Divisions by powers
+     * of two are shifts. Signed ones
+     * add 2^s - 1 to negative dividends first so they round towards zero.
+     * Other divisions take the high half of the product with a magic
+     * number (see signed_magic() and unsigned_magic()).
+     */
+    void gen_by_constant(Quad q, uint32_t operand, uint64_t k)
+    {
+        Register rax = Register::make(Reg_rax);
+        Register rdx = Register::make(Reg_rdx);
+        Register x = use(operand, Reg_r11);
+
+        if (q.op == IR::MUL || q.op == IR::IMUL)
+        {
+            Register target = def(q.target.temp_id, Reg_rax);
+            bool negative = (int64_t)k < 0;
+            uint64_t m;
+            int shift, s;
+            bool minus;
+            bool split = split_multiplier(negative ? 0 - k : k, &m, &shift, &s, &minus);
+            int ops = split ? (s > 0 ? 2 : (m > 1 ? 1 : 0)) + (shift > 0) + negative : 0;
+            if (k == 0)
+                code.mov(target, 0);
+            else if (fits_int32(k) && (!split || ops > 2))
+                code.imul(target, x, k);
+            else
+            {
+                // x is read again after the shift.
+                Register r = (s > 0 && target.id == x.id) ? rdx : target;
+                if (r.id != x.id)
+                    code.mov(r, x);
+                if (s > 0)
+                {
+                    code.shl(r, s);
+                    if (minus)
+                        code.sub(r, x);
                     else
-                    {
-                        reg = get_any_register_for(temp_id, true);
-                        code.set_arg(i*8, reg);
-                    }
+                        code.add(r, x);
                 }
-                args.resize(0);
+                else if (m > 1)
+                    code.lea_mul(r, m - 1);
+                if (shift > 0)
+                    code.shl(r, shift);
+                if (negative)
+                    code.neg(r);
+                if (r.id != target.id)
+                    code.mov(target, r);
+            }
+            finish_def(q.target.temp_id, target);
+            return;
+        }
 
-                code.call(q.left.func_id);
-                begin_basic_block();
-                get_register_for(Reg_rax, q.target.temp_id, false);
-                break;
+        bool is_signed = (q.op == IR::IDIV);
+        bool negative = is_signed && (int64_t)k < 0;
+        int s = log2_exact(negative ? 0 - k : k);
+        if (s == 0 || (s > 0 && !is_signed))
+        {
+            Register target = def(q.target.temp_id, Reg_rax);
+            if (target.id != x.id)
+                code.mov(target, x);
+            if (s > 0)
+                code.shr(target, s);
+            finish_def(q.target.temp_id, target);
+        }
+        else if (s > 0)
+        {
+            code.mov(rdx, x);
+            if (s > 1)
+                code.sar(rdx, 63);
+            code.shr(rdx, 64 - s); // 2^s - 1 if x is negative
+            code.add(rdx, x);
+            code.sar(rdx, s);
+            if (negative)
+                code.neg(rdx);
+            move_to(q.target.temp_id, rdx);
+        }
+        else if (is_signed)
+        {
+            uint64_t magic;
+            int shift;
+            signed_magic((int64_t)k, &magic, &shift);
+            code.mov(rax, magic);
+            code.imul(x);
+            if (!negative && (int64_t)magic < 0)
+                code.add(rdx, x);
+            if (negative && (int64_t)magic > 0)
+                code.sub(rdx, x);
+            if (shift > 0)
+                code.sar(rdx, shift);
+            code.mov(rax, rdx);
+            code.shr(rax, 63); // Negative quotients are one too small.
+            code.add(rdx, rax);
+            move_to(q.target.temp_id, rdx);
+        }
+        else
+        {
+            uint64_t magic;
+            int shift;
+            bool add = unsigned_magic(k, &magic, &shift);
+            code.mov(rax, magic);
+            code.mul(x);
+            if (add)
+            {
+                code.mov(rax, x);
+                code.sub(rax, rdx);
+                code.shr(rax, 1);
+                code.add(rax, rdx);
+                if (shift > 1)
+                    code.shr(rax, shift - 1);
+                move_to(q.target.temp_id, rax);
+            }
+            else
+            {
+                if (shift > 0)
+                    code.shr(rdx, shift);
+                move_to(q.target.temp_id, rdx);
             }
         }
     }
 
-    void begin_basic_block()
+    /**
+     * Comparison followed by JZ or JNZ that is the only use of its result.
+     * The result is never materialized: cmp sets the flags and jcc jumps.
+     */
+    void gen_branch(Quad cmp, Quad jump)
     {
-        regs.reset();
-        int temp_count = temps.get_size();
-        for (int i = 0; i < temp_count; i++)
-            temps[i].reg_id = Reg_NONE;
+        Register left = use(cmp.left.temp_id, Reg_r11);
+        Register right = use(cmp.right.temp_id, Reg_rax);
+        code.cmp(left, right);
+
+        IR::Type op = cmp.op;
+        if (jump.op == IR::JZ)
+            op = invert_comparison(op);
+
+        uint32_t label = jump.target.label;
+        switch (op)
+        {
+            case IR::EQ:    code.je(label);  break;
+            case IR::NE:    code.jne(label); break;
+            case IR::LT:    code.jl(label);  break;
+            case IR::BELOW: code.jb(label);  break;
+            case IR::GT:    code.jg(label);  break;
+            case IR::ABOVE: code.ja(label);  break;
+            case IR::LE:    code.jle(label); break;
+            case IR::BE:    code.jbe(label); break;
+            case IR::GE:    code.jge(label); break;
+            case IR::AE:    code.jae(label); break;
+            InvalidDefaultCase;
+        }
+    }
+
+    /**
+     * Generates the call. A tail call leaves the routine and jumps to the
+     * called routine which then returns to the caller of this routine.
+     */
+    void gen_call(Quad q, bool tail)
+    {
+        int arg_count = args.get_size();
+        if (arg_count > (int)max_arg_count)
+            max_arg_count = arg_count;
+
+        // NOTE: All temps that are live after the call are in stack slots
+        // or callee save registers so the argument registers (and rax)
+        // can be overwritten freely.
+
+        // Stack arguments first.
+        for (int i = regs.param_reg_count; i < arg_count; i++)
+        {
+            Register reg = use(args[i], Reg_rax);
+            int slot = i - regs.param_reg_count + shadow_slots();
+            code.set_arg(slot * 8, reg);
+        }
+
+        // Then the register arguments that are in registers.
+        moves.resize(0);
+        for (int i = 0; i < arg_count && i < regs.param_reg_count; i++)
+        {
+            Temp temp = temps[args[i]];
+            if (!temp.spilled)
+            {
+                Move move = { regs.param_registers[i], temp.reg_id };
+                moves.push(move);
+            }
+        }
+        parallel_move(Reg_rax);
+
+        // And last the register arguments that are in stack slots.
+        for (int i = 0; i < arg_count && i < regs.param_reg_count; i++)
+        {
+            Temp temp = temps[args[i]];
+            if (temp.spilled)
+                code.load(Register::make(regs.param_registers[i]), temp.base_offset);
+        }
+
+        args.resize(0);
+
+        if (tail)
+        {
+            code.tail_call(q.left.func_id);
+            return;
+        }
+
+        code.call(q.left.func_id);
+
+        if (ranges[q.target.temp_id].start >= 0)
+            move_to(q.target.temp_id, Register::make(Reg_rax));
     }
 
-    void end_basic_block()
+    /**
+     * Moves the parameters from the registers and the stack to
+     * the locations allocated for them.
+     */
+    void gen_entry(Routine *routine)
     {
-        for (int i = Reg_NONE + 1; i < Reg_COUNT; i++)
+        int param_count = routine->param_count;
+
+        // Spilled register parameters are stored first, before
+        // the parameter registers get overwritten.
+        for (int i = 0; i < param_count && i < regs.param_reg_count; i++)
         {
-            Register reg = regs.get_register_by_id((RegID)i);
-            spill(reg, true);
+            if (ranges[i].start >= 0 && temps[i].spilled)
+                code.store(temps[i].base_offset, Register::make(regs.param_registers[i]));
+        }
+
+        moves.resize(0);
+        for (int i = 0; i < param_count && i < regs.param_reg_count; i++)
+        {
+            if (ranges[i].start >= 0 && !temps[i].spilled)
+            {
+                Move move = { temps[i].reg_id, regs.param_registers[i] };
+                moves.push(move);
+            }
+        }
+        parallel_move(Reg_rax);
+
+        // Stack parameters that got a register.
+        for (int i = regs.param_reg_count; i < param_count; i++)
+        {
+            if (ranges[i].start >= 0 && !temps[i].spilled)
+            {
+                int slot = i - regs.param_reg_count + shadow_slots();
+                code.load(Register::make(temps[i].reg_id), 16 + 8 * slot);
+            }
         }
     }
 
-    void gen_code(Routine *routine)
+    void allocate_registers(Routine *routine)
     {
-        if (routine->external)
-            return;
+        liveness.compute(routine);
+        liveness.compute_ranges(routine, ranges);
 
-        spilled_count = 0;
-        max_arg_count = 0;
-        regs.reset();
-        temps.resize(routine->temp_count);
+        // A comparison can be fused into the JZ/JNZ right after it if the
+        // jump is the only place where the result is used. The result
+        // then needs neither a register nor a stack slot.
+        int quad_count = routine->quad_count;
+        fused.resize(quad_count);
+        for (int i = 0; i < quad_count; i++)
+        {
+            fused[i] = false;
+
+            Quad q = (*routine)[i];
+            if (!is_comparison(q.op) || i + 1 >= quad_count)
+                continue;
+
+            Quad next = (*routine)[i + 1];
+            if (next.op != IR::JZ && next.op != IR::JNZ)
+                continue;
+
+            uint32_t t = q.target.temp_id;
+            if (next.left.temp_id == t &&
+                ranges[t].start == DEF_POS(i) && ranges[t].end == USE_POS(i + 1))
+            {
+                fused[i] = true;
+                ranges[t].start = -1;
+            }
+        }
+
+        // Multiplications and divisions by constants don't read the
+        // constant (see is_reduced()). A constant that is used only by
+        // them needs neither a register nor its MOV_IM.
+        int temp_count = routine->temp_count;
+        List<uint32_t> def_count;
+        List<uint32_t> use_count;
+        def_count.resize(temp_count);
+        use_count.resize(temp_count);
+        constant.resize(temp_count);
+        constant_value.resize(temp_count);
+        for (int i = 0; i < temp_count; i++)
+        {
+            def_count[i] = (i < (int)routine->param_count) ? 1 : 0;
+            use_count[i] = 0;
+            constant[i] = false;
+        }
+        for (int i = 0; i < quad_count; i++)
+        {
+            Quad q = (*routine)[i];
+            uint32_t uses[2];
+            int count = get_uses(q, uses);
+            for (int k = 0; k < count; k++)
+                use_count[uses[k]]++;
 
-        int temp_count = temps.get_size();
+            uint32_t t;
+            if (get_def(q, &t))
+            {
+                def_count[t]++;
+                constant[t] = (q.op == IR::MOV_IM);
+                constant_value[t] = q.left.int_value;
+            }
+        }
+        for (int i = 0; i < temp_count; i++)
+            constant[i] = constant[i] && def_count[i] == 1;
+        for (int i = 0; i < quad_count; i++)
+        {
+            Quad q = (*routine)[i];
+            uint32_t operand;
+            uint64_t k;
+            if (is_reduced(q, &operand, &k))
+                use_count[(operand == q.left.temp_id) ? q.right.temp_id : q.left.temp_id]--;
+        }
+        for (int i = 0; i < temp_count; i++)
+        {
+            if (constant[i] && use_count[i] == 0)
+                ranges[i].start = -1;
+        }
+
+        intervals.resize(0);
+        for (int i = 0; i < temp_count; i++)
+        {
+            LiveRange range = ranges[i];
+            if (range.start < 0)
+                continue;
+            Interval interval;
+            interval.temp_id = i;
+            interval.start = range.start;
+            interval.end = range.end;
+            interval.crosses_call = range.crosses_call;
+            interval.hint = -1;
+            interval.weight = 0;
+            interval.reg_id = Reg_NONE;
+            intervals.push(interval);
+        }
+
+        // Two address instructions compute the target in place of the
+        // left operand (or the right one for ADD and MUL). The target
+        // should get the register of an operand whose live range ends there.
+        List<int32_t> interval_of;
+        interval_of.resize(temp_count);
+        for (int i = 0; i < temp_count; i++)
+            interval_of[i] = -1;
+        for (uint32_t i = 0; i < intervals.get_size(); i++)
+            interval_of[intervals[i].temp_id] = i;
+
+        for (int i = 0; i < quad_count; i++)
+        {
+            Quad q = (*routine)[i];
+            int32_t operand = -1;
+            switch (q.op)
+            {
+                case IR::MOV:
+                case IR::NOT:
+                case IR::NEG:
+                case IR::SUB:
+                    operand = q.left.temp_id;
+                    break;
+                case IR::ADD:
+                case IR::MUL:
+                case IR::IMUL:
+                    operand = q.left.temp_id;
+                    if (ranges[operand].end != USE_POS(i))
+                        operand = q.right.temp_id;
+                    break;
+                default:
+                    break;
+            }
+
+            uint32_t t = q.target.temp_id;
+            if (operand < 0 || interval_of[t] < 0 || interval_of[operand] < 0)
+                continue;
+            if (ranges[operand].end == USE_POS(i) && ranges[t].start == DEF_POS(i))
+                intervals[interval_of[t]].hint = interval_of[operand];
+        }
+
+        // With a profile, the temps that are read and written the most
+        // times keep their registers.
+        for (int i = 0; i < quad_count && counts; i++)
+        {
+            uint32_t uses[2];
+            int use_count = get_uses((*routine)[i], uses);
+            for (int k = 0; k < use_count; k++)
+            {
+                if (interval_of[uses[k]] >= 0)
+                    intervals[interval_of[uses[k]]].weight += counts->counts[i];
+            }
+
+            uint32_t def;
+            if (get_def((*routine)[i], &def) && interval_of[def] >= 0)
+                intervals[interval_of[def]].weight += counts->counts[i];
+        }
+
+        regs.allocate(intervals);
+
+        temps.resize(temp_count);
         for (int i = 0; i < temp_count; i++)
         {
             temps[i].reg_id = Reg_NONE;
             temps[i].base_offset = 0;
-            temps[i].spilled = false;
+            temps[i].spilled = true;
+        }
+
+        bool used[Reg_COUNT] = {};
+        int interval_count = intervals.get_size();
+        for (int i = 0; i < interval_count; i++)
+        {
+            Interval interval = intervals[i];
+            temps[interval.temp_id].reg_id = interval.reg_id;
+            temps[interval.temp_id].spilled = (interval.reg_id == Reg_NONE);
+            if (interval.reg_id != Reg_NONE)
+                used[interval.reg_id] = true;
         }
 
+        // Callee save registers are saved in the prologue right below rbp.
+        saved_regs.resize(0);
+        for (int r = 0; r < regs.pool_count; r++)
+        {
+            RegID reg_id = regs.pool[r];
+            if (used[reg_id] && regs.callee_save[reg_id])
+                saved_regs.push(reg_id);
+        }
+        int saved_count = saved_regs.get_size();
+
+        // Stack slots for the spilled temps.
         int param_count = routine->param_count;
-        for (int i = 0; i < param_count; i++)
+        for (int i = 0; i < temp_count; i++)
         {
-            Register reg;
-            if (regs.get_param_register(i, &reg))
+            if (ranges[i].start < 0 || !temps[i].spilled)
+                continue;
+
+            // NOTE: On Windows, all parameters have space on the stack for spilling.
+            // On System V, only the stack parameters do and the register
+            // parameters get a spill slot like any other temp.
+            int slot = i - regs.param_reg_count + shadow_slots();
+            if (i < param_count && slot >= 0)
+                temps[i].base_offset = 16 + 8 * slot;
+            else
+                temps[i].base_offset = -8 - 8 * (saved_count + spilled_count++);
+        }
+    }
+
+    /**
+     * Returns the index of the RET if the CALL at the given index returns
+     * its result right away and passes all its arguments in registers.
+     * Such a call can reuse the frame of the routine. Returns 0 otherwise.
+     */
+    uint32_t find_tail_ret(Routine *routine, uint32_t call, uint32_t end)
+    {
+        if (args.get_size() > (uint32_t)regs.param_reg_count)
+            return 0;
+
+        uint32_t ret = call + 1;
+        while (ret < end && (*routine)[ret].op == IR::NOP)
+            ret++;
+        if (ret == end)
+            return 0;
+
+        Quad q = (*routine)[ret];
+        if (q.op != IR::RET)
+            return 0;
+        if (q.target.returns_something && q.left.temp_id != (*routine)[call].target.temp_id)
+            return 0;
+        return ret;
+    }
+
+    /**
+     * Generates the quads [start, end) of the routine. The last quad is
+     * given separately so that its jump can be changed.
+     */
+    void gen_quads(Routine *routine, uint32_t start, uint32_t end, Quad last)
+    {
+        for (uint32_t i = start; i < end; i++)
+        {
+            if (instrument && counter_at[i] != NO_COUNTER)
+                code.count(counter_base + counter_at[i]);
+
+            Quad q = (i + 1 == end) ? last : (*routine)[i];
+            uint32_t ret = 0;
+            if (fused[i])
+            {
+                i++;
+                Quad jump = (i + 1 == end) ? last : (*routine)[i];
+                gen_branch(q, jump);
+                q = jump;
+            }
+            else if (q.op == IR::CALL && (ret = find_tail_ret(routine, i, end)) != 0)
             {
-                regs.alloc_register(reg.id, i);
-                temps[i].reg_id = reg.id;
+                // The RET and the NOPs before it are skipped.
+                gen_call(q, true);
+                i = ret;
             }
             else
+                gen_code(q);
+
+            // Counts the times the jump falls through.
+            if (instrument && (q.op == IR::JZ || q.op == IR::JNZ))
+                code.count(counter_base + counter_of[i] + 1);
+        }
+    }
+
+    /**
+     * Label at the start of the block. Blocks that don't start with
+     * a LABEL get a label after the labels of the IR when needed.
+     */
+    uint32_t block_label(Routine *routine, uint32_t block_index)
+    {
+        uint32_t start = routine->blocks[block_index].start;
+        if ((*routine)[start].op == IR::LABEL)
+            return (*routine)[start].target.label;
+        return routine->quad_count + start;
+    }
+
+    /**
+     * Generates the blocks of the routine. With a profile, the blocks
+     * that never ran are placed after the others so that the code that
+     * runs is packed together and its branches mostly fall through.
+     */
+    void gen_blocks(Routine *routine)
+    {
+        uint32_t block_count = routine->block_count;
+        BasicBlock *blocks = routine->blocks;
+
+        order.resize(0);
+        for (uint32_t b = 0; b < block_count; b++)
+        {
+            if (counts == nullptr || counts->counts[blocks[b].start] > 0)
+                order.push(b);
+        }
+        for (uint32_t b = 0; b < block_count && counts; b++)
+        {
+            if (counts->counts[blocks[b].start] == 0)
+                order.push(b);
+        }
+
+        for (uint32_t k = 0; k < block_count; k++)
+        {
+            uint32_t b = order[k];
+            BasicBlock block = blocks[b];
+            uint32_t next = (k + 1 < block_count) ? order[k + 1] : block_count;
+
+            // Blocks that don't follow the block before them in the IR
+            // are reached by a jump.
+            if (k > 0 && order[k - 1] != b - 1 && (*routine)[block.start].op != IR::LABEL)
+                code.label(block_label(routine, b));
+
+            Quad last = (*routine)[block.end - 1];
+            bool falls_through = (last.op != IR::JMP && last.op != IR::RET);
+            uint32_t fall = b + 1;
+
+            // A branch whose target comes next jumps to the block it used
+            // to fall through to when the condition is inverted.
+            if ((last.op == IR::JZ || last.op == IR::JNZ) && fall != next &&
+                fall < block_count && blocks[b].succ[1] == (int32_t)next)
+            {
+                last.op = (last.op == IR::JZ) ? IR::JNZ : IR::JZ;
+                last.target.label = block_label(routine, fall);
+                falls_through = false;
+            }
+
+            gen_quads(routine, block.start, block.end, last);
+
+            if (falls_through && fall != next)
             {
-                temps[i].spilled = true;
+                if (fall == block_count)
+                    code.jmp_epi();
+                else
+                    code.jmp(block_label(routine, fall));
             }
-            // NOTE: All parameters have space on the stack for spilling.
-            temps[i].base_offset = 16 + 8 * i;
         }
+    }
 
-        int quad_count = routine->quad_count;
-        for (int i = 0; i < quad_count; i++)
+    void gen_code(Routine *routine)
+    {
+        if (routine->external)
+            return;
+
+        spilled_count = 0;
+        max_arg_count = 0;
+        regs.init(target);
+
+        uint32_t quad_count = routine->quad_count;
+        // NOTE: The counters of instrumented code assume the blocks are in order.
+        counts = nullptr;
+        if (profile && !instrument)
+        {
+            counts = profile->find(routine->name);
+            if (counts && (counts->quad_count != quad_count || quad_count == 0 || counts->counts[0] == 0))
+                counts = nullptr;
+        }
+
+        if (instrument)
         {
-            gen_code((*routine)[i]);
+            counter_of.resize(quad_count + 1);
+            counter_at.resize(quad_count + 1);
+            counter_base = counter_count;
+            counter_count += place_counters(routine, &counter_of[0], &counter_at[0]);
         }
 
+        allocate_registers(routine);
+
+        // main registers the routine that writes the counters when the
+        // program exits. The call keeps the parameter registers.
+        if (instrument && routine->name == Str::make("main"))
+            code.call(profile_symbols[Prof_INIT]);
+
+        gen_entry(routine);
+        gen_blocks(routine);
+
+        if (instrument && counter_at[quad_count] != NO_COUNTER)
+            code.count(counter_base + counter_at[quad_count]);
+
         // NOTE: On windows, when you make a call, there must be 32
         // bytes of shadow space on the stack for the called function
         // to use. This space is for the 4 first parameters if they
@@ -356,39 +1297,152 @@ struct CodeGen
         // are less than 4 parameters.
 
         // Number of 8 byte stack slots needed is the number of spilled
-        // temps plus the maximum number of arguments (at least 4) any
-        // function call inside this routine ever needs.
+        // temps plus the maximum number of stack arguments (and the
+        // shadow space) any function call inside this routine ever needs.
         // That way we don't have to push and pop arguments to and from
         // the stack when we make a call.
         // The stack must have alignment of 16 bytes when a call is made.
         // We ensure this by reserving even number of 8 byte slots from
-        // the stack.
+        // the stack (counting the pushed callee save registers).
+
+        int arg_slots = (int)max_arg_count - regs.param_reg_count;
+        if (arg_slots < 0)
+            arg_slots = 0;
+        arg_slots += shadow_slots();
 
-        int arg_count = max_arg_count;
-        if (arg_count < PARAM_REG_COUNT)
-            arg_count = PARAM_REG_COUNT;
+        write_routine(routine->id, spilled_count + arg_slots);
+    }
 
-        int stack_slots = (spilled_count + arg_count + 1u) & ~1u;
-        code.write_routine(routine->name, stack_slots * 8u); // 8 bytes per stack slot
+    void write_routine(uint32_t routine_id, int stack_slots)
+    {
+        int saved_count = saved_regs.get_size();
+        if ((saved_count + stack_slots) % 2)
+            stack_slots++;
+        uint32_t stack_bytes = stack_slots * 8u; // 8 bytes per stack slot
+        if (encoder)
+            encoder->encode_routine(routine_id, stack_bytes, saved_regs, code.instructions);
+        else
+            code.write_routine(code.routines[routine_id], stack_bytes, saved_regs);
+    }
+
+    /**
+     * Generates the routines of the runtime of instrumented programs.
+     * mug.profile.init registers mug.profile.dump with atexit() and
+     * mug.profile.dump writes the counters to PROFILE_FILE.
+     */
+    void gen_profile_runtime()
+    {
+        regs.init(target);
+        saved_regs.resize(0);
+
+        Register rax = Register::make(Reg_rax);
+        Register param[4];
+        for (int i = 0; i < 4; i++)
+            param[i] = Register::make(regs.param_registers[i]);
+
+        // The parameter registers of main are saved around the call.
+        for (int i = 0; i < regs.param_reg_count; i++)
+            code.store(-8 - 8 * i, Register::make(regs.param_registers[i]));
+        code.lea(param[0], profile_symbols[Prof_DUMP]);
+        code.call(profile_symbols[Prof_ATEXIT]);
+        for (int i = 0; i < regs.param_reg_count; i++)
+            code.load(Register::make(regs.param_registers[i]), -8 - 8 * i);
+        write_routine(profile_symbols[Prof_INIT], regs.param_reg_count + shadow_slots());
+
+        // fwrite(counters, 8, counter_count, fopen(PROFILE_FILE, "wb"))
+        code.lea(param[0], profile_symbols[Prof_FILE]);
+        code.lea(param[1], profile_symbols[Prof_MODE]);
+        code.call(profile_symbols[Prof_FOPEN]);
+        code.cmp(rax, 0);
+        code.je(0);
+        code.store(-8, rax);
+        code.lea_counter(param[0], 0);
+        code.mov(param[1], 8);
+        code.mov(param[2], counter_count);
+        code.mov(param[3], rax);
+        code.call(profile_symbols[Prof_FWRITE]);
+        code.load(param[0], -8);
+        code.call(profile_symbols[Prof_FCLOSE]);
+        code.label(0);
+        write_routine(profile_symbols[Prof_DUMP], 1 + shadow_slots());
     }
 };
 
+/**
+ * Returns true if the program is instrumented. Only programs with
+ * a main function can write their counters.
+ */
+static bool instruments(IR ir, CodeGenOptions options)
+{
+    if (!options.profile_generate)
+        return false;
+    for (Routine *routine = ir.routines->next; routine; routine = routine->next)
+    {
+        if (!routine->external && routine->name == Str::make("main"))
+            return true;
+    }
+    return false;
+}
+
+#define PASTE_PROFILE_SYMBOL(x, name, external) name,
+static const char *profile_symbol_names[] = { PASTE_PROFILE_SYMBOLS };
+#undef PASTE_PROFILE_SYMBOL
+
+#define PASTE_PROFILE_SYMBOL(x, name, external) external,
+static const bool profile_symbol_external[] = { PASTE_PROFILE_SYMBOLS };
+#undef PASTE_PROFILE_SYMBOL
+
+/**
+ * Gives the routine ids of the runtime of instrumented programs. External
+ * routines that the program declares itself keep their ids, the rest are
+ * added to the code (and the encoder) after the routines of the IR.
+ */
+static void add_profile_symbols(IR ir, uint32_t ids[Prof_COUNT], Code &code, Encoder *encoder)
+{
+    for (int i = 0; i < Prof_COUNT; i++)
+    {
+        Str name = Str::make(profile_symbol_names[i]);
+        bool external = profile_symbol_external[i];
+
+        ids[i] = code.routines.get_size();
+        for (Routine *routine = ir.routines->next; routine; routine = routine->next)
+        {
+            if (external && routine->external && routine->name == name)
+                ids[i] = routine->id;
+        }
+
+        if (ids[i] == code.routines.get_size())
+        {
+            code.routine(name);
+            if (encoder)
+                encoder->routine(name, external);
+        }
+    }
+}
+
 //
 //
 //
 
-void gen_code(IR ir, FILE *f)
+bool gen_code(IR ir, FILE *f, CodeGenOptions options)
 {
     if (ir.routines == nullptr || ir.routines->next == nullptr)
     {
         fprintf(stderr, "ir is null!\n");
-        return;
+        return false;
     }
 
 //    print_ir(ir);
 //    fprintf(stdout, "\n\n");
 
-    Code code(f);
+    if (options.direct_obj)
+    {
+        Encoder encoder;
+        encode_code(ir, encoder, options);
+        return write_elf_object(encoder, f);
+    }
+
+    Code code(f, options.target == Target_SYSV);
 
     // TODO: How to handle top level?
     code.routine(Str::make("top.level"));
@@ -408,13 +1462,80 @@ void gen_code(IR ir, FILE *f)
         routine = routine->next;
     }
 
+    CodeGen gen(code, nullptr, options.target);
+    gen.profile = options.profile;
+    gen.instrument = instruments(ir, options);
+    if (gen.instrument)
+    {
+        uint32_t first_id = code.routines.get_size();
+        add_profile_symbols(ir, gen.profile_symbols, code, nullptr);
+        for (uint32_t i = 0; i < Prof_COUNT; i++)
+        {
+            if (gen.profile_symbols[i] >= first_id && profile_symbol_external[i])
+                fprintf(f, "\t" "extern %s\n", profile_symbol_names[i]);
+        }
+    }
+
     fprintf(f, "\t" "section .text\n");
 
-    CodeGen gen(code);
     routine = ir.routines->next;
     while (routine)
     {
         gen.gen_code(routine);
         routine = routine->next;
     }
+
+    if (gen.instrument)
+    {
+        gen.gen_profile_runtime();
+        code.string(code.routines[gen.profile_symbols[Prof_FILE]], PROFILE_FILE);
+        code.string(code.routines[gen.profile_symbols[Prof_MODE]], "wb");
+        fprintf(f, "\t" "section .bss\n");
+        fprintf(f, "\t" "alignb 8\n");
+        fprintf(f, COUNTERS_SYMBOL ":\n");
+        fprintf(f, "\t" "resq %u\n", gen.counter_count);
+    }
+
+    return true;
+}
+
+void encode_code(IR ir, Encoder &encoder, CodeGenOptions options, const bool *selected)
+{
+    Code code(nullptr);
+
+    // TODO: How to handle top level?
+    code.routine(Str::make("top.level"));
+    encoder.routine(Str::make("top.level"), false);
+
+    Routine *routine = ir.routines->next;
+    while (routine)
+    {
+        code.routine(routine->name);
+        encoder.routine(routine->name, routine->external);
+        routine = routine->next;
+    }
+
+    CodeGen gen(code, &encoder, options.target);
+    gen.profile = options.profile;
+    gen.instrument = (selected == nullptr && instruments(ir, options));
+    if (gen.instrument)
+        add_profile_symbols(ir, gen.profile_symbols, code, &encoder);
+
+    routine = ir.routines->next;
+    while (routine)
+    {
+        if (selected == nullptr || selected[routine->id])
+            gen.gen_code(routine);
+        routine = routine->next;
+    }
+
+    if (gen.instrument)
+    {
+        gen.gen_profile_runtime();
+        encoder.data(gen.profile_symbols[Prof_FILE], PROFILE_FILE, sizeof(PROFILE_FILE));
+        encoder.data(gen.profile_symbols[Prof_MODE], "wb", 3);
+        encoder.counter_count = gen.counter_count;
+    }
+
+    encoder.resolve_calls();
 }
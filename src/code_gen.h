@@ -4,9 +4,53 @@
 #include <cstdio>
 
 /**
- * Generates assembly from the given intermediate code and
- * writes the assembly code into the given file.
+ * Calling convention (and object format for nasm) of the generated code.
  */
-void gen_code(struct IR ir, FILE *f);
+enum Target
+{
+    Target_WIN64, // Windows x64: rcx, rdx, r8, r9 and 32 bytes of shadow space
+    Target_SYSV,  // System V AMD64 (Linux): rdi, rsi, rdx, rcx, r8, r9
+};
+
+/**
+ * Options that affect code generation.
+ */
+struct CodeGenOptions
+{
+    Target target;
+
+    // Encode machine code in-process and write an ELF64 object file
+    // instead of writing assembly for NASM.
+    bool direct_obj;
+
+    // Count how many times each block runs and each JZ and JNZ doesn't
+    // jump. The counters are placed like the interpreter places them
+    // (see place_counters()) and written to PROFILE_FILE when the program
+    // exits. Only programs with a main function are instrumented.
+    bool profile_generate;
+
+    // Execution counts that decide the order of the blocks (blocks that
+    // never ran go to the end of the routine) and which temps are spilled
+    // first (the least used ones). Can be null. Not used with profile_generate.
+    struct Profile *profile;
+};
+
+// File where the counters of an instrumented program are written.
+#define PROFILE_FILE "mug.profraw"
+
+/**
+ * Generates assembly (or an object file) from the given intermediate code
+ * and writes it into the given file.
+ * Returns false, if writing the output fails.
+ */
+bool gen_code(struct IR ir, FILE *f, CodeGenOptions options);
+
+/**
+ * Encodes the routines of the given intermediate code into machine code.
+ * If selected is not null, only the routines whose id is selected are
+ * encoded. Calls between the encoded routines are resolved. Calls to
+ * other routines are left in the calls list of the encoder.
+ */
+void encode_code(struct IR ir, struct Encoder &encoder, CodeGenOptions options, const bool *selected = nullptr);
 
 #endif // CODE_GEN_H
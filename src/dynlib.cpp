@@ -0,0 +1,63 @@
+#include "dynlib.h"
+
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+DynLibs::~DynLibs()
+{
+    for (uint32_t i = 0; i < handles.get_size(); i++)
+    {
+#ifdef _WIN32
+        FreeLibrary((HMODULE)handles[i]);
+#else
+        dlclose(handles[i]);
+#endif
+    }
+}
+
+bool DynLibs::open(const char *path)
+{
+#ifdef _WIN32
+    void *handle = (void *)LoadLibraryA(path);
+    if (handle == nullptr)
+    {
+        fprintf(stderr, "error: couldn't open library '%s'\n", path);
+        return false;
+    }
+#else
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr)
+    {
+        fprintf(stderr, "error: couldn't open library '%s': %s\n", path, dlerror());
+        return false;
+    }
+#endif
+
+    handles.push(handle);
+    return true;
+}
+
+void *DynLibs::find(Str name)
+{
+    for (uint32_t i = 0; i < handles.get_size(); i++)
+    {
+#ifdef _WIN32
+        void *address = (void *)GetProcAddress((HMODULE)handles[i], name.data);
+#else
+        void *address = dlsym(handles[i], name.data);
+#endif
+        if (address)
+            return address;
+    }
+
+#ifdef _WIN32
+    return (void *)GetProcAddress(GetModuleHandleA(nullptr), name.data);
+#else
+    return dlsym(RTLD_DEFAULT, name.data);
+#endif
+}
@@ -0,0 +1,30 @@
+#ifndef DYNLIB_H
+#define DYNLIB_H
+
+#include "str.h"
+#include "list.h"
+
+/**
+ * Shared libraries that external routines are looked up from when the
+ * program is run in this process. The libraries are searched in the
+ * order they were opened and the process itself (e.g. the C library)
+ * is searched last.
+ */
+struct DynLibs
+{
+    List<void *> handles;
+
+    ~DynLibs();
+
+    /**
+     * Opens the shared library. Returns false and prints an error if it fails.
+     */
+    bool open(const char *path);
+
+    /**
+     * Returns the address of the function or null if it's not found.
+     */
+    void *find(Str name);
+};
+
+#endif // DYNLIB_H
@@ -0,0 +1,297 @@
+#include "elf_writer.h"
+#include "encoder.h"
+
+// Constants from the ELF64 specification (System V ABI).
+enum
+{
+    ET_REL = 1,
+    EM_X86_64 = 62,
+
+    SHT_PROGBITS = 1,
+    SHT_SYMTAB = 2,
+    SHT_STRTAB = 3,
+    SHT_RELA = 4,
+    SHT_NOBITS = 8,
+
+    SHF_WRITE = 0x1,
+    SHF_ALLOC = 0x2,
+    SHF_EXECINSTR = 0x4,
+    SHF_INFO_LINK = 0x40,
+
+    STB_LOCAL = 0,
+    STB_GLOBAL = 1,
+    STT_NOTYPE = 0,
+    STT_OBJECT = 1,
+    STT_FUNC = 2,
+    STT_SECTION = 3,
+
+    R_X86_64_PC32 = 2,
+    R_X86_64_PLT32 = 4,
+};
+
+// Section indices in the object file.
+enum
+{
+    Sec_NULL,
+    Sec_TEXT,
+    Sec_RELA_TEXT,
+    Sec_SYMTAB,
+    Sec_STRTAB,
+    Sec_SHSTRTAB,
+    Sec_NOTE_GNU_STACK,
+    Sec_BSS, // Only if the code has counters.
+
+    Sec_COUNT
+};
+
+#define EHDR_SIZE 64
+#define SHDR_SIZE 64
+#define SYM_SIZE 24
+#define RELA_SIZE 24
+
+/**
+ * Little endian byte buffer.
+ */
+struct Bytes
+{
+    List<uint8_t> data;
+
+    uint32_t size()
+    {
+        return data.get_size();
+    }
+
+    void u8(uint8_t value)
+    {
+        data.push(value);
+    }
+
+    void u16(uint16_t value)
+    {
+        for (int i = 0; i < 2; i++) u8((uint8_t)(value >> (8 * i)));
+    }
+
+    void u32(uint32_t value)
+    {
+        for (int i = 0; i < 4; i++) u8((uint8_t)(value >> (8 * i)));
+    }
+
+    void u64(uint64_t value)
+    {
+        for (int i = 0; i < 8; i++) u8((uint8_t)(value >> (8 * i)));
+    }
+
+    void bytes(const void *src, uint32_t count)
+    {
+        const uint8_t *p = (const uint8_t *)src;
+        for (uint32_t i = 0; i < count; i++) u8(p[i]);
+    }
+
+    /**
+     * Appends a zero terminated string and returns its offset.
+     */
+    uint32_t str(const char *s, uint32_t len)
+    {
+        uint32_t offset = size();
+        bytes(s, len);
+        u8(0);
+        return offset;
+    }
+
+    void align(uint32_t alignment)
+    {
+        while (size() % alignment) u8(0);
+    }
+};
+
+static void symbol(Bytes &symtab, uint32_t name, uint8_t bind, uint8_t type,
+                   uint16_t shndx, uint64_t value, uint64_t size)
+{
+    symtab.u32(name);
+    symtab.u8((bind << 4) | type);
+    symtab.u8(0); // st_other: default visibility
+    symtab.u16(shndx);
+    symtab.u64(value);
+    symtab.u64(size);
+}
+
+static void section_header(Bytes &out, uint32_t name, uint32_t type, uint64_t flags,
+                           uint64_t offset, uint64_t size, uint32_t link, uint32_t info,
+                           uint64_t alignment, uint64_t entsize)
+{
+    out.u32(name);
+    out.u32(type);
+    out.u64(flags);
+    out.u64(0); // sh_addr
+    out.u64(offset);
+    out.u64(size);
+    out.u32(link);
+    out.u32(info);
+    out.u64(alignment);
+    out.u64(entsize);
+}
+
+bool write_elf_object(Encoder &enc, FILE *f)
+{
+    enc.resolve_calls();
+
+    // Section names.
+
+    Bytes shstrtab;
+    uint32_t sh_names[Sec_COUNT];
+    sh_names[Sec_NULL] = shstrtab.str("", 0);
+    sh_names[Sec_TEXT] = shstrtab.str(".text", 5);
+    sh_names[Sec_RELA_TEXT] = shstrtab.str(".rela.text", 10);
+    sh_names[Sec_SYMTAB] = shstrtab.str(".symtab", 7);
+    sh_names[Sec_STRTAB] = shstrtab.str(".strtab", 7);
+    sh_names[Sec_SHSTRTAB] = shstrtab.str(".shstrtab", 9);
+    sh_names[Sec_NOTE_GNU_STACK] = shstrtab.str(".note.GNU-stack", 15);
+
+    bool has_bss = (enc.counter_count > 0);
+    uint16_t section_count = has_bss ? Sec_COUNT : Sec_BSS;
+    if (has_bss)
+        sh_names[Sec_BSS] = shstrtab.str(".bss", 4);
+
+    // Symbols. Locals must come before globals.
+    // Symbol 0 is the null symbol and symbol 1 is the text section.
+    // Symbol 2 is the bss section if there is one.
+
+    Bytes strtab;
+    strtab.str("", 0);
+
+    Bytes symtab;
+    symbol(symtab, 0, STB_LOCAL, STT_NOTYPE, 0, 0, 0);
+    symbol(symtab, 0, STB_LOCAL, STT_SECTION, Sec_TEXT, 0, 0);
+    uint32_t first_global = 2;
+    if (has_bss)
+    {
+        symbol(symtab, 0, STB_LOCAL, STT_SECTION, Sec_BSS, 0, 0);
+        first_global++;
+    }
+    uint32_t sym_count = first_global;
+
+    List<uint32_t> sym_index; // routine id -> symbol index or 0
+    int routine_count = enc.symbols.get_size();
+    sym_index.resize(routine_count);
+
+    for (int i = 0; i < routine_count; i++)
+    {
+        Encoder::Symbol sym = enc.symbols[i];
+        sym_index[i] = 0;
+
+        if (!sym.defined && !sym.external)
+            continue; // e.g. the top level routine
+
+        uint32_t name = strtab.str(sym.name.data, sym.name.len);
+        if (sym.defined)
+            symbol(symtab, name, STB_GLOBAL, sym.data ? STT_OBJECT : STT_FUNC, Sec_TEXT, sym.offset, sym.size);
+        else
+            symbol(symtab, name, STB_GLOBAL, STT_NOTYPE, 0, 0, 0);
+        sym_index[i] = sym_count++;
+    }
+
+    // Relocations for calls to routines that weren't defined.
+
+    Bytes rela;
+    int call_count = enc.calls.get_size();
+    for (int i = 0; i < call_count; i++)
+    {
+        Encoder::Fixup call = enc.calls[i];
+        uint32_t index = sym_index[call.target];
+        if (index == 0)
+        {
+            fprintf(stderr, "error: call to undefined routine '%s'\n",
+                    enc.symbols[call.target].name.data);
+            return false;
+        }
+        rela.u64(call.offset);
+        rela.u64(((uint64_t)index << 32) | R_X86_64_PLT32);
+        rela.u64((uint64_t)-4); // The displacement is relative to the end of the call.
+    }
+
+    // Relocations for the counters in the bss section.
+
+    int counter_ref_count = enc.counter_refs.get_size();
+    for (int i = 0; i < counter_ref_count; i++)
+    {
+        Encoder::Fixup ref = enc.counter_refs[i];
+        rela.u64(ref.offset);
+        rela.u64(((uint64_t)2 << 32) | R_X86_64_PC32);
+        rela.u64((uint64_t)(8 * (int64_t)ref.target - 4));
+    }
+
+    // Layout: header, section contents, section headers.
+
+    Bytes out;
+    out.data.resize(EHDR_SIZE); // filled in the end
+
+    uint64_t offsets[Sec_COUNT] = {};
+
+    out.align(16);
+    offsets[Sec_TEXT] = out.size();
+    out.bytes(enc.text.data, enc.text.get_size());
+
+    out.align(8);
+    offsets[Sec_RELA_TEXT] = out.size();
+    out.bytes(rela.data.data, rela.size());
+
+    out.align(8);
+    offsets[Sec_SYMTAB] = out.size();
+    out.bytes(symtab.data.data, symtab.size());
+
+    offsets[Sec_STRTAB] = out.size();
+    out.bytes(strtab.data.data, strtab.size());
+
+    offsets[Sec_SHSTRTAB] = out.size();
+    out.bytes(shstrtab.data.data, shstrtab.size());
+
+    offsets[Sec_NOTE_GNU_STACK] = out.size();
+
+    out.align(8);
+    uint64_t shoff = out.size();
+
+    section_header(out, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    section_header(out, sh_names[Sec_TEXT], SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR,
+                   offsets[Sec_TEXT], enc.text.get_size(), 0, 0, 16, 0);
+    section_header(out, sh_names[Sec_RELA_TEXT], SHT_RELA, SHF_INFO_LINK,
+                   offsets[Sec_RELA_TEXT], rela.size(), Sec_SYMTAB, Sec_TEXT, 8, RELA_SIZE);
+    section_header(out, sh_names[Sec_SYMTAB], SHT_SYMTAB, 0,
+                   offsets[Sec_SYMTAB], symtab.size(), Sec_STRTAB, first_global, 8, SYM_SIZE);
+    section_header(out, sh_names[Sec_STRTAB], SHT_STRTAB, 0,
+                   offsets[Sec_STRTAB], strtab.size(), 0, 0, 1, 0);
+    section_header(out, sh_names[Sec_SHSTRTAB], SHT_STRTAB, 0,
+                   offsets[Sec_SHSTRTAB], shstrtab.size(), 0, 0, 1, 0);
+    section_header(out, sh_names[Sec_NOTE_GNU_STACK], SHT_PROGBITS, 0,
+                   offsets[Sec_NOTE_GNU_STACK], 0, 0, 0, 1, 0);
+    if (has_bss)
+        section_header(out, sh_names[Sec_BSS], SHT_NOBITS, SHF_ALLOC | SHF_WRITE,
+                       offsets[Sec_NOTE_GNU_STACK], 8 * (uint64_t)enc.counter_count, 0, 0, 8, 0);
+
+    // ELF header.
+
+    Bytes ehdr;
+    ehdr.u8(0x7f); ehdr.u8('E'); ehdr.u8('L'); ehdr.u8('F');
+    ehdr.u8(2); // ELFCLASS64
+    ehdr.u8(1); // ELFDATA2LSB
+    ehdr.u8(1); // EV_CURRENT
+    ehdr.u8(0); // ELFOSABI_NONE
+    ehdr.align(16);
+    ehdr.u16(ET_REL);
+    ehdr.u16(EM_X86_64);
+    ehdr.u32(1); // e_version
+    ehdr.u64(0); // e_entry
+    ehdr.u64(0); // e_phoff
+    ehdr.u64(shoff);
+    ehdr.u32(0); // e_flags
+    ehdr.u16(EHDR_SIZE);
+    ehdr.u16(0); // e_phentsize
+    ehdr.u16(0); // e_phnum
+    ehdr.u16(SHDR_SIZE);
+    ehdr.u16(section_count);
+    ehdr.u16(Sec_SHSTRTAB);
+    assert(ehdr.size() == EHDR_SIZE);
+
+    memcpy(out.data.data, ehdr.data.data, EHDR_SIZE);
+
+    return fwrite(out.data.data, 1, out.size(), f) == out.size();
+}
@@ -0,0 +1,14 @@
+#ifndef ELF_WRITER_H
+#define ELF_WRITER_H
+
+#include <cstdio>
+
+/**
+ * Writes the encoded routines as a relocatable ELF64 object file.
+ * Defined routines get global symbols and the calls to external
+ * routines get relocations.
+ * Returns false, if writing fails.
+ */
+bool write_elf_object(struct Encoder &enc, FILE *f);
+
+#endif // ELF_WRITER_H
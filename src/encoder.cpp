@@ -0,0 +1,532 @@
+#include "encoder.h"
+
+// Hardware register numbers.
+enum
+{
+    HW_rax = 0,
+    HW_rcx = 1,
+    HW_rdx = 2,
+    HW_rbx = 3,
+    HW_rsp = 4,
+    HW_rbp = 5,
+    HW_rsi = 6,
+    HW_rdi = 7,
+    HW_r8  = 8,
+    HW_r9  = 9,
+    HW_r10 = 10,
+    HW_r11 = 11,
+    HW_r12 = 12,
+    HW_r13 = 13,
+    HW_r14 = 14,
+    HW_r15 = 15,
+};
+
+#define PASTE_REG(r) HW_##r,
+
+static int hw(RegID reg_id)
+{
+    static const int hw_reg[] =
+    {
+        PASTE_REGS
+    };
+
+    assert(reg_id != Reg_NONE);
+    return hw_reg[reg_id];
+}
+
+#undef PASTE_REG
+
+// Condition codes used by jcc and cmovcc.
+enum
+{
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A  = 0x7,
+    CC_L  = 0xc,
+    CC_GE = 0xd,
+    CC_LE = 0xe,
+    CC_G  = 0xf,
+};
+
+static bool fits_int8(int64_t value)
+{
+    return value >= -128 && value <= 127;
+}
+
+static bool fits_int32(int64_t value)
+{
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+/**
+ * REX prefix with W bit set. The reg and rm are hardware register numbers.
+ */
+static void rex_w(Encoder &e, int reg, int rm)
+{
+    e.emit(0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+static void modrm(Encoder &e, int mod, int reg, int rm)
+{
+    e.emit((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+/**
+ * op r/m64, r64 or op r64, r/m64 with register operands only.
+ */
+static void op_reg_reg(Encoder &e, uint8_t opcode, int reg, int rm)
+{
+    rex_w(e, reg, rm);
+    e.emit(opcode);
+    modrm(e, 3, reg, rm);
+}
+
+/**
+ * Two byte opcode version of op_reg_reg (0x0f prefixed).
+ */
+static void op2_reg_reg(Encoder &e, uint8_t opcode, int reg, int rm)
+{
+    rex_w(e, reg, rm);
+    e.emit(0x0f);
+    e.emit(opcode);
+    modrm(e, 3, reg, rm);
+}
+
+/**
+ * Opcodes with an extension in the reg field, e.g. F7 /3 (neg r/m64).
+ */
+static void op_ext_reg(Encoder &e, uint8_t opcode, int ext, int rm)
+{
+    rex_w(e, 0, rm);
+    e.emit(opcode);
+    modrm(e, 3, ext, rm);
+}
+
+/**
+ * Group 1 instructions with an immediate (add, or, adc, sbb, and, sub, xor, cmp).
+ */
+static void op_imm(Encoder &e, int ext, int rm, uint64_t value)
+{
+    int64_t imm = (int64_t)value;
+    assert(fits_int32(imm));
+
+    if (fits_int8(imm))
+    {
+        op_ext_reg(e, 0x83, ext, rm);
+        e.emit((uint8_t)imm);
+    }
+    else
+    {
+        op_ext_reg(e, 0x81, ext, rm);
+        e.emit32((uint32_t)imm);
+    }
+}
+
+/**
+ * op with a memory operand [base + disp]. Base is either rbp or rsp.
+ */
+static void op_mem(Encoder &e, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    rex_w(e, reg, base);
+    e.emit(opcode);
+
+    // NOTE: [rbp] without displacement can't be encoded (it means rip relative)
+    // so rbp always gets at least a disp8. rsp as base always needs a SIB byte.
+    int mod;
+    if (disp == 0 && (base & 7) != HW_rbp)
+        mod = 0;
+    else if (fits_int8(disp))
+        mod = 1;
+    else
+        mod = 2;
+
+    modrm(e, mod, reg, base);
+    if ((base & 7) == HW_rsp)
+        e.emit(0x24);
+
+    if (mod == 1)
+        e.emit((uint8_t)disp);
+    else if (mod == 2)
+        e.emit32((uint32_t)disp);
+}
+
+static void mov_imm(Encoder &e, int reg, uint64_t value)
+{
+    if (value <= UINT32_MAX)
+    {
+        // mov r32, imm32 zero extends to 64 bits.
+        if (reg >> 3)
+            e.emit(0x41);
+        e.emit(0xb8 + (reg & 7));
+        e.emit32((uint32_t)value);
+    }
+    else if (fits_int32((int64_t)value))
+    {
+        op_ext_reg(e, 0xc7, 0, reg);
+        e.emit32((uint32_t)value);
+    }
+    else
+    {
+        rex_w(e, 0, reg);
+        e.emit(0xb8 + (reg & 7));
+        e.emit64(value);
+    }
+}
+
+/**
+ * op with a rip relative memory operand [rip + disp32]. Returns the
+ * offset of the displacement which is relative to the end of the op.
+ */
+static uint32_t op_rip(Encoder &e, uint8_t opcode, int reg)
+{
+    rex_w(e, reg, 0);
+    e.emit(opcode);
+    modrm(e, 0, reg, HW_rbp); // rm 101 without SIB is rip relative
+    uint32_t offset = e.text.get_size();
+    e.emit32(0);
+    return offset;
+}
+
+static void push(Encoder &e, int reg)
+{
+    if (reg >> 3)
+        e.emit(0x41);
+    e.emit(0x50 + (reg & 7));
+}
+
+static void pop(Encoder &e, int reg)
+{
+    if (reg >> 3)
+        e.emit(0x41);
+    e.emit(0x58 + (reg & 7));
+}
+
+static void jump(Encoder &e, int cc, uint32_t label)
+{
+    if (cc < 0)
+    {
+        e.emit(0xe9);
+    }
+    else
+    {
+        e.emit(0x0f);
+        e.emit(0x80 + cc);
+    }
+
+    Encoder::Fixup fixup;
+    fixup.offset = e.text.get_size();
+    fixup.target = label;
+    e.jumps.push(fixup);
+    e.emit32(0);
+}
+
+/**
+ * Restores the saved registers and the stack of the caller.
+ */
+static void epilogue(Encoder &e, uint32_t stack_bytes, List<RegID> &saved_regs)
+{
+    int saved_count = saved_regs.get_size();
+    if (saved_count > 0)
+    {
+        op_ext_reg(e, 0x81, 0, HW_rsp);  // add rsp, imm32
+        e.emit32(stack_bytes);
+        for (int i = saved_count - 1; i >= 0; i--)
+            pop(e, hw(saved_regs[i]));
+    }
+    else
+    {
+        op_reg_reg(e, 0x89, HW_rbp, HW_rsp); // mov rsp, rbp
+    }
+    e.emit(0x5d);                        // pop rbp
+}
+
+// The epilogue gets a label that can't collide with the labels of the IR.
+#define EPI_LABEL 0xffffffff
+
+void Encoder::encode(Instr instr)
+{
+    switch (instr.type)
+    {
+        case Instr::STORE:
+            op_mem(*this, 0x89, hw(instr.oper2.reg_id), HW_rbp, instr.oper1.offset);
+            break;
+        case Instr::LOAD:
+            op_mem(*this, 0x8b, hw(instr.oper1.reg_id), HW_rbp, instr.oper2.offset);
+            break;
+        case Instr::MOV_IM:
+            mov_imm(*this, hw(instr.oper1.reg_id), instr.oper2.value);
+            break;
+        case Instr::XOR_IM:
+            op_imm(*this, 6, hw(instr.oper1.reg_id), instr.oper2.value);
+            break;
+        case Instr::CMP_IM:
+            op_imm(*this, 7, hw(instr.oper1.reg_id), instr.oper2.value);
+            break;
+        case Instr::NEG:
+            op_ext_reg(*this, 0xf7, 3, hw(instr.oper1.reg_id));
+            break;
+        case Instr::MUL:
+            op_ext_reg(*this, 0xf7, 4, hw(instr.oper1.reg_id));
+            break;
+        case Instr::IMUL:
+            op_ext_reg(*this, 0xf7, 5, hw(instr.oper1.reg_id));
+            break;
+        case Instr::IMUL_REG:
+            op2_reg_reg(*this, 0xaf, hw(instr.oper1.reg_id), hw(instr.oper2.reg_id));
+            break;
+        case Instr::IMUL_IM:
+        {
+            int64_t imm = (int64_t)instr.oper3.value;
+            assert(fits_int32(imm));
+            op_reg_reg(*this, fits_int8(imm) ? 0x6b : 0x69, hw(instr.oper1.reg_id), hw(instr.oper2.reg_id));
+            if (fits_int8(imm))
+                emit((uint8_t)imm);
+            else
+                emit32((uint32_t)imm);
+            break;
+        }
+        case Instr::DIV:
+            op_ext_reg(*this, 0xf7, 6, hw(instr.oper1.reg_id));
+            break;
+        case Instr::IDIV:
+            op_ext_reg(*this, 0xf7, 7, hw(instr.oper1.reg_id));
+            break;
+        case Instr::CQO:
+            emit(0x48);
+            emit(0x99);
+            break;
+        case Instr::SHL:
+        case Instr::SHR:
+        case Instr::SAR:
+        {
+            int ext = (instr.type == Instr::SHL) ? 4 : (instr.type == Instr::SHR) ? 5 : 7;
+            op_ext_reg(*this, 0xc1, ext, hw(instr.oper1.reg_id));
+            emit((uint8_t)instr.oper2.value);
+            break;
+        }
+        case Instr::LEA_MUL:
+        {
+            // lea r, [r + r * scale]: the register is both the base and
+            // the index of a SIB byte. rbp and r13 as base need a disp8.
+            int reg = hw(instr.oper1.reg_id);
+            int high = reg >> 3;
+            int scale = (instr.oper2.value == 2) ? 1 : (instr.oper2.value == 4) ? 2 : 3;
+            bool disp = (reg & 7) == HW_rbp;
+            emit(0x48 | (high << 2) | (high << 1) | high);
+            emit(0x8d);
+            modrm(*this, disp ? 1 : 0, reg, HW_rsp); // rm 100 means a SIB byte follows
+            emit((scale << 6) | ((reg & 7) << 3) | (reg & 7));
+            if (disp)
+                emit(0);
+            break;
+        }
+
+        // op r/m64, r64: oper1 goes to the rm field.
+        case Instr::MOV:
+        case Instr::XOR:
+        case Instr::ADD:
+        case Instr::SUB:
+        case Instr::CMP:
+        {
+            uint8_t opcode = 0;
+            switch (instr.type)
+            {
+                case Instr::MOV: opcode = 0x89; break;
+                case Instr::XOR: opcode = 0x31; break;
+                case Instr::ADD: opcode = 0x01; break;
+                case Instr::SUB: opcode = 0x29; break;
+                case Instr::CMP: opcode = 0x39; break;
+                InvalidDefaultCase;
+            }
+            op_reg_reg(*this, opcode, hw(instr.oper2.reg_id), hw(instr.oper1.reg_id));
+            break;
+        }
+
+        // cmovcc r64, r/m64: oper1 goes to the reg field.
+        case Instr::CMOVE:  case Instr::CMOVNE:
+        case Instr::CMOVL:  case Instr::CMOVB:
+        case Instr::CMOVG:  case Instr::CMOVA:
+        case Instr::CMOVLE: case Instr::CMOVBE:
+        case Instr::CMOVGE: case Instr::CMOVAE:
+        {
+            int cc = 0;
+            switch (instr.type)
+            {
+                case Instr::CMOVE:  cc = CC_E;  break;
+                case Instr::CMOVNE: cc = CC_NE; break;
+                case Instr::CMOVL:  cc = CC_L;  break;
+                case Instr::CMOVB:  cc = CC_B;  break;
+                case Instr::CMOVG:  cc = CC_G;  break;
+                case Instr::CMOVA:  cc = CC_A;  break;
+                case Instr::CMOVLE: cc = CC_LE; break;
+                case Instr::CMOVBE: cc = CC_BE; break;
+                case Instr::CMOVGE: cc = CC_GE; break;
+                case Instr::CMOVAE: cc = CC_AE; break;
+                InvalidDefaultCase;
+            }
+            op2_reg_reg(*this, 0x40 + cc, hw(instr.oper1.reg_id), hw(instr.oper2.reg_id));
+            break;
+        }
+
+        case Instr::LABEL:
+            if (labels.get_size() < instr.oper1.label + 1)
+            {
+                uint32_t old_size = labels.get_size();
+                labels.resize(instr.oper1.label + 1);
+                for (uint32_t i = old_size; i < labels.get_size(); i++)
+                    labels[i] = -1;
+            }
+            labels[instr.oper1.label] = text.get_size();
+            break;
+        case Instr::JMP_EPI:
+            jump(*this, -1, EPI_LABEL);
+            break;
+        case Instr::JMP:
+            jump(*this, -1, instr.oper1.label);
+            break;
+        case Instr::JE:  case Instr::JNE:
+        case Instr::JL:  case Instr::JB:
+        case Instr::JG:  case Instr::JA:
+        case Instr::JLE: case Instr::JBE:
+        case Instr::JGE: case Instr::JAE:
+        {
+            int cc = 0;
+            switch (instr.type)
+            {
+                case Instr::JE:  cc = CC_E;  break;
+                case Instr::JNE: cc = CC_NE; break;
+                case Instr::JL:  cc = CC_L;  break;
+                case Instr::JB:  cc = CC_B;  break;
+                case Instr::JG:  cc = CC_G;  break;
+                case Instr::JA:  cc = CC_A;  break;
+                case Instr::JLE: cc = CC_LE; break;
+                case Instr::JBE: cc = CC_BE; break;
+                case Instr::JGE: cc = CC_GE; break;
+                case Instr::JAE: cc = CC_AE; break;
+                InvalidDefaultCase;
+            }
+            jump(*this, cc, instr.oper1.label);
+            break;
+        }
+        case Instr::SET_ARG:
+            op_mem(*this, 0x89, hw(instr.oper2.reg_id), HW_rsp, instr.oper1.offset);
+            break;
+        case Instr::CALL:
+        case Instr::TAIL_CALL:
+        {
+            // call rel32 or jmp rel32 after the epilogue.
+            emit(instr.type == Instr::CALL ? 0xe8 : 0xe9);
+            Fixup fixup;
+            fixup.offset = text.get_size();
+            fixup.target = instr.oper1.routine;
+            calls.push(fixup);
+            emit32(0);
+            break;
+        }
+        case Instr::LEA:
+        {
+            Fixup fixup;
+            fixup.offset = op_rip(*this, 0x8d, hw(instr.oper1.reg_id));
+            fixup.target = instr.oper2.routine;
+            calls.push(fixup);
+            break;
+        }
+        case Instr::LEA_COUNTER:
+        case Instr::COUNT:
+        {
+            // lea r64, m or inc r/m64 (FF /0)
+            Fixup fixup;
+            if (instr.type == Instr::LEA_COUNTER)
+            {
+                fixup.offset = op_rip(*this, 0x8d, hw(instr.oper1.reg_id));
+                fixup.target = (uint32_t)instr.oper2.value;
+            }
+            else
+            {
+                fixup.offset = op_rip(*this, 0xff, 0);
+                fixup.target = (uint32_t)instr.oper1.value;
+            }
+            counter_refs.push(fixup);
+            break;
+        }
+    }
+}
+
+void Encoder::encode_routine(uint32_t routine_id, uint32_t stack_bytes,
+                             List<RegID> &saved_regs, List<Instr> &instructions)
+{
+    int saved_count = saved_regs.get_size();
+
+    // Routines are aligned to 16 bytes like NASM does with section .text.
+    while (text.get_size() % 16)
+        emit(0x90); // nop
+
+    Symbol &sym = symbols[routine_id];
+    sym.offset = text.get_size();
+    sym.defined = true;
+
+    labels.resize(0);
+    jumps.resize(0);
+
+    emit(0x55);                             // push rbp
+    op_reg_reg(*this, 0x89, HW_rsp, HW_rbp); // mov rbp, rsp
+    for (int i = 0; i < saved_count; i++)
+        push(*this, hw(saved_regs[i]));
+    op_ext_reg(*this, 0x81, 5, HW_rsp);      // sub rsp, imm32
+    emit32(stack_bytes);
+
+    int instr_count = instructions.get_size();
+    for (int i = 0; i < instr_count; i++)
+    {
+        if (instructions[i].type == Instr::TAIL_CALL)
+            epilogue(*this, stack_bytes, saved_regs);
+        encode(instructions[i]);
+    }
+
+    int32_t epi_offset = text.get_size();
+    epilogue(*this, stack_bytes, saved_regs);
+    emit(0xc3);                              // ret
+
+    int jump_count = jumps.get_size();
+    for (int i = 0; i < jump_count; i++)
+    {
+        Fixup fixup = jumps[i];
+        int32_t target;
+        if (fixup.target == EPI_LABEL)
+            target = epi_offset;
+        else
+            target = labels[fixup.target];
+        assert(target >= 0);
+        // The displacement is relative to the end of the jump instruction.
+        patch32(fixup.offset, (uint32_t)(target - (int32_t)(fixup.offset + 4)));
+    }
+
+    symbols[routine_id].size = text.get_size() - symbols[routine_id].offset;
+
+    instructions.resize(0);
+}
+
+#undef EPI_LABEL
+
+void Encoder::resolve_calls()
+{
+    uint32_t unresolved = 0;
+    int call_count = calls.get_size();
+    for (int i = 0; i < call_count; i++)
+    {
+        Fixup fixup = calls[i];
+        Symbol sym = symbols[fixup.target];
+        if (sym.defined)
+        {
+            patch32(fixup.offset, sym.offset - (fixup.offset + 4));
+        }
+        else
+        {
+            calls[unresolved++] = fixup;
+        }
+    }
+    calls.resize(unresolved);
+}
@@ -0,0 +1,121 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include "str.h"
+#include "register_alloc.h"
+#include "code.h"
+
+/**
+ * Encodes instructions straight into AMD64 machine code.
+ * All routines are placed one after another into a single text buffer.
+ *
+ * Jumps inside a routine are resolved when the routine is done.
+ * Calls are recorded and resolve_calls() patches the ones that target
+ * routines defined in the same buffer. Calls to external routines are
+ * left for the user of the encoder (e.g. object file writer) to handle.
+ * Loads of routine addresses (LEA) are recorded and patched like calls.
+ *
+ * Instrumented code addresses a table of counter_count 64 bit counters
+ * that is not in the text buffer. The displacements are left for the
+ * object file writer.
+ */
+struct Encoder
+{
+    struct Symbol
+    {
+        Str name;
+        uint32_t offset; // Offset of the routine in the text buffer.
+        uint32_t size;
+        bool defined;    // The routine has been encoded.
+        bool external;
+        bool data;       // Bytes that aren't code, e.g. a string.
+    };
+
+    /**
+     * Location of a 32 bit displacement that needs to be patched.
+     */
+    struct Fixup
+    {
+        uint32_t offset;
+        uint32_t target; // label, routine id or counter
+    };
+
+    List<uint8_t> text;
+    List<Symbol> symbols;   // Can be indexed with routine ids.
+    List<Fixup> calls;      // Call sites. Target is a routine id.
+    List<Fixup> jumps;      // Jumps inside the current routine. Target is a label.
+    List<int32_t> labels;   // Label offsets of the current routine or -1.
+    List<Fixup> counter_refs; // Displacements to the counters. Target is a counter.
+    uint32_t counter_count;
+
+    Encoder()
+    : counter_count()
+    {}
+
+    void routine(Str name, bool external)
+    {
+        Symbol sym;
+        sym.name = name;
+        sym.offset = 0;
+        sym.size = 0;
+        sym.defined = false;
+        sym.external = external;
+        sym.data = false;
+        symbols.push(sym);
+    }
+
+    /**
+     * Places the bytes at the end of the text buffer as the symbol with the
+     * given id. The symbol is added with routine() and addressed like one.
+     */
+    void data(uint32_t symbol_id, const void *bytes, uint32_t size)
+    {
+        Symbol &sym = symbols[symbol_id];
+        sym.offset = text.get_size();
+        sym.size = size;
+        sym.defined = true;
+        sym.data = true;
+        for (uint32_t i = 0; i < size; i++)
+            emit(((const uint8_t *)bytes)[i]);
+    }
+
+    /**
+     * Encodes the instructions of the given routine and empties the list of instructions.
+     * The prologue and the epilogue are the same as in Code::write_routine().
+     */
+    void encode_routine(uint32_t routine_id, uint32_t stack_bytes,
+                        List<RegID> &saved_regs, List<Instr> &instructions);
+
+    /**
+     * Patches calls to the routines that are defined.
+     * Calls to routines not defined are left in the calls list.
+     */
+    void resolve_calls();
+
+    void emit(uint8_t byte)
+    {
+        text.push(byte);
+    }
+
+    void emit32(uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+            emit((uint8_t)(value >> (8 * i)));
+    }
+
+    void emit64(uint64_t value)
+    {
+        for (int i = 0; i < 8; i++)
+            emit((uint8_t)(value >> (8 * i)));
+    }
+
+    void patch32(uint32_t offset, uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+            text[offset + i] = (uint8_t)(value >> (8 * i));
+    }
+
+    void encode(Instr instr);
+};
+
+#endif // ENCODER_H
@@ -1,10 +1,12 @@
 #include "ir.h"
 #include "ast.h"
 #include "sym_table.h"
+#include "list.h"
 #include "alloc.h"
 #include "assert.h"
 
 #include <cstdio>
+#include <cstring>
 #include <cinttypes>
 #include <new> // to placement new routines
 
@@ -32,36 +34,209 @@ const char *IR::get_str(Type type)
 // Routine
 //
 
-Quad *Routine::add(Quad quad)
+uint32_t Routine::add(Quad quad)
 {
-    uint32_t n = quad_count % Quads::N;
+    if (quad_count == quad_capacity)
+    {
+        // NOTE: The old array is left to the allocator.
+        uint32_t capacity = quad_capacity ? quad_capacity * 2 : 64;
+        Quad *array = a.allocate_array<Quad>(capacity);
+        if (quad_count > 0)
+            memcpy(array, quads, sizeof(Quad) * quad_count);
+        quads = array;
+        quad_capacity = capacity;
+    }
+
+    quads[quad_count] = quad;
+    return quad_count++;
+}
 
-    if (n == 0)
+int get_use_operands(Quad &quad, Operand *uses[2])
+{
+    switch (quad.op)
     {
-        Quads *quads = a.allocate<Quads>();
-        quads->next = nullptr;
-        if (head == nullptr)
-             head = quads;
-        else tail->next = quads;
-        tail = quads;
+        case IR::MOV_IM:
+        case IR::JMP:
+        case IR::LABEL:
+        case IR::CALL:
+        case IR::NOP:
+            return 0;
+        case IR::MOV:
+        case IR::NOT:
+        case IR::NEG:
+        case IR::JZ:
+        case IR::JNZ:
+        case IR::ARG:
+            uses[0] = &quad.left;
+            return 1;
+        case IR::MUL: case IR::IMUL:
+        case IR::DIV: case IR::IDIV:
+        case IR::ADD: case IR::SUB:
+        case IR::EQ: case IR::NE:
+        case IR::LT: case IR::BELOW:
+        case IR::GT: case IR::ABOVE:
+        case IR::LE: case IR::BE:
+        case IR::GE: case IR::AE:
+            uses[0] = &quad.left;
+            uses[1] = &quad.right;
+            return 2;
+        case IR::RET:
+            if (!quad.target.returns_something)
+                return 0;
+            uses[0] = &quad.left;
+            return 1;
     }
 
-    Quad *q = tail->quads + n;
-    *q = quad;
-    quad_count++;
-    return q;
+    InvalidCodePath;
+    return 0;
+}
+
+int get_uses(Quad quad, uint32_t uses[2])
+{
+    Operand *operands[2];
+    int count = get_use_operands(quad, operands);
+    for (int i = 0; i < count; i++)
+        uses[i] = operands[i]->temp_id;
+    return count;
 }
 
-Quad &Routine::operator [] (uint32_t index)
+bool get_def(Quad quad, uint32_t *def)
 {
-    assert(index < quad_count);
-    Quads *quads = head;
-    uint32_t n = index / Quads::N;
-    while (n --> 0) // haha
-        quads = quads->next;
-    return quads->quads[index % Quads::N];
+    switch (quad.op)
+    {
+        case IR::MOV_IM:
+        case IR::MOV:
+        case IR::NOT:
+        case IR::NEG:
+        case IR::MUL: case IR::IMUL:
+        case IR::DIV: case IR::IDIV:
+        case IR::ADD: case IR::SUB:
+        case IR::EQ: case IR::NE:
+        case IR::LT: case IR::BELOW:
+        case IR::GT: case IR::ABOVE:
+        case IR::LE: case IR::BE:
+        case IR::GE: case IR::AE:
+        case IR::CALL:
+            *def = quad.target.temp_id;
+            return true;
+        default:
+            return false;
+    }
+}
+
+void update_blocks(Routine *routine)
+{
+    uint32_t quad_count = routine->quad_count;
+
+    // Mark the leaders.
+    List<int32_t> block_of; // quad index -> block index (only for leaders)
+    block_of.resize(quad_count);
+    for (uint32_t i = 0; i < quad_count; i++)
+        block_of[i] = -1;
+
+    // The table never has more blocks than quads.
+    if (routine->block_capacity < quad_count)
+    {
+        // NOTE: The old table is left to the allocator.
+        routine->blocks = routine->a.allocate_array<BasicBlock>(quad_count);
+        routine->block_capacity = quad_count;
+    }
+    BasicBlock *blocks = routine->blocks;
+    uint32_t block_count = 0;
+
+    bool leader = true;
+    for (uint32_t i = 0; i < quad_count; i++)
+    {
+        Quad quad = (*routine)[i];
+        if (leader || quad.op == IR::LABEL)
+        {
+            if (block_count > 0)
+                blocks[block_count - 1].end = i;
+
+            BasicBlock block;
+            block.start = i;
+            block.end = quad_count;
+            block.succ[0] = -1;
+            block.succ[1] = -1;
+            block_of[i] = block_count;
+            blocks[block_count++] = block;
+        }
+
+        leader = (quad.op == IR::JMP || quad.op == IR::JZ ||
+                  quad.op == IR::JNZ || quad.op == IR::RET);
+    }
+
+    // Connect the blocks.
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        BasicBlock &block = blocks[b];
+        Quad last = (*routine)[block.end - 1];
+        int32_t next = (b + 1 < block_count) ? (int32_t)(b + 1) : -1;
+
+        switch (last.op)
+        {
+            case IR::JMP:
+                block.succ[0] = block_of[last.target.label];
+                break;
+            case IR::JZ:
+            case IR::JNZ:
+                block.succ[0] = next;
+                block.succ[1] = block_of[last.target.label];
+                if (block.succ[1] == next)
+                    block.succ[1] = -1; // Jump to the next block.
+                break;
+            case IR::RET:
+                break;
+            default:
+                block.succ[0] = next;
+                break;
+        }
+    }
+
+    routine->block_count = block_count;
 }
 
+void set_quads(Routine *routine, List<Quad> &quads)
+{
+    uint32_t count = quads.get_size();
+
+    uint32_t label_count = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (quads[i].op == IR::LABEL && quads[i].target.label >= label_count)
+            label_count = quads[i].target.label + 1;
+    }
+
+    List<uint32_t> new_label;
+    new_label.resize(label_count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (quads[i].op == IR::LABEL)
+            new_label[quads[i].target.label] = i;
+    }
+
+    routine->quad_count = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        Quad quad = quads[i];
+        switch (quad.op)
+        {
+            case IR::LABEL:
+            case IR::JMP:
+            case IR::JZ:
+            case IR::JNZ:
+                assert(quad.target.label < label_count);
+                quad.target.label = new_label[quad.target.label];
+                break;
+            default:
+                break;
+        }
+        routine->add(quad);
+    }
+
+    update_blocks(routine);
+}
 
 /**
  * Generates intermediate code from AST.
@@ -125,14 +300,21 @@ struct IRGen
 
             case ExpType_CALL:
             {
-                ArgList *arg = exp->call.args;
-                for (uint32_t index = 0; arg; index++)
+                // NOTE: All arguments are evaluated before the ARG quads
+                // so that the ARG quads of nested calls don't get mixed up
+                // and the ARG quads are always right before their CALL quad.
+                List<Operand> values;
+                for (ArgList *arg = exp->call.args; arg; arg = arg->next)
+                {
+                    values.push(gen_ir(r, arg->arg));
+                }
+
+                uint32_t arg_count = values.get_size();
+                for (uint32_t index = 0; index < arg_count; index++)
                 {
                     Operand arg_idx;
                     arg_idx.arg_index = index;
-                    Operand value = gen_ir(r, arg->arg);
-                    r.add(IR::ARG, arg_idx, value);
-                    arg = arg->next;
+                    r.add(IR::ARG, arg_idx, values[index]);
                 }
 
                 Operand result = r.make_temp();
@@ -211,19 +393,21 @@ struct IRGen
                     case BinaryOp_AND:
                     {
                         r.add(IR::MOV, result, left);
-                        Quad *jz_quad = r.add(IR::JZ, {}, result);
+                        uint32_t jz_quad = r.add(IR::JZ, {}, result);
                         right = gen_ir(r, exp->binary.right);
                         r.add(IR::MOV, result, right);
-                        jz_quad->target = r.make_label();
+                        Operand label = r.make_label();
+                        r[jz_quad].target = label;
                         break;
                     }
                     case BinaryOp_OR:
                     {
                         r.add(IR::MOV, result, left);
-                        Quad *jnz_quad = r.add(IR::JNZ, {}, result);
+                        uint32_t jnz_quad = r.add(IR::JNZ, {}, result);
                         right = gen_ir(r, exp->binary.right);
                         r.add(IR::MOV, result, right);
-                        jnz_quad->target = r.make_label();
+                        Operand label = r.make_label();
+                        r[jnz_quad].target = label;
                         break;
                     }
                 }
@@ -251,11 +435,8 @@ struct IRGen
                 Operand var;
                 var = sym.get(node->assign.var_name);
                 Operand value = gen_ir(r, node->assign.value);
-                // TODO: If gen_ir(exp) always generates a quad with a new temp as target,
-                // we could replace that quad's target with the var and not add this mov quad.
-                // By doing that, we wouldn't get useless movs here, BUT
-                // think about expressions that use vars e.g. "(x + y) * z"!
-                // They would generate unnecessary movs.
+                // NOTE: The mov is removed by copy propagation and coalescing
+                // (see ir_opt.h) when the value and the var can share a temp.
                 r.add(IR::MOV, var, value);
                 break;
             }
@@ -265,6 +446,14 @@ struct IRGen
                 if (node->decl.init)
                 {
                     Operand init = gen_ir(r, node->decl.init);
+                    if (node->decl.init->type == ExpType_VAR)
+                    {
+                        // The init is the temp of another variable.
+                        // Copy it so that assigning to one doesn't change the other.
+                        Operand var = r.make_temp();
+                        r.add(IR::MOV, var, init);
+                        init = var;
+                    }
                     sym.put(node->decl.var_name, init);
                 }
                 else
@@ -294,18 +483,21 @@ struct IRGen
             case NodeType_IF:
             {
                 Operand condition = gen_ir(r, node->if_stmt.condition);
-                Quad *jz_quad = r.add(IR::JZ, {}, condition);
+                uint32_t jz_quad = r.add(IR::JZ, {}, condition);
                 gen_ir(r, node->if_stmt.true_stmt);
                 if (node->if_stmt.else_stmt)
                 {
-                    Quad *jmp_quad = r.add(IR::JMP);
-                    jz_quad->target = r.make_label();
+                    uint32_t jmp_quad = r.add(IR::JMP);
+                    Operand else_label = r.make_label();
+                    r[jz_quad].target = else_label;
                     gen_ir(r, node->if_stmt.else_stmt);
-                    jmp_quad->target = r.make_label();
+                    Operand end_label = r.make_label();
+                    r[jmp_quad].target = end_label;
                 }
                 else
                 {
-                    jz_quad->target = r.make_label();
+                    Operand end_label = r.make_label();
+                    r[jz_quad].target = end_label;
                 }
                 break;
             }
@@ -314,10 +506,11 @@ struct IRGen
             {
                 Operand label = r.make_label();
                 Operand condition = gen_ir(r, node->while_stmt.condition);
-                Quad *jz_quad = r.add(IR::JZ, {}, condition);
+                uint32_t jz_quad = r.add(IR::JZ, {}, condition);
                 gen_ir(r, node->while_stmt.stmt);
                 r.add(IR::JMP, label);
-                jz_quad->target = r.make_label();
+                Operand end_label = r.make_label();
+                r[jz_quad].target = end_label;
                 break;
             }
 
@@ -345,6 +538,8 @@ struct IRGen
 
                 if (node->func_def.body == nullptr)
                 {
+                    for (ParamList *p = node->func_def.params; p; p = p->next)
+                        routine->param_count++;
                     routine->external = true;
                     break;
                 }
@@ -375,6 +570,9 @@ struct IRGen
         Routine *top_level = make_routine(Str::make("@top_level"));
         gen_ir(*top_level, ast.root);
 
+        for (Routine *routine = top_level; routine; routine = routine->next)
+            update_blocks(routine);
+
         IR ir;
         ir.routines = top_level;
         return ir;
@@ -441,6 +639,9 @@ void print_ir(Routine *routine)
         case IR::ARG:
             fprintf(stdout, "arg%u \ttemp%u \t-\n", quad.target.arg_index, quad.left.temp_id);
             break;
+        case IR::NOP:
+            fprintf(stdout, "- \t- \t-\n");
+            break;
         }
     }
 }
@@ -3,6 +3,7 @@
 
 #include "ir_gen.h"
 #include "str.h"
+#include "list.h"
 
 union Operand
 {
@@ -23,14 +24,14 @@ struct Quad
 };
 
 /**
- * Routine containes linked list of quad blocks.
- * One block contains 64 quads.
+ * Basic block of quads [start, end).
  */
-struct Quads
+struct BasicBlock
 {
-    static const uint32_t N = 64;
-    Quad quads[N];
-    Quads *next;
+    uint32_t start;
+    uint32_t end;
+    int32_t succ[2]; // Successor block indices or -1.
+                     // For JZ/JNZ succ[0] is the next block and succ[1] the jump target.
 };
 
 /**
@@ -46,6 +47,10 @@ struct Quads
  * All temps inside a routine have similarly ids that
  * can be used as indices. Params and vars are temps.
  * Params have the first ids (from 0 to param_count - 1).
+ *
+ * Quads are stored in one array in the arena. When the array
+ * is full, the quads are copied to an array twice as big.
+ * The basic block table is computed by update_blocks().
  */
 struct Routine
 {
@@ -53,8 +58,12 @@ struct Routine
     uint32_t param_count;
 
     uint32_t quad_count;
-    Quads *head;
-    Quads *tail;
+    uint32_t quad_capacity;
+    Quad *quads;
+
+    uint32_t block_count;
+    uint32_t block_capacity;
+    BasicBlock *blocks;
 
     Str name;
     uint32_t id;
@@ -68,8 +77,11 @@ struct Routine
     : temp_count()
     , param_count()
     , quad_count()
-    , head()
-    , tail()
+    , quad_capacity()
+    , quads()
+    , block_count()
+    , block_capacity()
+    , blocks()
     , name(name_)
     , id(id_)
     , next()
@@ -92,18 +104,61 @@ struct Routine
         return result;
     }
 
-    Quad *add(Quad quad);
+    /**
+     * Adds the quad to the end and returns its index.
+     * NOTE: Adding can move the quads so don't keep pointers to them.
+     */
+    uint32_t add(Quad quad);
 
-    Quad *add(IR::Type op)
+    uint32_t add(IR::Type op)
     { return add((Quad){op, {}, {}, {}}); }
-    Quad *add(IR::Type op, Operand target)
+    uint32_t add(IR::Type op, Operand target)
     { return add((Quad){op, target, {}, {}}); }
-    Quad *add(IR::Type op, Operand target, Operand operand)
+    uint32_t add(IR::Type op, Operand target, Operand operand)
     { return add((Quad){op, target, operand, {}}); }
-    Quad *add(IR::Type op, Operand target, Operand left, Operand right)
+    uint32_t add(IR::Type op, Operand target, Operand left, Operand right)
     { return add((Quad){op, target, left, right}); }
 
-    Quad &operator [] (uint32_t index);
+    Quad &operator [] (uint32_t index)
+    {
+        assert(index < quad_count);
+        return quads[index];
+    }
+
+    Quad *begin() { return quads; }
+    Quad *end() { return quads + quad_count; }
 };
 
+/**
+ * Gets the temps the quad reads. Returns the number of temps (0 to 2).
+ * NOTE: ARG quads read their temp, but the value is passed
+ * at the CALL quad that follows the ARG quads.
+ */
+int get_uses(Quad quad, uint32_t uses[2]);
+
+/**
+ * Same as get_uses() but gives the operands so that they can be renamed.
+ */
+int get_use_operands(Quad &quad, Operand *uses[2]);
+
+/**
+ * Gets the temp the quad writes. Returns false, if the quad doesn't write a temp.
+ */
+bool get_def(Quad quad, uint32_t *def);
+
+/**
+ * Splits the quads of the routine into basic blocks.
+ * A block starts at the first quad, at a LABEL, or after a jump or a RET.
+ * Must be called after the jumps of the routine are changed.
+ * NOTE: set_quads() calls this.
+ */
+void update_blocks(Routine *routine);
+
+/**
+ * Replaces the quads of the routine with the given ones.
+ * The labels in the given quads can be any unique numbers. They are
+ * renumbered to be the indices of the LABEL quads as make_label() does.
+ */
+void set_quads(Routine *routine, List<Quad> &quads);
+
 #endif // IR_H
@@ -0,0 +1,222 @@
+#include "ir_cfg.h"
+#include "assert.h"
+
+void make_lists(uint32_t list_count, List<uint32_t> &from, List<uint32_t> &to,
+                List<uint32_t> &start, List<uint32_t> &items)
+{
+    uint32_t count = from.get_size();
+
+    start.resize(list_count + 1);
+    for (uint32_t n = 0; n <= list_count; n++)
+        start[n] = 0;
+    for (uint32_t i = 0; i < count; i++)
+        start[from[i] + 1] += 1;
+    for (uint32_t n = 0; n < list_count; n++)
+        start[n + 1] += start[n];
+
+    List<uint32_t> next;
+    next.resize(list_count);
+    for (uint32_t n = 0; n < list_count; n++)
+        next[n] = start[n];
+
+    items.resize(count);
+    for (uint32_t i = 0; i < count; i++)
+        items[next[from[i]]++] = to[i];
+}
+
+void CFG::build(Routine *routine)
+{
+    blocks = routine->blocks;
+    count = routine->block_count;
+
+    block_of.resize(routine->quad_count);
+    for (uint32_t b = 0; b < count; b++)
+    {
+        for (uint32_t i = blocks[b].start; i < blocks[b].end; i++)
+            block_of[i] = b;
+    }
+
+    // Predecessors.
+    List<uint32_t> from;
+    List<uint32_t> to;
+    for (uint32_t b = 0; b < count; b++)
+    {
+        for (int k = 0; k < 2; k++)
+        {
+            int32_t s = blocks[b].succ[k];
+            if (s < 0) continue;
+            from.push(s);
+            to.push(b);
+        }
+    }
+    make_lists(count, from, to, pred_start, preds);
+
+    // Depth first search from the entry for the reverse postorder.
+    rpo.resize(0);
+    List<int32_t> order; // block -> index in rpo, -1 if unreachable
+    order.resize(count);
+    for (uint32_t b = 0; b < count; b++)
+        order[b] = -1;
+
+    if (count > 0)
+    {
+        List<uint32_t> post;
+        List<uint32_t> stack;
+        List<int> next_succ;
+        List<bool> visited;
+        visited.resize(count);
+        for (uint32_t b = 0; b < count; b++)
+            visited[b] = false;
+
+        stack.push(0);
+        next_succ.push(0);
+        visited[0] = true;
+        while (stack.get_size() > 0)
+        {
+            uint32_t top = stack.get_size() - 1;
+            uint32_t b = stack[top];
+            int k = next_succ[top]++;
+            if (k < 2)
+            {
+                int32_t s = blocks[b].succ[k];
+                if (s >= 0 && !visited[s])
+                {
+                    visited[s] = true;
+                    stack.push(s);
+                    next_succ.push(0);
+                }
+                continue;
+            }
+            post.push(b);
+            stack.pop();
+            next_succ.pop();
+        }
+
+        for (uint32_t i = post.get_size(); i > 0; i--)
+        {
+            order[post[i - 1]] = rpo.get_size();
+            rpo.push(post[i - 1]);
+        }
+    }
+
+    // Dominators with the iterative algorithm by Cooper, Harvey and Kennedy
+    // (A Simple, Fast Dominance Algorithm). The entry is its own dominator
+    // until the end.
+    idom.resize(count);
+    for (uint32_t b = 0; b < count; b++)
+        idom[b] = -1;
+    if (count > 0)
+        idom[0] = 0;
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (uint32_t i = 1; i < rpo.get_size(); i++)
+        {
+            uint32_t b = rpo[i];
+            int32_t new_idom = -1;
+            for (uint32_t k = 0; k < pred_count(b); k++)
+            {
+                int32_t p = pred(b, k);
+                if (idom[p] < 0)
+                    continue; // Not processed yet or unreachable.
+                if (new_idom < 0)
+                {
+                    new_idom = p;
+                    continue;
+                }
+
+                int32_t x = p;
+                int32_t y = new_idom;
+                while (x != y)
+                {
+                    while (order[x] > order[y]) x = idom[x];
+                    while (order[y] > order[x]) y = idom[y];
+                }
+                new_idom = x;
+            }
+
+            if (idom[b] != new_idom)
+            {
+                idom[b] = new_idom;
+                changed = true;
+            }
+        }
+    }
+    if (count > 0)
+        idom[0] = -1;
+
+    // Dominator tree.
+    from.resize(0);
+    to.resize(0);
+    for (uint32_t i = 1; i < rpo.get_size(); i++)
+    {
+        from.push(idom[rpo[i]]);
+        to.push(rpo[i]);
+    }
+    make_lists(count, from, to, child_start, children);
+
+    dom_pre.resize(count);
+    dom_post.resize(count);
+    if (count > 0)
+    {
+        uint32_t pre = 0;
+        uint32_t post = 0;
+        List<uint32_t> stack;
+        List<uint32_t> next_child;
+        stack.push(0);
+        next_child.push(0);
+        dom_pre[0] = pre++;
+        while (stack.get_size() > 0)
+        {
+            uint32_t top = stack.get_size() - 1;
+            uint32_t b = stack[top];
+            uint32_t k = next_child[top]++;
+            if (k < child_count(b))
+            {
+                uint32_t c = child(b, k);
+                dom_pre[c] = pre++;
+                stack.push(c);
+                next_child.push(0);
+                continue;
+            }
+            dom_post[b] = post++;
+            stack.pop();
+            next_child.pop();
+        }
+    }
+
+    // Dominance frontiers. A join block is in the frontier of each block
+    // on the dominator tree path from its predecessors up to its idom.
+    from.resize(0);
+    to.resize(0);
+    List<int32_t> last_added;
+    last_added.resize(count);
+    for (uint32_t b = 0; b < count; b++)
+        last_added[b] = -1;
+
+    for (uint32_t i = 0; i < rpo.get_size(); i++)
+    {
+        uint32_t b = rpo[i];
+        if (pred_count(b) < 2)
+            continue;
+        for (uint32_t k = 0; k < pred_count(b); k++)
+        {
+            int32_t runner = pred(b, k);
+            if (!reachable(runner))
+                continue;
+            while (runner >= 0 && runner != idom[b])
+            {
+                if (last_added[runner] != (int32_t)b)
+                {
+                    last_added[runner] = b;
+                    from.push(runner);
+                    to.push(b);
+                }
+                runner = idom[runner];
+            }
+        }
+    }
+    make_lists(count, from, to, df_start, df);
+}
@@ -0,0 +1,66 @@
+#ifndef IR_CFG_H
+#define IR_CFG_H
+
+#include "ir.h"
+#include "list.h"
+
+/**
+ * Turns (from, to) pairs into lists stored one after another:
+ * the items of list n are items[start[n]] ... items[start[n + 1] - 1]
+ * in the order the pairs are given.
+ */
+void make_lists(uint32_t list_count, List<uint32_t> &from, List<uint32_t> &to,
+                List<uint32_t> &start, List<uint32_t> &items);
+
+/**
+ * Control flow graph of a routine with its dominator tree.
+ *
+ * The blocks are the block table of the routine (see update_blocks()).
+ * Block 0 is the entry. Blocks that can't be reached from the entry
+ * are in the graph but they have no dominator and they are not in rpo.
+ * Lists of predecessors, dominator tree children and dominance frontiers
+ * are stored one after another: e.g. the predecessors of block b are
+ * preds[pred_start[b]] ... preds[pred_start[b + 1] - 1].
+ */
+struct CFG
+{
+    BasicBlock *blocks;         // The block table of the routine.
+    uint32_t count;
+    List<int32_t> block_of;     // Quad index -> block index.
+    List<uint32_t> pred_start;
+    List<uint32_t> preds;       // One per edge. Same order as the phi arguments.
+    List<uint32_t> rpo;         // Reachable blocks in reverse postorder.
+    List<int32_t> idom;         // Immediate dominator or -1 (the entry and unreachable blocks).
+    List<uint32_t> child_start;
+    List<uint32_t> children;    // Dominator tree.
+    List<uint32_t> dom_pre;     // Preorder and postorder numbers in the dominator tree.
+    List<uint32_t> dom_post;
+    List<uint32_t> df_start;
+    List<uint32_t> df;          // Dominance frontiers.
+
+    void build(Routine *routine);
+
+    uint32_t block_count() { return count; }
+
+    uint32_t pred_count(uint32_t b) { return pred_start[b + 1] - pred_start[b]; }
+    uint32_t pred(uint32_t b, uint32_t k) { return preds[pred_start[b] + k]; }
+
+    uint32_t child_count(uint32_t b) { return child_start[b + 1] - child_start[b]; }
+    uint32_t child(uint32_t b, uint32_t k) { return children[child_start[b] + k]; }
+
+    uint32_t df_count(uint32_t b) { return df_start[b + 1] - df_start[b]; }
+    uint32_t frontier(uint32_t b, uint32_t k) { return df[df_start[b] + k]; }
+
+    bool reachable(uint32_t b) { return b == 0 || idom[b] >= 0; }
+
+    /**
+     * Block a dominates block b (a block dominates itself).
+     * Both blocks must be reachable.
+     */
+    bool dominates(uint32_t a, uint32_t b)
+    {
+        return dom_pre[a] <= dom_pre[b] && dom_post[b] <= dom_post[a];
+    }
+};
+
+#endif // IR_CFG_H
@@ -25,25 +25,31 @@ struct Voidable
  */
 struct Evaluator
 {
-    int env_index;
-    // TODO: Better environment.
-    // NOTE: Temp ids are used as indices to the environment.
-    Value env[20][100]; // max 20 nested calls, max 100 temps per call
+    // NOTE: Frames are in one stack. Temp ids are indices to the frame
+    // of the current routine that starts at base. The frame of a callee
+    // starts right after the temps of the caller so ARG writes
+    // the argument straight to the param of the callee.
+    List<Value> stack;
+    uint32_t base;
     List<Routine*> routines; // routine table can be indexed with routine ids
 
     Voidable lastval; // for tests... which is not very intuitive :S
 
 
+    void enter(Routine *routine)
+    {
+        if (stack.get_size() < base + routine->temp_count)
+            stack.resize(base + routine->temp_count);
+    }
+
     Value get(Operand temp)
     {
-        assert(temp.temp_id < 100);
-        return env[env_index][temp.temp_id];
+        return stack[base + temp.temp_id];
     }
 
     void set(Operand temp, uint64_t value)
     {
-        assert(temp.temp_id < 100);
-        env[env_index][temp.temp_id].uvalue = value;
+        stack[base + temp.temp_id].uvalue = value;
 
         lastval.value.uvalue = value;
         lastval.is_void = false;
@@ -54,6 +60,8 @@ struct Evaluator
         Voidable rv;
         rv.is_void = true;
 
+        enter(routine);
+
         int quad_count = routine->quad_count;
         for (int i = 0; i < quad_count; i++)
         {
@@ -132,14 +140,15 @@ struct Evaluator
                         i = quad.target.label; // for loop's i++ will skip the label quad
                     break;
                 case IR::LABEL:
+                case IR::NOP:
                     break;
                 case IR::CALL:
                 {
-                    assert(env_index < 20);
-                    env_index++;
+                    uint32_t caller_base = base;
+                    base += routine->temp_count;
                     // NOTE: External routines have no quads => evaluation just returns void.
                     Voidable rv = eval(routines[quad.left.func_id]);
-                    env_index--;
+                    base = caller_base;
                     set(quad.target, rv.value.uvalue);
                     lastval.is_void = rv.is_void;
                     break;
@@ -156,13 +165,12 @@ struct Evaluator
                 }
                 case IR::ARG:
                 {
-                    assert(env_index < 20);
-                    Value arg = get(quad.left);
-                    env_index++;
-                    Operand temp;
-                    temp.temp_id = quad.target.arg_index;
-                    set(temp, arg.uvalue);
-                    env_index--;
+                    uint32_t index = base + routine->temp_count + quad.target.arg_index;
+                    if (stack.get_size() < index + 1)
+                        stack.resize(index + 1);
+                    stack[index] = get(quad.left);
+                    lastval.value = stack[index];
+                    lastval.is_void = false;
                     break;
                 }
             }
@@ -185,7 +193,7 @@ struct Evaluator
 
         lastval.is_void = true;
 
-        env_index = 0;
+        base = 0;
         eval(routines[0]);
     }
 };
@@ -28,7 +28,8 @@
     PASTE_TYPE(LABEL)   \
     PASTE_TYPE(CALL)    \
     PASTE_TYPE(RET)     \
-    PASTE_TYPE(ARG)
+    PASTE_TYPE(ARG)     \
+    PASTE_TYPE(NOP)
 
 /**
  * IR has a linked list of routines.
@@ -0,0 +1,2004 @@
+#include "ir_opt.h"
+#include "ir.h"
+#include "ir_cfg.h"
+#include "ir_ssa.h"
+#include "liveness.h"
+#include "ir_vm.h"
+#include "profile.h"
+#include "list.h"
+#include "assert.h"
+
+#include <cstring>
+
+static void optimize(Routine *routine);
+
+//
+// Constant folding and propagation
+//
+
+/**
+ * What is known about the value of a temp at some point of the routine.
+ */
+struct Constant
+{
+    bool known; // The temp has this value on every path.
+    uint64_t value;
+};
+
+/**
+ * Computes the value the quad writes if its operands are known.
+ * Uses the same arithmetic as the evaluator. Division by zero and
+ * the overflowing INT64_MIN / -1 are left for the run time.
+ */
+static bool evaluate(Quad q, Constant *env, uint64_t *result)
+{
+    switch (q.op)
+    {
+        case IR::MOV_IM:
+            *result = q.left.int_value;
+            return true;
+        case IR::MOV:
+        case IR::NOT:
+        case IR::NEG:
+        {
+            Constant left = env[q.left.temp_id];
+            if (!left.known)
+                return false;
+            switch (q.op)
+            {
+                case IR::MOV: *result = left.value; break;
+                case IR::NOT: *result = !left.value; break;
+                case IR::NEG: *result = 0 - left.value; break;
+                InvalidDefaultCase;
+            }
+            return true;
+        }
+        case IR::MUL: case IR::IMUL:
+        case IR::DIV: case IR::IDIV:
+        case IR::ADD: case IR::SUB:
+        case IR::EQ: case IR::NE:
+        case IR::LT: case IR::BELOW:
+        case IR::GT: case IR::ABOVE:
+        case IR::LE: case IR::BE:
+        case IR::GE: case IR::AE:
+        {
+            Constant left = env[q.left.temp_id];
+            Constant right = env[q.right.temp_id];
+            if (!left.known || !right.known)
+                return false;
+
+            uint64_t l = left.value;
+            uint64_t r = right.value;
+            int64_t sl = (int64_t)l;
+            int64_t sr = (int64_t)r;
+            switch (q.op)
+            {
+                // NOTE: Low 64 bits of the product are the same for signed and unsigned.
+                case IR::MUL:   *result = l * r; break;
+                case IR::IMUL:  *result = l * r; break;
+                case IR::DIV:
+                    if (r == 0)
+                        return false;
+                    *result = l / r;
+                    break;
+                case IR::IDIV:
+                    if (r == 0 || (sl == INT64_MIN && sr == -1))
+                        return false;
+                    *result = (uint64_t)(sl / sr);
+                    break;
+                case IR::ADD:   *result = l + r; break;
+                case IR::SUB:   *result = l - r; break;
+                case IR::EQ:    *result = l == r; break;
+                case IR::NE:    *result = l != r; break;
+                case IR::LT:    *result = sl < sr; break;
+                case IR::BELOW: *result = l < r; break;
+                case IR::GT:    *result = sl > sr; break;
+                case IR::ABOVE: *result = l > r; break;
+                case IR::LE:    *result = sl <= sr; break;
+                case IR::BE:    *result = l <= r; break;
+                case IR::GE:    *result = sl >= sr; break;
+                case IR::AE:    *result = l >= r; break;
+                InvalidDefaultCase;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/**
+ * Updates the environment with the value the quad writes.
+ */
+static void transfer(Quad q, Constant *env)
+{
+    uint32_t t;
+    if (!get_def(q, &t))
+        return;
+
+    uint64_t value;
+    if (evaluate(q, env, &value))
+    {
+        env[t].known = true;
+        env[t].value = value;
+    }
+    else
+    {
+        env[t].known = false;
+    }
+}
+
+/**
+ * Gets the successors of the block that can be executed
+ * with the constants known at the end of the block.
+ */
+static int get_successors(Routine *routine, BasicBlock block, Constant *env, int32_t succ[2])
+{
+    Quad last = (*routine)[block.end - 1];
+    if (last.op == IR::JZ || last.op == IR::JNZ)
+    {
+        Constant cond = env[last.left.temp_id];
+        if (cond.known)
+        {
+            // succ[0] is the next block and succ[1] is the jump target.
+            // A jump to the next block has only succ[0].
+            bool jumps = (last.op == IR::JZ) == (cond.value == 0);
+            if (jumps && block.succ[1] >= 0)
+                succ[0] = block.succ[1];
+            else
+                succ[0] = block.succ[0];
+            return (succ[0] >= 0) ? 1 : 0;
+        }
+    }
+
+    int count = 0;
+    for (int k = 0; k < 2; k++)
+    {
+        if (block.succ[k] >= 0)
+            succ[count++] = block.succ[k];
+    }
+    return count;
+}
+
+void fold_constants(Routine *routine)
+{
+    BasicBlock *blocks = routine->blocks;
+    uint32_t block_count = routine->block_count;
+    uint32_t temp_count = routine->temp_count;
+    if (block_count == 0 || temp_count == 0)
+        return;
+
+    // Constants at the start of each block. Blocks are visited only
+    // after some executable edge reaches them, so values from the
+    // paths that can't be taken don't spoil the constants.
+    List<Constant> in;
+    List<bool> reached;
+    List<Constant> env;
+    in.resize(block_count * temp_count);
+    reached.resize(block_count);
+    env.resize(temp_count);
+
+    for (uint32_t b = 0; b < block_count; b++)
+        reached[b] = false;
+    for (uint32_t t = 0; t < temp_count; t++)
+        in[t].known = false; // Nothing is known at the entry.
+    reached[0] = true;
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (uint32_t b = 0; b < block_count; b++)
+        {
+            if (!reached[b])
+                continue;
+
+            BasicBlock block = blocks[b];
+            for (uint32_t t = 0; t < temp_count; t++)
+                env[t] = in[b * temp_count + t];
+            for (uint32_t i = block.start; i < block.end; i++)
+                transfer((*routine)[i], &env[0]);
+
+            int32_t succ[2];
+            int succ_count = get_successors(routine, block, &env[0], succ);
+            for (int k = 0; k < succ_count; k++)
+            {
+                Constant *s_in = &in[succ[k] * temp_count];
+                if (!reached[succ[k]])
+                {
+                    reached[succ[k]] = true;
+                    for (uint32_t t = 0; t < temp_count; t++)
+                        s_in[t] = env[t];
+                    changed = true;
+                    continue;
+                }
+
+                // Temps with different values on different paths are not constants.
+                for (uint32_t t = 0; t < temp_count; t++)
+                {
+                    if (s_in[t].known && (!env[t].known || env[t].value != s_in[t].value))
+                    {
+                        s_in[t].known = false;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // Rewrite the quads whose results are known.
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        if (!reached[b])
+            continue;
+
+        BasicBlock block = blocks[b];
+        for (uint32_t t = 0; t < temp_count; t++)
+            env[t] = in[b * temp_count + t];
+
+        for (uint32_t i = block.start; i < block.end; i++)
+        {
+            Quad &q = (*routine)[i];
+
+            if (q.op == IR::JZ || q.op == IR::JNZ)
+            {
+                Constant cond = env[q.left.temp_id];
+                if (cond.known)
+                {
+                    bool jumps = (q.op == IR::JZ) == (cond.value == 0);
+                    q.op = jumps ? IR::JMP : IR::NOP;
+                }
+                continue;
+            }
+
+            transfer(q, &env[0]);
+
+            uint32_t t;
+            if (q.op != IR::MOV_IM && get_def(q, &t) && env[t].known)
+            {
+                q.op = IR::MOV_IM;
+                q.left.int_value = env[t].value;
+            }
+        }
+    }
+
+    update_blocks(routine);
+}
+
+//
+// Copy propagation
+//
+
+/**
+ * Follows the copies to the temp whose value the given temp has.
+ */
+static uint32_t find_value(List<uint32_t> &value, uint32_t t)
+{
+    uint32_t root = t;
+    while (value[root] != root)
+        root = value[root];
+    while (value[t] != root)
+    {
+        uint32_t next = value[t];
+        value[t] = root;
+        t = next;
+    }
+    return root;
+}
+
+void propagate_copies(SSA &ssa, Routine *routine)
+{
+    CFG &cfg = ssa.cfg;
+    uint32_t temp_count = routine->temp_count;
+
+    List<uint32_t> value; // temp -> temp with the same value
+    value.resize(temp_count);
+    for (uint32_t t = 0; t < temp_count; t++)
+        value[t] = t;
+
+    // In SSA form the source of a copy is defined before the copy on every
+    // path so the target can be replaced with the source everywhere.
+    // A phi whose arguments are all the same value (or the phi itself) is
+    // a copy too. Phis in loops may need more rounds to see that.
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (uint32_t i = 0; i < cfg.rpo.get_size(); i++)
+        {
+            uint32_t b = cfg.rpo[i];
+            for (uint32_t k = 0; k < ssa.phi_count(b); k++)
+            {
+                Phi &phi = ssa.phi(b, k);
+                if (find_value(value, phi.target) != phi.target)
+                    continue;
+
+                int32_t same = -1;
+                bool trivial = true;
+                for (uint32_t j = 0; j < cfg.pred_count(b) && trivial; j++)
+                {
+                    if (!cfg.reachable(cfg.pred(b, j)))
+                        continue;
+                    uint32_t a = find_value(value, ssa.arg(phi, j));
+                    if (a == phi.target || (int32_t)a == same)
+                        continue;
+                    if (same >= 0)
+                        trivial = false;
+                    same = a;
+                }
+                if (trivial && same >= 0)
+                {
+                    value[phi.target] = same;
+                    changed = true;
+                }
+            }
+
+            BasicBlock block = cfg.blocks[b];
+            for (uint32_t q = block.start; q < block.end; q++)
+            {
+                Quad quad = (*routine)[q];
+                if (quad.op == IR::MOV && value[quad.target.temp_id] == quad.target.temp_id)
+                {
+                    value[quad.target.temp_id] = find_value(value, quad.left.temp_id);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Read the values instead of the copies. The copies are left
+    // for the dead code elimination.
+    for (uint32_t i = 0; i < cfg.rpo.get_size(); i++)
+    {
+        uint32_t b = cfg.rpo[i];
+        for (uint32_t k = 0; k < ssa.phi_count(b); k++)
+        {
+            Phi &phi = ssa.phi(b, k);
+            for (uint32_t j = 0; j < cfg.pred_count(b); j++)
+                ssa.arg(phi, j) = find_value(value, ssa.arg(phi, j));
+        }
+
+        BasicBlock block = cfg.blocks[b];
+        for (uint32_t q = block.start; q < block.end; q++)
+        {
+            Quad &quad = (*routine)[q];
+            Operand *uses[2];
+            int use_count = get_use_operands(quad, uses);
+            for (int n = 0; n < use_count; n++)
+                uses[n]->temp_id = find_value(value, uses[n]->temp_id);
+        }
+    }
+}
+
+//
+// Dead code elimination
+//
+
+/**
+ * The quad can be removed if nothing reads its result.
+ * Calls can have side effects and divisions can trap.
+ */
+static bool is_removable(Quad quad)
+{
+    uint32_t t;
+    if (!get_def(quad, &t))
+        return false;
+    return quad.op != IR::CALL && quad.op != IR::DIV && quad.op != IR::IDIV;
+}
+
+void eliminate_dead_code(SSA &ssa, Routine *routine)
+{
+    CFG &cfg = ssa.cfg;
+    uint32_t temp_count = routine->temp_count;
+    uint32_t block_count = cfg.block_count();
+
+    // Definition of each temp: quad index, or -2 - phi index for phis.
+    // Temps without a definition are the values at the entry.
+    List<int32_t> def;
+    def.resize(temp_count);
+    for (uint32_t t = 0; t < temp_count; t++)
+        def[t] = -1;
+    for (uint32_t i = 0; i < ssa.phis.get_size(); i++)
+        def[ssa.phis[i].target] = -2 - (int32_t)i;
+
+    List<bool> live;
+    List<uint32_t> work;
+    live.resize(temp_count);
+    for (uint32_t t = 0; t < temp_count; t++)
+        live[t] = false;
+
+    // Every temp read by a quad that must stay is live.
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        if (!cfg.reachable(b))
+            continue;
+        for (uint32_t i = cfg.blocks[b].start; i < cfg.blocks[b].end; i++)
+        {
+            Quad quad = (*routine)[i];
+            uint32_t t;
+            if (get_def(quad, &t))
+                def[t] = i;
+            if (is_removable(quad))
+                continue;
+
+            uint32_t uses[2];
+            int use_count = get_uses(quad, uses);
+            for (int k = 0; k < use_count; k++)
+            {
+                if (!live[uses[k]])
+                {
+                    live[uses[k]] = true;
+                    work.push(uses[k]);
+                }
+            }
+        }
+    }
+
+    // And so are the temps the live temps are computed from.
+    while (work.get_size() > 0)
+    {
+        int32_t d = def[work.pop()];
+        if (d == -1)
+            continue;
+
+        if (d >= 0)
+        {
+            uint32_t uses[2];
+            int use_count = get_uses((*routine)[d], uses);
+            for (int k = 0; k < use_count; k++)
+            {
+                if (!live[uses[k]])
+                {
+                    live[uses[k]] = true;
+                    work.push(uses[k]);
+                }
+            }
+            continue;
+        }
+
+        Phi &phi = ssa.phis[-2 - d];
+        for (uint32_t j = 0; j < cfg.pred_count(phi.block); j++)
+        {
+            uint32_t a = ssa.arg(phi, j);
+            if (cfg.reachable(cfg.pred(phi.block, j)) && !live[a])
+            {
+                live[a] = true;
+                work.push(a);
+            }
+        }
+    }
+
+    // Remove the dead quads and the blocks that can't be reached.
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        bool reachable = cfg.reachable(b);
+        for (uint32_t i = cfg.blocks[b].start; i < cfg.blocks[b].end; i++)
+        {
+            Quad &quad = (*routine)[i];
+            uint32_t t;
+            if (!reachable || (is_removable(quad) && get_def(quad, &t) && !live[t]))
+                quad.op = IR::NOP;
+        }
+    }
+
+    // Remove the dead phis.
+    uint32_t count = 0;
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        uint32_t start = ssa.phi_start[b];
+        uint32_t end = ssa.phi_start[b + 1];
+        ssa.phi_start[b] = count;
+        for (uint32_t i = start; i < end; i++)
+        {
+            if (live[ssa.phis[i].target])
+                ssa.phis[count++] = ssa.phis[i];
+        }
+    }
+    ssa.phi_start[block_count] = count;
+    ssa.phis.resize(count);
+}
+
+//
+// Copy coalescing
+//
+
+/**
+ * Interference between the temps that are in copies.
+ * Row i has a bit for each temp that interferes with temp_of[i].
+ */
+struct Interference
+{
+    uint32_t words; // 64 bit words per row
+    List<int32_t> index; // temp -> row or -1
+    List<uint32_t> temp_of;
+    List<uint64_t> bits;
+
+    bool test(uint32_t a, uint32_t b)
+    {
+        return bits[a * words + b / 64] & (1ull << (b % 64));
+    }
+
+    void add(uint32_t a, uint32_t b)
+    {
+        bits[a * words + b / 64] |= 1ull << (b % 64);
+        bits[b * words + a / 64] |= 1ull << (a % 64);
+    }
+
+    /**
+     * Temp a is defined while the temps in the set are live.
+     */
+    void add_live(uint32_t a, uint64_t *live, uint32_t live_words, int32_t except)
+    {
+        for (uint32_t w = 0; w < live_words; w++)
+        {
+            if (live[w] == 0)
+                continue;
+            for (uint32_t n = 0; n < 64; n++)
+            {
+                uint32_t t = w * 64 + n;
+                if (!(live[w] & (1ull << n)) || (int32_t)t == except)
+                    continue;
+                if (index[t] >= 0 && index[t] != (int32_t)a)
+                    add(a, index[t]);
+            }
+        }
+    }
+
+    /**
+     * Row b is merged into row a.
+     */
+    void merge(uint32_t a, uint32_t b)
+    {
+        uint32_t count = temp_of.get_size();
+        for (uint32_t x = 0; x < count; x++)
+        {
+            if (test(b, x))
+                add(a, x);
+        }
+    }
+};
+
+/**
+ * Removes the nops from the routine.
+ */
+static void remove_nops(Routine *routine)
+{
+    List<Quad> quads;
+    for (Quad quad : *routine)
+    {
+        if (quad.op != IR::NOP)
+            quads.push(quad);
+    }
+    if (quads.get_size() != routine->quad_count)
+        set_quads(routine, quads);
+}
+
+void coalesce_copies(Routine *routine)
+{
+    uint32_t temp_count = routine->temp_count;
+    uint32_t quad_count = routine->quad_count;
+    uint32_t param_count = routine->param_count;
+
+    Interference graph;
+    graph.index.resize(temp_count);
+    for (uint32_t t = 0; t < temp_count; t++)
+        graph.index[t] = -1;
+    for (uint32_t i = 0; i < quad_count; i++)
+    {
+        Quad quad = (*routine)[i];
+        if (quad.op != IR::MOV)
+            continue;
+        uint32_t pair[2] = {quad.target.temp_id, quad.left.temp_id};
+        for (int k = 0; k < 2; k++)
+        {
+            if (graph.index[pair[k]] < 0)
+            {
+                graph.index[pair[k]] = graph.temp_of.get_size();
+                graph.temp_of.push(pair[k]);
+            }
+        }
+    }
+
+    uint32_t count = graph.temp_of.get_size();
+    if (count == 0)
+        return;
+    graph.words = (count + 63) / 64;
+    graph.bits.resize(count * graph.words);
+    for (uint32_t i = 0; i < count * graph.words; i++)
+        graph.bits[i] = 0;
+
+    // A temp interferes with the temps that are live where it is defined.
+    // The source of a copy doesn't interfere with the target because
+    // they have the same value.
+    Liveness liveness;
+    liveness.compute(routine);
+    uint32_t words = liveness.words;
+
+    List<uint64_t> live;
+    live.resize(words);
+    for (uint32_t b = 0; b < liveness.block_count; b++)
+    {
+        BasicBlock block = liveness.blocks[b];
+        for (uint32_t w = 0; w < words; w++)
+            live[w] = liveness.out(b)[w];
+
+        for (uint32_t i = block.end; i > block.start; i--)
+        {
+            Quad quad = (*routine)[i - 1];
+
+            uint32_t d;
+            if (get_def(quad, &d))
+            {
+                if (graph.index[d] >= 0)
+                {
+                    int32_t except = (quad.op == IR::MOV) ? (int32_t)quad.left.temp_id : -1;
+                    graph.add_live(graph.index[d], &live[0], words, except);
+                }
+                live[d / 64] &= ~(1ull << (d % 64));
+            }
+
+            uint32_t uses[2];
+            int use_count = get_uses(quad, uses);
+            for (int k = 0; k < use_count; k++)
+                live[uses[k] / 64] |= 1ull << (uses[k] % 64);
+        }
+    }
+
+    // Params are defined at the entry.
+    if (liveness.block_count > 0)
+    {
+        for (uint32_t p = 0; p < param_count; p++)
+        {
+            if (graph.index[p] >= 0)
+                graph.add_live(graph.index[p], liveness.in(0), words, -1);
+        }
+    }
+
+    // Merge the temps of each copy unless they interfere.
+    // Params keep their ids.
+    List<uint32_t> rep;
+    rep.resize(temp_count);
+    for (uint32_t t = 0; t < temp_count; t++)
+        rep[t] = t;
+
+    bool merged = false;
+    for (uint32_t i = 0; i < quad_count; i++)
+    {
+        Quad quad = (*routine)[i];
+        if (quad.op != IR::MOV)
+            continue;
+
+        uint32_t a = find_value(rep, quad.target.temp_id);
+        uint32_t b = find_value(rep, quad.left.temp_id);
+        if (a == b || (a < param_count && b < param_count))
+            continue;
+        if (graph.test(graph.index[a], graph.index[b]))
+            continue;
+
+        if (b < param_count)
+        {
+            uint32_t tmp = a;
+            a = b;
+            b = tmp;
+        }
+        rep[b] = a;
+        graph.merge(graph.index[a], graph.index[b]);
+        merged = true;
+    }
+
+    if (!merged)
+        return;
+
+    for (uint32_t i = 0; i < quad_count; i++)
+    {
+        Quad &quad = (*routine)[i];
+
+        Operand *uses[2];
+        int use_count = get_use_operands(quad, uses);
+        for (int k = 0; k < use_count; k++)
+            uses[k]->temp_id = find_value(rep, uses[k]->temp_id);
+
+        uint32_t d;
+        if (get_def(quad, &d))
+            quad.target.temp_id = find_value(rep, d);
+
+        if (quad.op == IR::MOV && quad.target.temp_id == quad.left.temp_id)
+            quad.op = IR::NOP;
+    }
+    remove_nops(routine);
+}
+
+//
+// Loop invariant code motion
+//
+
+static bool is_invariant_candidate(IR::Type op)
+{
+    switch (op)
+    {
+        case IR::MOV_IM: case IR::MOV:
+        case IR::NOT: case IR::NEG:
+        case IR::MUL: case IR::IMUL:
+        case IR::ADD: case IR::SUB:
+        case IR::EQ: case IR::NE:
+        case IR::LT: case IR::BELOW:
+        case IR::GT: case IR::ABOVE:
+        case IR::LE: case IR::BE:
+        case IR::GE: case IR::AE:
+            return true;
+        default:
+            return false; // Divisions can trap and calls have side effects.
+    }
+}
+
+/**
+ * Natural loops of a routine. The loop of a header has the blocks that
+ * reach a back edge to the header without passing through the header.
+ * The blocks of loop n are body[n * block_count] ... body[(n + 1) * block_count - 1].
+ */
+struct Loops
+{
+    uint32_t block_count;
+    List<uint32_t> headers;
+    List<uint32_t> sizes; // Blocks in the loop.
+    List<bool> body;      // Block -> the block is in the loop.
+
+    uint32_t count() { return headers.get_size(); }
+    bool contains(uint32_t loop, uint32_t b) { return body[loop * block_count + b]; }
+
+    void find(CFG &cfg)
+    {
+        block_count = cfg.block_count();
+        List<uint32_t> work;
+        for (uint32_t h = 0; h < block_count; h++)
+        {
+            if (!cfg.reachable(h))
+                continue;
+
+            int32_t loop = -1;
+            for (uint32_t k = 0; k < cfg.pred_count(h); k++)
+            {
+                uint32_t tail = cfg.pred(h, k);
+                if (!cfg.reachable(tail) || !cfg.dominates(h, tail))
+                    continue;
+
+                if (loop < 0)
+                {
+                    loop = headers.get_size();
+                    headers.push(h);
+                    sizes.push(1);
+                    body.resize(body.get_size() + block_count);
+                    for (uint32_t b = 0; b < block_count; b++)
+                        body[loop * block_count + b] = (b == h);
+                }
+
+                work.resize(0);
+                work.push(tail);
+                while (work.get_size() > 0)
+                {
+                    uint32_t b = work[work.get_size() - 1];
+                    work.resize(work.get_size() - 1);
+                    if (body[loop * block_count + b])
+                        continue;
+                    body[loop * block_count + b] = true;
+                    sizes[loop]++;
+                    for (uint32_t j = 0; j < cfg.pred_count(b); j++)
+                    {
+                        if (cfg.reachable(cfg.pred(b, j)))
+                            work.push(cfg.pred(b, j));
+                    }
+                }
+            }
+        }
+    }
+};
+
+/**
+ * Definitions of the temps of a routine counted for one loop.
+ * Params count as defined at the entry.
+ */
+struct LoopDefs
+{
+    List<uint32_t> count;
+    List<uint32_t> loop_count; // Definitions in the loop.
+    List<uint32_t> quad;       // The last definition.
+    List<uint32_t> loop_quad;  // The last definition in the loop.
+
+    void find(Routine *routine, CFG &cfg, Loops &loops, uint32_t loop)
+    {
+        uint32_t temp_count = routine->temp_count;
+        count.resize(temp_count);
+        loop_count.resize(temp_count);
+        quad.resize(temp_count);
+        loop_quad.resize(temp_count);
+        for (uint32_t t = 0; t < temp_count; t++)
+        {
+            count[t] = (t < routine->param_count) ? 1 : 0;
+            loop_count[t] = 0;
+        }
+        for (uint32_t i = 0; i < routine->quad_count; i++)
+        {
+            uint32_t t;
+            if (!get_def((*routine)[i], &t))
+                continue;
+            count[t]++;
+            quad[t] = i;
+            if (loops.contains(loop, cfg.block_of[i]))
+            {
+                loop_count[t]++;
+                loop_quad[t] = i;
+            }
+        }
+    }
+};
+
+/**
+ * Rebuilds the routine with the preheader quads in a new block right
+ * before the header of the loop. The jumps to the header from outside
+ * the loop go to the preheader. The quads marked in removed are left
+ * out and each quad of added is placed after the quad at the same index
+ * of added_after.
+ */
+static void add_preheader(Routine *routine, CFG &cfg, Loops &loops, uint32_t loop, List<Quad> &preheader,
+                          List<bool> &removed, List<Quad> &added, List<uint32_t> &added_after)
+{
+    uint32_t quad_count = routine->quad_count;
+    BasicBlock header = routine->blocks[loops.headers[loop]];
+    uint32_t header_label = (*routine)[header.start].target.label;
+    uint32_t preheader_label = quad_count; // The labels of the routine are quad indices.
+
+    List<Quad> quads;
+    for (uint32_t i = 0; i < quad_count; i++)
+    {
+        if (i == header.start)
+        {
+            // A block of the loop that falls through to the header
+            // jumps over the preheader.
+            if (i > 0)
+            {
+                Quad last = (*routine)[i - 1];
+                if (loops.contains(loop, cfg.block_of[i - 1]) && last.op != IR::JMP && last.op != IR::RET)
+                {
+                    Quad jmp = {};
+                    jmp.op = IR::JMP;
+                    jmp.target.label = header_label;
+                    quads.push(jmp);
+                }
+            }
+
+            Quad label = {};
+            label.op = IR::LABEL;
+            label.target.label = preheader_label;
+            quads.push(label);
+            for (uint32_t k = 0; k < preheader.get_size(); k++)
+                quads.push(preheader[k]);
+        }
+
+        if (!removed[i])
+        {
+            Quad quad = (*routine)[i];
+            if ((quad.op == IR::JMP || quad.op == IR::JZ || quad.op == IR::JNZ) &&
+                quad.target.label == header_label && !loops.contains(loop, cfg.block_of[i]))
+            {
+                quad.target.label = preheader_label;
+            }
+            quads.push(quad);
+        }
+
+        for (uint32_t k = 0; k < added.get_size(); k++)
+        {
+            if (added_after[k] == i)
+                quads.push(added[k]);
+        }
+    }
+
+    set_quads(routine, quads);
+}
+
+/**
+ * Moves the invariant quads of the loop to a preheader that is placed
+ * right before the header. The jumps to the header from outside the
+ * loop go to the preheader. Returns false if nothing can be moved.
+ *
+ * A quad is invariant if its operands are defined only outside the
+ * loop or by invariant quads. Its target must have no other definition
+ * and it must not be live at the header, so every read of the target
+ * sees the value the quad computes in any iteration.
+ */
+static bool hoist_invariants(Routine *routine, CFG &cfg, Liveness &liveness, Loops &loops, uint32_t loop)
+{
+    uint32_t quad_count = routine->quad_count;
+    uint32_t temp_count = routine->temp_count;
+    uint32_t header_block = loops.headers[loop];
+    BasicBlock header = routine->blocks[header_block];
+    if ((*routine)[header.start].op != IR::LABEL)
+        return false;
+
+    LoopDefs defs;
+    defs.find(routine, cfg, loops, loop);
+
+    List<bool> hoisted;
+    List<uint32_t> order;
+    hoisted.resize(quad_count);
+    for (uint32_t i = 0; i < quad_count; i++)
+        hoisted[i] = false;
+
+    uint64_t *live_in = liveness.in(header_block);
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (uint32_t i = 0; i < quad_count; i++)
+        {
+            Quad quad = (*routine)[i];
+            if (hoisted[i] || !loops.contains(loop, cfg.block_of[i]) || !is_invariant_candidate(quad.op))
+                continue;
+
+            uint32_t t = quad.target.temp_id;
+            if (defs.count[t] != 1 || (live_in[t / 64] >> (t % 64)) & 1)
+                continue;
+
+            uint32_t uses[2];
+            int use_count = get_uses(quad, uses);
+            bool invariant = true;
+            for (int k = 0; k < use_count && invariant; k++)
+            {
+                uint32_t u = uses[k];
+                invariant = defs.loop_count[u] == 0 || (defs.count[u] == 1 && hoisted[defs.quad[u]]);
+            }
+            if (!invariant)
+                continue;
+
+            hoisted[i] = true;
+            order.push(i);
+            changed = true;
+        }
+    }
+
+    if (order.get_size() == 0)
+        return false;
+
+    // The hoisted constants are computed once each.
+    List<uint32_t> same;
+    same.resize(temp_count);
+    for (uint32_t t = 0; t < temp_count; t++)
+        same[t] = t;
+    for (uint32_t k = 0; k < order.get_size(); k++)
+    {
+        Quad quad = (*routine)[order[k]];
+        for (uint32_t j = 0; j < k && quad.op == IR::MOV_IM; j++)
+        {
+            Quad earlier = (*routine)[order[j]];
+            if (earlier.op == IR::MOV_IM && earlier.left.int_value == quad.left.int_value &&
+                same[earlier.target.temp_id] == earlier.target.temp_id)
+            {
+                same[quad.target.temp_id] = earlier.target.temp_id;
+                break;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < quad_count; i++)
+    {
+        Operand *uses[2];
+        int use_count = get_use_operands((*routine)[i], uses);
+        for (int k = 0; k < use_count; k++)
+            uses[k]->temp_id = same[uses[k]->temp_id];
+    }
+
+    List<Quad> preheader;
+    for (uint32_t k = 0; k < order.get_size(); k++)
+    {
+        Quad quad = (*routine)[order[k]];
+        if (same[quad.target.temp_id] == quad.target.temp_id)
+            preheader.push(quad);
+    }
+
+    List<Quad> added;
+    List<uint32_t> added_after;
+    add_preheader(routine, cfg, loops, loop, preheader, hoisted, added, added_after);
+    return true;
+}
+
+void hoist_loop_invariants(Routine *routine)
+{
+    // Quads hoisted out of an inner loop can be hoisted again out of
+    // the loop around it, so the loops are done one at a time from the
+    // smallest and the loops are found again after each change.
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        CFG cfg;
+        cfg.build(routine);
+        Loops loops;
+        loops.find(cfg);
+        uint32_t loop_count = loops.count();
+        if (loop_count == 0)
+            break;
+
+        Liveness liveness;
+        liveness.compute(routine);
+
+        List<bool> done;
+        done.resize(loop_count);
+        for (uint32_t k = 0; k < loop_count; k++)
+            done[k] = false;
+
+        for (uint32_t n = 0; n < loop_count && !changed; n++)
+        {
+            uint32_t smallest = 0;
+            for (uint32_t k = 0; k < loop_count; k++)
+            {
+                if (!done[k] && (done[smallest] || loops.sizes[k] < loops.sizes[smallest]))
+                    smallest = k;
+            }
+            done[smallest] = true;
+            changed = hoist_invariants(routine, cfg, liveness, loops, smallest);
+        }
+    }
+}
+
+//
+// Induction variables
+//
+
+/**
+ * Gets the value of a temp whose only definition is a MOV_IM.
+ */
+static bool get_constant(Routine *routine, LoopDefs &defs, uint32_t t, int64_t *value)
+{
+    if (t < routine->param_count || defs.count[t] != 1 || (*routine)[defs.quad[t]].op != IR::MOV_IM)
+        return false;
+    *value = (int64_t)(*routine)[defs.quad[t]].left.int_value;
+    return true;
+}
+
+/**
+ * Replaces the test of a basic induction variable t against an
+ * invariant bound with the same test of scaled = t * k against
+ * bound * k so that t is not needed in the loop. The test is quad
+ * test and the update of t is quad update. Returns false if the
+ * result of the test could change.
+ *
+ * EQ and NE are exact for any odd k because multiplying by an odd
+ * number is a bijection modulo 2^64. The ordered tests need a positive
+ * k and no overflow: t must start from a constant, step towards a
+ * constant bound once per iteration and leave the loop at the header
+ * when the test fails, so that t stays between its start and the bound.
+ */
+static bool replace_test(Routine *routine, CFG &cfg, Loops &loops, uint32_t loop, LoopDefs &defs,
+                         uint32_t t, uint32_t update, uint32_t test, uint32_t scaled, uint32_t k,
+                         List<Quad> &preheader)
+{
+    Quad quad = (*routine)[test];
+    bool t_left = (quad.left.temp_id == t);
+    uint32_t bound = t_left ? quad.right.temp_id : quad.left.temp_id;
+    if (bound == t || defs.loop_count[bound] != 0)
+        return false;
+
+    int64_t factor;
+    if (!get_constant(routine, defs, k, &factor))
+        return false;
+
+    int64_t bound_value;
+    bool constant_bound = get_constant(routine, defs, bound, &bound_value);
+    if (quad.op == IR::EQ || quad.op == IR::NE)
+    {
+        if ((factor & 1) == 0)
+            return false;
+    }
+    else if (quad.op == IR::LT || quad.op == IR::LE || quad.op == IR::GT || quad.op == IR::GE)
+    {
+        const int64_t limit = (int64_t)1 << 30;
+        if (!constant_bound || factor <= 0 || factor > limit || bound_value < -limit || bound_value > limit)
+            return false;
+
+        int64_t step;
+        Quad add = (*routine)[update];
+        uint32_t step_temp = (add.left.temp_id == t) ? add.right.temp_id : add.left.temp_id;
+        if (!get_constant(routine, defs, step_temp, &step) || step < -limit || step > limit)
+            return false;
+        if (add.op == IR::SUB)
+            step = -step;
+
+        // t < bound or t <= bound while counting up, t > bound or t >= bound while counting down.
+        bool up = (quad.op == IR::LT || quad.op == IR::LE) == t_left;
+        if (step == 0 || (step > 0) != up)
+            return false;
+
+        // The test must be in the header and leave the loop when it fails.
+        uint32_t header_block = loops.headers[loop];
+        Quad jump = (*routine)[test + 1];
+        if ((uint32_t)cfg.block_of[test] != header_block || test + 1 >= routine->blocks[header_block].end ||
+            jump.op != IR::JZ || jump.left.temp_id != quad.target.temp_id ||
+            loops.contains(loop, cfg.block_of[jump.target.label]))
+        {
+            return false;
+        }
+
+        // t is updated at most once per iteration and only this loop
+        // can bring its value back to the preheader.
+        uint32_t update_block = cfg.block_of[update];
+        for (uint32_t m = 0; m < loops.count(); m++)
+        {
+            if (m != loop && loops.contains(m, update_block))
+                return false;
+        }
+
+        // The start value is the only definition of t outside the loop.
+        if (defs.count[t] != 2)
+            return false;
+        int64_t start = 0;
+        bool found = false;
+        for (uint32_t i = 0; i < routine->quad_count && !found; i++)
+        {
+            Quad def = (*routine)[i];
+            found = (i != update && def.op == IR::MOV_IM && def.target.temp_id == t &&
+                     cfg.reachable(cfg.block_of[i]) && cfg.dominates(cfg.block_of[i], header_block));
+            start = (int64_t)def.left.int_value;
+        }
+        if (!found || start < -limit || start > limit)
+            return false;
+    }
+    else
+        return false;
+
+    Quad scaled_bound = {};
+    scaled_bound.target.temp_id = routine->temp_count++;
+    if (constant_bound)
+    {
+        scaled_bound.op = IR::MOV_IM;
+        scaled_bound.left.int_value = (uint64_t)bound_value * (uint64_t)factor;
+    }
+    else
+    {
+        scaled_bound.op = IR::IMUL;
+        scaled_bound.left.temp_id = bound;
+        scaled_bound.right.temp_id = k;
+    }
+    preheader.push(scaled_bound);
+
+    Quad &replaced = (*routine)[test];
+    replaced.left.temp_id = t_left ? scaled : scaled_bound.target.temp_id;
+    replaced.right.temp_id = t_left ? scaled_bound.target.temp_id : scaled;
+    return true;
+}
+
+/**
+ * Strength reduces the induction variables of the loop. A basic
+ * induction variable t has one definition in the loop that adds or
+ * subtracts an invariant step. A derived one is t * k with an invariant k.
+ * Each product t * k gets a temp that is set to t * k in a new preheader
+ * and that is updated right after t by step * k, so it equals t * k at
+ * every point of the loop and the multiplications become copies.
+ *
+ * When t is then used only by its update and by a test against an
+ * invariant bound, the test is done on a product instead (see
+ * replace_test()) and the update of t is removed. Returns false if
+ * nothing changed.
+ */
+static bool reduce_induction_variables(Routine *routine, CFG &cfg, Liveness &liveness, Loops &loops, uint32_t loop)
+{
+    uint32_t quad_count = routine->quad_count;
+    uint32_t temp_count = routine->temp_count;
+    uint32_t header_block = loops.headers[loop];
+    if ((*routine)[routine->blocks[header_block].start].op != IR::LABEL)
+        return false;
+
+    LoopDefs defs;
+    defs.find(routine, cfg, loops, loop);
+
+    List<uint32_t> loop_use_count;
+    loop_use_count.resize(temp_count);
+    for (uint32_t t = 0; t < temp_count; t++)
+        loop_use_count[t] = 0;
+    for (uint32_t i = 0; i < quad_count; i++)
+    {
+        if (!loops.contains(loop, cfg.block_of[i]))
+            continue;
+        uint32_t uses[2];
+        int use_count = get_uses((*routine)[i], uses);
+        for (int k = 0; k < use_count; k++)
+            loop_use_count[uses[k]]++;
+    }
+
+    List<Quad> preheader;
+    List<bool> removed;
+    List<Quad> added;
+    List<uint32_t> added_after;
+    removed.resize(quad_count);
+    for (uint32_t i = 0; i < quad_count; i++)
+        removed[i] = false;
+
+    // The products of one basic induction variable: factor k -> temp.
+    List<uint32_t> factors;
+    List<uint32_t> products;
+
+    bool changed = false;
+    for (uint32_t t = 0; t < temp_count; t++)
+    {
+        if (defs.loop_count[t] != 1)
+            continue;
+
+        uint32_t update = defs.loop_quad[t];
+        Quad quad = (*routine)[update];
+        uint32_t step;
+        if ((quad.op == IR::ADD || quad.op == IR::SUB) && quad.left.temp_id == t)
+            step = quad.right.temp_id;
+        else if (quad.op == IR::ADD && quad.right.temp_id == t)
+            step = quad.left.temp_id;
+        else
+            continue;
+        if (defs.loop_count[step] != 0)
+            continue;
+
+        factors.resize(0);
+        products.resize(0);
+        uint32_t use_count = loop_use_count[t] - 1;
+        for (uint32_t i = 0; i < quad_count; i++)
+        {
+            Quad mul = (*routine)[i];
+            if ((mul.op != IR::MUL && mul.op != IR::IMUL) || !loops.contains(loop, cfg.block_of[i]))
+                continue;
+
+            uint32_t k;
+            if (mul.left.temp_id == t)
+                k = mul.right.temp_id;
+            else if (mul.right.temp_id == t)
+                k = mul.left.temp_id;
+            else
+                continue;
+            if (defs.loop_count[k] != 0)
+                continue;
+
+            uint32_t n = 0;
+            while (n < factors.get_size() && factors[n] != k)
+                n++;
+            if (n == factors.get_size())
+            {
+                uint32_t product = routine->temp_count++;
+                uint32_t stride = routine->temp_count++;
+                factors.push(k);
+                products.push(product);
+
+                Quad init = {};
+                init.op = mul.op;
+                init.target.temp_id = product;
+                init.left.temp_id = t;
+                init.right.temp_id = k;
+                preheader.push(init);
+
+                Quad stride_quad = {};
+                int64_t step_value, k_value;
+                stride_quad.target.temp_id = stride;
+                if (get_constant(routine, defs, step, &step_value) && get_constant(routine, defs, k, &k_value))
+                {
+                    stride_quad.op = IR::MOV_IM;
+                    stride_quad.left.int_value = (uint64_t)step_value * (uint64_t)k_value;
+                }
+                else
+                {
+                    stride_quad.op = mul.op;
+                    stride_quad.left.temp_id = step;
+                    stride_quad.right.temp_id = k;
+                }
+                preheader.push(stride_quad);
+
+                Quad next = {};
+                next.op = quad.op;
+                next.target.temp_id = product;
+                next.left.temp_id = product;
+                next.right.temp_id = stride;
+                added.push(next);
+                added_after.push(update);
+            }
+
+            Quad &copy = (*routine)[i];
+            copy.op = IR::MOV;
+            copy.left.temp_id = products[n];
+            copy.right.temp_id = 0;
+            use_count--;
+            changed = true;
+        }
+
+        // The value of t after the loop must not be needed.
+        bool live_out = false;
+        for (uint32_t b = 0; b < cfg.block_count() && !live_out; b++)
+        {
+            if (!cfg.reachable(b) || loops.contains(loop, b))
+                continue;
+            for (uint32_t k = 0; k < cfg.pred_count(b) && !live_out; k++)
+            {
+                uint64_t *live_in = liveness.in(b);
+                live_out = loops.contains(loop, cfg.pred(b, k)) && ((live_in[t / 64] >> (t % 64)) & 1);
+            }
+        }
+        if (live_out || use_count > 1)
+            continue;
+
+        if (use_count == 1)
+        {
+            uint32_t test = 0;
+            while (true)
+            {
+                uint32_t uses[2];
+                int count = get_uses((*routine)[test], uses);
+                if (test != update && loops.contains(loop, cfg.block_of[test]) &&
+                    ((count > 0 && uses[0] == t) || (count > 1 && uses[1] == t)))
+                {
+                    break;
+                }
+                test++;
+            }
+
+            bool replaced = false;
+            for (uint32_t n = 0; n < factors.get_size() && !replaced; n++)
+            {
+                replaced = replace_test(routine, cfg, loops, loop, defs, t, update, test,
+                                        products[n], factors[n], preheader);
+            }
+            if (!replaced)
+                continue;
+        }
+
+        removed[update] = true;
+        changed = true;
+    }
+
+    if (changed)
+        add_preheader(routine, cfg, loops, loop, preheader, removed, added, added_after);
+    return changed;
+}
+
+bool reduce_induction_variables(Routine *routine)
+{
+    // The products can be induction variables of the loops around the
+    // loop, so the loops are found again after each change.
+    bool reduced = false;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        CFG cfg;
+        cfg.build(routine);
+        Loops loops;
+        loops.find(cfg);
+
+        Liveness liveness;
+        liveness.compute(routine);
+
+        for (uint32_t loop = 0; loop < loops.count() && !changed; loop++)
+            changed = reduce_induction_variables(routine, cfg, liveness, loops, loop);
+        reduced = reduced || changed;
+    }
+    return reduced;
+}
+
+//
+// Tail recursion
+//
+
+void eliminate_tail_recursion(Routine *routine)
+{
+    uint32_t quad_count = routine->quad_count;
+    uint32_t param_count = routine->param_count;
+    uint32_t entry_label = quad_count; // The labels of the routine are quad indices.
+
+    List<Quad> quads;
+    Quad label = {};
+    label.op = IR::LABEL;
+    label.target.label = entry_label;
+    quads.push(label);
+
+    bool changed = false;
+    for (uint32_t i = 0; i < quad_count; i++)
+    {
+        Quad quad = (*routine)[i];
+
+        // The ARG quads are right before the CALL and the RET right after it.
+        uint32_t arg_start = i;
+        while (arg_start < quad_count && (*routine)[arg_start].op == IR::ARG)
+            arg_start++;
+        uint32_t ret = arg_start + 1;
+        while (ret < quad_count && (*routine)[ret].op == IR::NOP)
+            ret++;
+
+        bool tail_call = false;
+        if (arg_start - i == param_count && ret < quad_count && (*routine)[arg_start].op == IR::CALL)
+        {
+            Quad call = (*routine)[arg_start];
+            Quad last = (*routine)[ret];
+            tail_call = call.left.func_id == routine->id && last.op == IR::RET &&
+                        (!last.target.returns_something || last.left.temp_id == call.target.temp_id);
+        }
+
+        if (!tail_call)
+        {
+            quads.push(quad);
+            continue;
+        }
+
+        // The arguments are copied to new temps first because
+        // they can be computed from the params.
+        uint32_t temp_base = routine->temp_count;
+        routine->temp_count += param_count;
+        for (uint32_t k = i; k < arg_start; k++)
+        {
+            Quad arg = (*routine)[k];
+            Quad mov = {};
+            mov.op = IR::MOV;
+            mov.target.temp_id = temp_base + arg.target.arg_index;
+            mov.left = arg.left;
+            quads.push(mov);
+        }
+        for (uint32_t k = 0; k < param_count; k++)
+        {
+            Quad mov = {};
+            mov.op = IR::MOV;
+            mov.target.temp_id = k;
+            mov.left.temp_id = temp_base + k;
+            quads.push(mov);
+        }
+
+        Quad jmp = {};
+        jmp.op = IR::JMP;
+        jmp.target.label = entry_label;
+        quads.push(jmp);
+
+        i = ret;
+        changed = true;
+    }
+
+    if (changed)
+        set_quads(routine, quads);
+}
+
+//
+// Inlining
+//
+
+// Callees of at most this many quads (without labels and nops) are
+// inlined at every call site, and callees of at most INLINE_HOT_SIZE quads
+// at the hot ones. A call site is hot if it is in a loop or, with a profile,
+// if it ran at least INLINE_HOT_COUNT times. Call sites that never ran
+// aren't inlined. Routines don't grow past INLINE_MAX_QUADS by inlining.
+#define INLINE_SIZE 12
+#define INLINE_HOT_SIZE 48
+#define INLINE_HOT_COUNT 1000
+#define INLINE_MAX_QUADS 2000
+
+static uint32_t get_size(Routine *routine)
+{
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < routine->quad_count; i++)
+    {
+        IR::Type op = (*routine)[i].op;
+        if (op != IR::LABEL && op != IR::NOP)
+            size++;
+    }
+    return size;
+}
+
+/**
+ * A routine is recursive if it can call itself through other routines.
+ * Recursive routines are never inlined.
+ */
+static void find_recursive_routines(List<Routine *> &by_id, List<bool> &recursive)
+{
+    uint32_t routine_count = by_id.get_size();
+    recursive.resize(routine_count);
+
+    List<bool> reached;
+    List<uint32_t> work;
+    reached.resize(routine_count);
+    for (uint32_t r = 0; r < routine_count; r++)
+    {
+        for (uint32_t k = 0; k < routine_count; k++)
+            reached[k] = false;
+        work.resize(0);
+        work.push(r);
+
+        while (work.get_size() > 0)
+        {
+            Routine *routine = by_id[work[work.get_size() - 1]];
+            work.resize(work.get_size() - 1);
+            for (uint32_t i = 0; i < routine->quad_count; i++)
+            {
+                Quad &quad = (*routine)[i];
+                if (quad.op == IR::CALL && !reached[quad.left.func_id])
+                {
+                    reached[quad.left.func_id] = true;
+                    work.push(quad.left.func_id);
+                }
+            }
+        }
+
+        recursive[r] = reached[r];
+    }
+}
+
+/**
+ * Counts of the routine in the profile or null if it has none.
+ */
+static RoutineProfile *get_counts(Profile *profile, Routine *routine)
+{
+    if (profile == nullptr)
+        return nullptr;
+    RoutineProfile *counts = profile->find(routine->name);
+    if (counts && counts->quad_count != routine->quad_count)
+        return nullptr;
+    return counts;
+}
+
+/**
+ * Copies the quads of the callee in place of the CALL at index call and
+ * its ARG quads [arg_start, call). The arguments are moved to the params
+ * of the copy and each RET moves its value to the target of the CALL and
+ * jumps after the copy. The temps of the copy come after the temps of the
+ * routine and its labels start from label_base.
+ */
+static void add_inlined(Routine *routine, Routine *callee, uint32_t arg_start, uint32_t call,
+                        uint32_t label_base, List<Quad> &quads)
+{
+    Quad call_quad = (*routine)[call];
+    uint32_t temp_base = routine->temp_count;
+    routine->temp_count += callee->temp_count;
+    uint32_t end_label = label_base + callee->quad_count;
+
+    for (uint32_t i = arg_start; i < call; i++)
+    {
+        Quad arg = (*routine)[i];
+        Quad mov = {};
+        mov.op = IR::MOV;
+        mov.target.temp_id = temp_base + arg.target.arg_index;
+        mov.left = arg.left;
+        quads.push(mov);
+    }
+
+    for (uint32_t i = 0; i < callee->quad_count; i++)
+    {
+        Quad quad = (*callee)[i];
+
+        Operand *uses[2];
+        int use_count = get_use_operands(quad, uses);
+        for (int k = 0; k < use_count; k++)
+            uses[k]->temp_id += temp_base;
+        uint32_t def;
+        if (get_def(quad, &def))
+            quad.target.temp_id += temp_base;
+
+        switch (quad.op)
+        {
+            case IR::LABEL:
+            case IR::JMP:
+            case IR::JZ:
+            case IR::JNZ:
+                quad.target.label += label_base;
+                break;
+            case IR::RET:
+            {
+                if (quad.target.returns_something)
+                {
+                    Quad mov = {};
+                    mov.op = IR::MOV;
+                    mov.target = call_quad.target;
+                    mov.left = quad.left;
+                    quads.push(mov);
+                }
+                quad = Quad();
+                quad.op = IR::JMP;
+                quad.target.label = end_label;
+                if (i + 1 == callee->quad_count)
+                    quad.op = IR::NOP; // The label is next.
+                break;
+            }
+            default:
+                break;
+        }
+        quads.push(quad);
+    }
+
+    // Falling off the end returns 0.
+    IR::Type last = (callee->quad_count > 0) ? (*callee)[callee->quad_count - 1].op : IR::NOP;
+    if (last != IR::RET && last != IR::JMP)
+    {
+        Quad zero = {};
+        zero.op = IR::MOV_IM;
+        zero.target = call_quad.target;
+        zero.left.int_value = 0;
+        quads.push(zero);
+    }
+
+    Quad label = {};
+    label.op = IR::LABEL;
+    label.target.label = end_label;
+    quads.push(label);
+}
+
+/**
+ * Inlines the calls of the routine that fit the budget. With a profile
+ * the counts of the routine are updated to match its new quads: the
+ * counts of the inlined quads are those of the callee scaled by how
+ * many of its calls came from the call site. Returns true if some call
+ * was inlined.
+ */
+static bool inline_calls(Routine *routine, List<Routine *> &by_id, List<bool> &recursive, Profile *profile)
+{
+    uint32_t quad_count = routine->quad_count;
+    RoutineProfile *counts = get_counts(profile, routine);
+    if (profile && counts == nullptr)
+        return false; // The routine never ran.
+
+    // Quads between a backward jump and its label are in a loop.
+    List<int32_t> loop_depth;
+    loop_depth.resize(quad_count + 1);
+    for (uint32_t i = 0; i <= quad_count; i++)
+        loop_depth[i] = 0;
+    for (uint32_t i = 0; i < quad_count; i++)
+    {
+        Quad &quad = (*routine)[i];
+        if ((quad.op == IR::JMP || quad.op == IR::JZ || quad.op == IR::JNZ) && quad.target.label < i)
+        {
+            loop_depth[quad.target.label]++;
+            loop_depth[i + 1]--;
+        }
+    }
+    for (uint32_t i = 1; i <= quad_count; i++)
+        loop_depth[i] += loop_depth[i - 1];
+
+    List<Quad> quads;
+    List<uint64_t> new_counts;
+    List<uint64_t> new_taken;
+    uint32_t label_base = quad_count; // The labels of the routine are quad indices.
+    bool changed = false;
+
+    for (uint32_t i = 0; i < quad_count; i++)
+    {
+        Quad quad = (*routine)[i];
+        if (quad.op == IR::ARG)
+            continue; // Added with the CALL.
+
+        // The ARG quads are right before the CALL.
+        uint32_t arg_start = i;
+        if (quad.op == IR::CALL)
+        {
+            while (arg_start > 0 && (*routine)[arg_start - 1].op == IR::ARG)
+                arg_start--;
+        }
+
+        Routine *callee = (quad.op == IR::CALL) ? by_id[quad.left.func_id] : nullptr;
+        bool inlines = false;
+        if (callee && !callee->external && callee != routine && !recursive[callee->id] &&
+            i - arg_start == callee->param_count &&
+            quads.get_size() + callee->quad_count + quad_count - i <= INLINE_MAX_QUADS)
+        {
+            bool hot = loop_depth[i] > 0;
+            bool cold = false;
+            if (counts)
+            {
+                hot = counts->counts[i] >= INLINE_HOT_COUNT;
+                cold = counts->counts[i] == 0;
+            }
+            inlines = !cold && get_size(callee) <= (hot ? INLINE_HOT_SIZE : INLINE_SIZE);
+        }
+
+        if (!inlines)
+        {
+            for (uint32_t k = arg_start; k <= i; k++)
+            {
+                quads.push((*routine)[k]);
+                if (counts)
+                {
+                    new_counts.push(counts->counts[k]);
+                    new_taken.push(counts->taken[k]);
+                }
+            }
+            continue;
+        }
+
+        uint32_t first = quads.get_size();
+        add_inlined(routine, callee, arg_start, i, label_base, quads);
+        label_base += callee->quad_count + 1;
+        changed = true;
+
+        if (counts)
+        {
+            // The ARG quads became moves and the rest is the callee
+            // with a move before each RET and the label at the end.
+            uint64_t call_count = counts->counts[i];
+            RoutineProfile *callee_counts = get_counts(profile, callee);
+            uint64_t entry_count = callee_counts ? callee_counts->counts[0] : 0;
+            double scale = entry_count ? (double)call_count / (double)entry_count : 0.0;
+
+            for (uint32_t k = arg_start; k < i; k++)
+            {
+                new_counts.push(counts->counts[k]);
+                new_taken.push(0);
+            }
+            for (uint32_t k = 0; k < callee->quad_count; k++)
+            {
+                uint64_t count = callee_counts ? (uint64_t)(callee_counts->counts[k] * scale + 0.5) : 0;
+                uint64_t taken = callee_counts ? (uint64_t)(callee_counts->taken[k] * scale + 0.5) : 0;
+                Quad callee_quad = (*callee)[k];
+                if (callee_quad.op == IR::RET && callee_quad.target.returns_something)
+                {
+                    new_counts.push(count);
+                    new_taken.push(0);
+                }
+                new_counts.push(count);
+                new_taken.push(taken);
+            }
+            while (new_counts.get_size() < quads.get_size())
+            {
+                // The move of falling off the end and the label.
+                new_counts.push(call_count);
+                new_taken.push(0);
+            }
+            assert(new_counts.get_size() == quads.get_size() && quads.get_size() > first);
+        }
+    }
+
+    if (!changed)
+        return false;
+
+    set_quads(routine, quads);
+
+    if (counts)
+    {
+        counts = profile->reset(routine->name, routine->quad_count);
+        memcpy(counts->counts, &new_counts[0], sizeof(uint64_t) * routine->quad_count);
+        memcpy(counts->taken, &new_taken[0], sizeof(uint64_t) * routine->quad_count);
+    }
+
+    return true;
+}
+
+/**
+ * Inlines the calls of the routine after the calls of its callees.
+ */
+static void inline_bottom_up(Routine *routine, List<Routine *> &by_id, List<bool> &recursive,
+                             List<bool> &visited, Profile *profile)
+{
+    visited[routine->id] = true;
+    for (uint32_t i = 0; i < routine->quad_count; i++)
+    {
+        Quad &quad = (*routine)[i];
+        if (quad.op == IR::CALL && !visited[quad.left.func_id])
+            inline_bottom_up(by_id[quad.left.func_id], by_id, recursive, visited, profile);
+    }
+
+    if (routine->external)
+        return;
+
+    // NOTE: Inlining into a routine that isn't optimized again keeps the
+    // quad indices of the profile valid for the rest of the routines.
+    if (inline_calls(routine, by_id, recursive, profile) && profile == nullptr)
+        optimize(routine);
+}
+
+void inline_calls(IR ir, Profile *profile)
+{
+    List<Routine *> by_id;
+    for (Routine *routine = ir.routines; routine; routine = routine->next)
+    {
+        if (by_id.get_size() < routine->id + 1)
+            by_id.resize(routine->id + 1);
+        by_id[routine->id] = routine;
+    }
+
+    List<bool> recursive;
+    find_recursive_routines(by_id, recursive);
+
+    List<bool> visited;
+    visited.resize(by_id.get_size());
+    for (uint32_t i = 0; i < visited.get_size(); i++)
+        visited[i] = false;
+
+    // NOTE: The top level runs only once so its calls are left alone.
+    visited[ir.routines->id] = true;
+    for (Routine *routine = ir.routines->next; routine; routine = routine->next)
+    {
+        if (!visited[routine->id])
+            inline_bottom_up(routine, by_id, recursive, visited, profile);
+    }
+}
+
+//
+// Compile time evaluation of pure calls
+//
+
+// Calls and backward jumps one evaluated call may use.
+#define PURE_CALL_FUEL 100000
+
+/**
+ * A routine is pure if it calls only pure routines. There are no globals
+ * or pointers so calls to external routines are the only side effects.
+ */
+static void find_pure_routines(IR ir, List<bool> &pure)
+{
+    for (Routine *routine = ir.routines; routine; routine = routine->next)
+    {
+        if (pure.get_size() < routine->id + 1)
+            pure.resize(routine->id + 1);
+        pure[routine->id] = !routine->external;
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (Routine *routine = ir.routines; routine; routine = routine->next)
+        {
+            if (!pure[routine->id])
+                continue;
+            for (uint32_t i = 0; i < routine->quad_count; i++)
+            {
+                Quad &quad = (*routine)[i];
+                if (quad.op == IR::CALL && !pure[quad.left.func_id])
+                {
+                    pure[routine->id] = false;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static bool returns_value(Routine *routine)
+{
+    for (uint32_t i = 0; i < routine->quad_count; i++)
+    {
+        Quad &quad = (*routine)[i];
+        if (quad.op == IR::RET && quad.target.returns_something)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Replaces the calls to pure routines whose arguments are constants in
+ * the same block with the results. Returns true if some call was replaced.
+ */
+static bool evaluate_calls(VM &vm, List<bool> &pure, Routine *routine)
+{
+    bool changed = false;
+
+    List<uint64_t> values;
+    List<uint32_t> known_in; // Temp -> 1 + the block where the value is known.
+    values.resize(routine->temp_count);
+    known_in.resize(routine->temp_count);
+    for (uint32_t t = 0; t < routine->temp_count; t++)
+        known_in[t] = 0;
+
+    uint64_t args[MAX_NATIVE_PARAMS];
+
+    for (uint32_t b = 0; b < routine->block_count; b++)
+    {
+        BasicBlock block = routine->blocks[b];
+        for (uint32_t i = block.start; i < block.end; i++)
+        {
+            Quad &quad = (*routine)[i];
+            if (quad.op == IR::MOV_IM)
+            {
+                values[quad.target.temp_id] = quad.left.int_value;
+                known_in[quad.target.temp_id] = b + 1;
+                continue;
+            }
+
+            uint32_t def;
+            if (quad.op != IR::CALL)
+            {
+                if (get_def(quad, &def))
+                    known_in[def] = 0;
+                continue;
+            }
+
+            // The ARG quads are right before the CALL.
+            Routine *callee = vm.routines[quad.left.func_id].routine;
+            uint32_t param_count = callee->param_count;
+            uint32_t arg_start = i;
+            uint32_t known_args = 0;
+            while (arg_start > block.start && (*routine)[arg_start - 1].op == IR::ARG)
+            {
+                Quad &arg = (*routine)[--arg_start];
+                uint32_t temp_id = arg.left.temp_id;
+                if (arg.target.arg_index < param_count && param_count <= MAX_NATIVE_PARAMS &&
+                    known_in[temp_id] == b + 1)
+                {
+                    args[arg.target.arg_index] = values[temp_id];
+                    known_args++;
+                }
+            }
+
+            known_in[quad.target.temp_id] = 0;
+            if (!pure[callee->id] || known_args != param_count || i - arg_start != param_count ||
+                !returns_value(callee))
+                continue;
+
+            vm.fuel = PURE_CALL_FUEL;
+            uint64_t result = vm.call(callee->id, args, param_count);
+            if (vm.error)
+                continue;
+
+            for (uint32_t j = arg_start; j < i; j++)
+                (*routine)[j].op = IR::NOP;
+            quad.op = IR::MOV_IM;
+            quad.left.int_value = result;
+            values[quad.target.temp_id] = result;
+            known_in[quad.target.temp_id] = b + 1;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+//
+//
+//
+
+static void optimize(Routine *routine)
+{
+    eliminate_tail_recursion(routine);
+    fold_constants(routine);
+
+    SSA ssa;
+    ssa.build(routine);
+    propagate_copies(ssa, routine);
+    eliminate_dead_code(ssa, routine);
+    ssa.destroy(routine);
+
+    coalesce_copies(routine);
+    hoist_loop_invariants(routine);
+
+    // The copies of the products and the start values that only fed
+    // removed induction variables are cleaned up by another round.
+    if (reduce_induction_variables(routine))
+    {
+        fold_constants(routine);
+        ssa.build(routine);
+        propagate_copies(ssa, routine);
+        eliminate_dead_code(ssa, routine);
+        ssa.destroy(routine);
+        coalesce_copies(routine);
+    }
+}
+
+void evaluate_pure_calls(IR ir)
+{
+    List<bool> pure;
+    find_pure_routines(ir, pure);
+
+    VM vm;
+    vm.init(ir);
+
+    // The routines are optimized again only after the evaluation since
+    // the VM keeps the ops and frame layout of the routines it decoded.
+    // NOTE: The top level runs only once so its calls are left alone.
+    List<Routine *> changed;
+    for (Routine *routine = ir.routines->next; routine; routine = routine->next)
+    {
+        if (!routine->external && evaluate_calls(vm, pure, routine))
+            changed.push(routine);
+    }
+
+    for (uint32_t i = 0; i < changed.get_size(); i++)
+        optimize(changed[i]);
+}
+
+void optimize(IR ir)
+{
+    Routine *routine = ir.routines;
+    while (routine)
+    {
+        if (!routine->external)
+            optimize(routine);
+        routine = routine->next;
+    }
+
+    inline_calls(ir, nullptr);
+    evaluate_pure_calls(ir);
+}
@@ -0,0 +1,88 @@
+#ifndef IR_OPT_H
+#define IR_OPT_H
+
+#include "ir_gen.h"
+
+/**
+ * Runs the optimization passes on all routines of the IR.
+ * Optimized IR evaluates to the same values as the unoptimized one.
+ */
+void optimize(IR ir);
+
+/**
+ * Folds arithmetic and comparisons on constants and propagates the
+ * constant temps through the routine. Conditional jumps on constants
+ * become plain jumps or nops.
+ */
+void fold_constants(struct Routine *routine);
+
+/**
+ * Replaces the reads of temps that are copies of other temps
+ * with the reads of the originals. Phis whose arguments are all
+ * the same temp are copies too. The copies are left for the dead
+ * code elimination.
+ */
+void propagate_copies(struct SSA &ssa, struct Routine *routine);
+
+/**
+ * Removes the quads and phis whose results are never used and the
+ * blocks that can't be reached from the entry. Calls and divisions
+ * are kept. The removed quads become nops until the SSA form is
+ * destroyed.
+ */
+void eliminate_dead_code(struct SSA &ssa, struct Routine *routine);
+
+/**
+ * Gives the target and the source of a copy the same temp if their
+ * values are never live at the same time and removes the copy.
+ * Works on routines that are not in SSA form, e.g. on the copies
+ * that destroying the SSA form leaves on the edges.
+ */
+void coalesce_copies(struct Routine *routine);
+
+/**
+ * Finds the natural loops of the routine and moves the quads that
+ * compute the same value in every iteration to a preheader before the
+ * loop. Only quads that can't trap are moved because the preheader
+ * runs even if the loop body doesn't.
+ */
+void hoist_loop_invariants(struct Routine *routine);
+
+/**
+ * Replaces the products of induction variables and loop invariants
+ * in the loops of the routine with temps that are updated by additions
+ * along with the induction variables. Induction variables that are
+ * left only for the exit test are replaced in the test by a product.
+ * Returns true if the routine changed.
+ */
+bool reduce_induction_variables(struct Routine *routine);
+
+/**
+ * Turns the calls of the routine to itself whose result it returns
+ * right away into jumps to its entry. The arguments are moved to the
+ * params before the jump so the recursion runs as a loop.
+ */
+void eliminate_tail_recursion(struct Routine *routine);
+
+/**
+ * Evaluates the calls to pure routines whose arguments are constants
+ * at compile time and replaces them with their results. A routine is
+ * pure if it calls only other pure routines. Calls that take too long
+ * or divide by zero are left for the run time. The routines where
+ * calls were replaced are optimized again.
+ */
+void evaluate_pure_calls(IR ir);
+
+/**
+ * Copies the quads of small routines in place of the calls to them.
+ * The size limit is larger for the calls in loops and, with a profile,
+ * for the calls that ran often. Calls that never ran aren't inlined.
+ * Recursive routines and calls in the top level are left alone.
+ *
+ * Without a profile the routines where calls were inlined are optimized
+ * again. With one they are not, and their counts in the profile are
+ * updated for their new quads.
+ */
+void inline_calls(IR ir, struct Profile *profile);
+
+#endif // IR_OPT_H
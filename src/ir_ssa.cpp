@@ -0,0 +1,531 @@
+#include "ir_ssa.h"
+#include "liveness.h"
+#include "assert.h"
+
+/**
+ * Prepares the quads for the control flow graph of the SSA form.
+ * Conditional jumps to the next quad are removed so that there is
+ * at most one edge between two blocks, and the entry block gets a nop
+ * if it starts with a label so that it has no predecessors.
+ */
+static void normalize(Routine *routine)
+{
+    uint32_t quad_count = routine->quad_count;
+    for (uint32_t i = 0; i + 1 < quad_count; i++)
+    {
+        Quad &quad = (*routine)[i];
+        if ((quad.op == IR::JZ || quad.op == IR::JNZ) && quad.target.label == i + 1)
+            quad.op = IR::NOP;
+    }
+
+    if (quad_count > 0 && (*routine)[0].op == IR::LABEL)
+    {
+        List<Quad> quads;
+        quads.push((Quad){IR::NOP, {}, {}, {}});
+        for (uint32_t i = 0; i < quad_count; i++)
+            quads.push((*routine)[i]);
+        set_quads(routine, quads);
+    }
+    else
+    {
+        update_blocks(routine);
+    }
+}
+
+/**
+ * Renames the temps in a preorder walk of the dominator tree.
+ * The names that are replaced in a block are saved to a stack
+ * and restored when the walk leaves the block.
+ */
+struct Renamer
+{
+    Routine *routine;
+    SSA *ssa;
+    List<uint32_t> current; // var -> name at the current point
+    List<uint32_t> saved_var;
+    List<uint32_t> saved_name;
+
+    uint32_t new_name(uint32_t var)
+    {
+        uint32_t t = routine->temp_count++;
+        ssa->var_of.push(var);
+        saved_var.push(var);
+        saved_name.push(current[var]);
+        current[var] = t;
+        return t;
+    }
+
+    void rename_block(uint32_t b)
+    {
+        CFG &cfg = ssa->cfg;
+
+        for (uint32_t k = 0; k < ssa->phi_count(b); k++)
+        {
+            Phi &phi = ssa->phi(b, k);
+            phi.target = new_name(phi.var);
+        }
+
+        BasicBlock block = cfg.blocks[b];
+        for (uint32_t i = block.start; i < block.end; i++)
+        {
+            Quad &quad = (*routine)[i];
+
+            Operand *uses[2];
+            int use_count = get_use_operands(quad, uses);
+            for (int k = 0; k < use_count; k++)
+                uses[k]->temp_id = current[uses[k]->temp_id];
+
+            uint32_t t;
+            if (get_def(quad, &t))
+                quad.target.temp_id = new_name(t);
+        }
+
+        // Fill in the phi arguments of this edge in the successors.
+        for (int k = 0; k < 2; k++)
+        {
+            int32_t s = block.succ[k];
+            if (s < 0)
+                continue;
+            for (uint32_t j = 0; j < cfg.pred_count(s); j++)
+            {
+                if (cfg.pred(s, j) != b)
+                    continue;
+                for (uint32_t n = 0; n < ssa->phi_count(s); n++)
+                {
+                    Phi &phi = ssa->phi(s, n);
+                    ssa->arg(phi, j) = current[phi.var];
+                }
+            }
+        }
+    }
+
+    void rename()
+    {
+        CFG &cfg = ssa->cfg;
+
+        List<uint32_t> stack;
+        List<uint32_t> next_child;
+        List<uint32_t> mark; // size of the saved names when the block was entered
+
+        mark.push(saved_var.get_size());
+        rename_block(0);
+        stack.push(0);
+        next_child.push(0);
+        while (stack.get_size() > 0)
+        {
+            uint32_t top = stack.get_size() - 1;
+            uint32_t b = stack[top];
+            uint32_t k = next_child[top]++;
+            if (k < cfg.child_count(b))
+            {
+                uint32_t c = cfg.child(b, k);
+                mark.push(saved_var.get_size());
+                rename_block(c);
+                stack.push(c);
+                next_child.push(0);
+                continue;
+            }
+
+            uint32_t m = mark.pop();
+            while (saved_var.get_size() > m)
+                current[saved_var.pop()] = saved_name.pop();
+            stack.pop();
+            next_child.pop();
+        }
+    }
+};
+
+void SSA::build(Routine *routine)
+{
+    normalize(routine);
+    cfg.build(routine);
+
+    var_count = routine->temp_count;
+    uint32_t block_count = cfg.block_count();
+
+    var_of.resize(var_count);
+    for (uint32_t t = 0; t < var_count; t++)
+        var_of[t] = t;
+
+    phis.resize(0);
+    phi_args.resize(0);
+    phi_start.resize(block_count + 1);
+    for (uint32_t b = 0; b <= block_count; b++)
+        phi_start[b] = 0;
+    if (block_count == 0)
+        return;
+
+    // Blocks where each var is defined. Params are defined at the entry.
+    List<uint32_t> def_var;
+    List<uint32_t> def_block;
+    for (uint32_t t = 0; t < routine->param_count; t++)
+    {
+        def_var.push(t);
+        def_block.push(0);
+    }
+    for (uint32_t i = 0; i < cfg.rpo.get_size(); i++)
+    {
+        uint32_t b = cfg.rpo[i];
+        for (uint32_t q = cfg.blocks[b].start; q < cfg.blocks[b].end; q++)
+        {
+            uint32_t t;
+            if (get_def((*routine)[q], &t))
+            {
+                def_var.push(t);
+                def_block.push(b);
+            }
+        }
+    }
+    List<uint32_t> def_start;
+    List<uint32_t> defs;
+    make_lists(var_count, def_var, def_block, def_start, defs);
+
+    // Phis go to the iterated dominance frontier of the definitions,
+    // but only where the var is live.
+    Liveness liveness;
+    liveness.compute(routine);
+
+    List<int32_t> has_phi; // block -> last var that got a phi there
+    List<int32_t> queued;  // block -> last var for which the block was in the work list
+    has_phi.resize(block_count);
+    queued.resize(block_count);
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        has_phi[b] = -1;
+        queued[b] = -1;
+    }
+
+    List<uint32_t> phi_block;
+    List<uint32_t> phi_var;
+    List<uint32_t> work;
+    for (uint32_t v = 0; v < var_count; v++)
+    {
+        work.resize(0);
+        for (uint32_t k = def_start[v]; k < def_start[v + 1]; k++)
+        {
+            uint32_t d = defs[k];
+            if (queued[d] != (int32_t)v)
+            {
+                queued[d] = v;
+                work.push(d);
+            }
+        }
+
+        uint64_t bit = 1ull << (v % 64);
+        while (work.get_size() > 0)
+        {
+            uint32_t d = work.pop();
+            for (uint32_t k = 0; k < cfg.df_count(d); k++)
+            {
+                uint32_t y = cfg.frontier(d, k);
+                if (has_phi[y] == (int32_t)v || !(liveness.in(y)[v / 64] & bit))
+                    continue;
+
+                has_phi[y] = v;
+                phi_block.push(y);
+                phi_var.push(v);
+                if (queued[y] != (int32_t)v)
+                {
+                    queued[y] = v;
+                    work.push(y);
+                }
+            }
+        }
+    }
+
+    List<uint32_t> vars;
+    make_lists(block_count, phi_block, phi_var, phi_start, vars);
+    phis.resize(vars.get_size());
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        for (uint32_t k = phi_start[b]; k < phi_start[b + 1]; k++)
+        {
+            Phi &phi = phis[k];
+            phi.block = b;
+            phi.var = vars[k];
+            phi.target = vars[k];
+            phi.args = phi_args.get_size();
+
+            // Arguments from unreachable blocks stay as the original var.
+            for (uint32_t j = 0; j < cfg.pred_count(b); j++)
+                phi_args.push(phi.var);
+        }
+    }
+
+    Renamer renamer;
+    renamer.routine = routine;
+    renamer.ssa = this;
+    renamer.current.resize(var_count);
+    for (uint32_t v = 0; v < var_count; v++)
+        renamer.current[v] = v;
+    renamer.rename();
+}
+
+/**
+ * Move of a parallel copy.
+ */
+struct Copy
+{
+    uint32_t dest;
+    uint32_t src;
+};
+
+/**
+ * Emits the moves for the phis of block s on the edge from block b.
+ * The phis read their arguments at the same time, so the moves are
+ * ordered so that no source is overwritten before it is read.
+ * Cycles are broken with a new temp.
+ */
+static void emit_copies(SSA &ssa, Routine *routine, uint32_t b, uint32_t s, List<Quad> &quads)
+{
+    CFG &cfg = ssa.cfg;
+    if (ssa.phi_count(s) == 0)
+        return;
+
+    uint32_t j = 0;
+    while (cfg.pred(s, j) != b)
+        j++;
+
+    List<Copy> copies;
+    for (uint32_t k = 0; k < ssa.phi_count(s); k++)
+    {
+        Phi &phi = ssa.phi(s, k);
+        Copy copy = {phi.target, ssa.arg(phi, j)};
+        if (copy.dest != copy.src)
+            copies.push(copy);
+    }
+
+    while (copies.get_size() > 0)
+    {
+        // Find a move whose target is not read by the other moves.
+        uint32_t count = copies.get_size();
+        uint32_t ready = count;
+        for (uint32_t i = 0; i < count && ready == count; i++)
+        {
+            ready = i;
+            for (uint32_t k = 0; k < count; k++)
+            {
+                if (k != i && copies[k].src == copies[i].dest)
+                {
+                    ready = count;
+                    break;
+                }
+            }
+        }
+
+        if (ready == count)
+        {
+            // Only cycles are left. Save one target to a new temp.
+            uint32_t dest = copies[0].dest;
+            uint32_t temp = routine->temp_count++;
+            ssa.var_of.push(ssa.var_of[dest]);
+
+            Quad quad = {IR::MOV, {}, {}, {}};
+            quad.target.temp_id = temp;
+            quad.left.temp_id = dest;
+            quads.push(quad);
+
+            for (uint32_t k = 0; k < count; k++)
+            {
+                if (copies[k].src == dest)
+                    copies[k].src = temp;
+            }
+            continue;
+        }
+
+        Quad quad = {IR::MOV, {}, {}, {}};
+        quad.target.temp_id = copies[ready].dest;
+        quad.left.temp_id = copies[ready].src;
+        quads.push(quad);
+
+        copies[ready] = copies[count - 1];
+        copies.pop();
+    }
+}
+
+/**
+ * Copies the quads [start, end) of the routine without the nops.
+ */
+static void copy_quads(Routine *routine, uint32_t start, uint32_t end, List<Quad> &quads)
+{
+    for (uint32_t i = start; i < end; i++)
+    {
+        Quad quad = (*routine)[i];
+        if (quad.op != IR::NOP)
+            quads.push(quad);
+    }
+}
+
+void SSA::destroy(Routine *routine)
+{
+    uint32_t block_count = cfg.block_count();
+
+    List<Quad> quads;
+    List<Quad> split; // Blocks for the moves on jump edges. They go to the end.
+    uint32_t next_label = routine->quad_count; // Labels are quad indices, so these are unique.
+
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        BasicBlock block = cfg.blocks[b];
+        Quad last = (*routine)[block.end - 1];
+
+        if (!cfg.reachable(b))
+        {
+            copy_quads(routine, block.start, block.end, quads);
+            continue;
+        }
+
+        switch (last.op)
+        {
+            case IR::JMP:
+            {
+                copy_quads(routine, block.start, block.end - 1, quads);
+                emit_copies(*this, routine, b, block.succ[0], quads);
+                quads.push(last);
+                break;
+            }
+            case IR::JZ:
+            case IR::JNZ:
+            {
+                int32_t target = block.succ[1];
+                if (target >= 0 && phi_count(target) > 0)
+                {
+                    Quad label = {IR::LABEL, {}, {}, {}};
+                    label.target.label = next_label++;
+                    split.push(label);
+                    emit_copies(*this, routine, b, target, split);
+                    Quad jump = {IR::JMP, {}, {}, {}};
+                    jump.target.label = last.target.label;
+                    split.push(jump);
+
+                    last.target.label = label.target.label;
+                }
+
+                copy_quads(routine, block.start, block.end - 1, quads);
+                quads.push(last);
+
+                // The moves after the jump are done only when it falls through.
+                if (block.succ[0] >= 0)
+                    emit_copies(*this, routine, b, block.succ[0], quads);
+                break;
+            }
+            default:
+            {
+                copy_quads(routine, block.start, block.end, quads);
+                if (block.succ[0] >= 0)
+                    emit_copies(*this, routine, b, block.succ[0], quads);
+                break;
+            }
+        }
+    }
+
+    if (split.get_size() > 0)
+    {
+        uint32_t count = quads.get_size();
+        if (count == 0 || (quads[count - 1].op != IR::JMP && quads[count - 1].op != IR::RET))
+        {
+            Quad ret = {IR::RET, {}, {}, {}};
+            ret.target.returns_something = false;
+            quads.push(ret);
+        }
+        for (uint32_t i = 0; i < split.get_size(); i++)
+            quads.push(split[i]);
+    }
+
+    set_quads(routine, quads);
+
+    phis.resize(0);
+    phi_args.resize(0);
+    for (uint32_t b = 0; b <= block_count; b++)
+        phi_start[b] = 0;
+}
+
+bool SSA::verify(Routine *routine)
+{
+    uint32_t temp_count = routine->temp_count;
+    uint32_t block_count = cfg.block_count();
+
+    // Block and quad index of the definition of each temp.
+    // Phis are defined before the first quad of the block.
+    List<int32_t> def_block;
+    List<int32_t> def_quad;
+    def_block.resize(temp_count);
+    def_quad.resize(temp_count);
+    for (uint32_t t = 0; t < temp_count; t++)
+    {
+        def_block[t] = -1;
+        def_quad[t] = -1;
+    }
+
+    for (uint32_t i = 0; i < phis.get_size(); i++)
+    {
+        Phi &phi = phis[i];
+        if (!cfg.reachable(phi.block) || def_block[phi.target] >= 0 || phi.target < var_count)
+            return false;
+        def_block[phi.target] = phi.block;
+    }
+
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        if (!cfg.reachable(b))
+            continue;
+        for (uint32_t i = cfg.blocks[b].start; i < cfg.blocks[b].end; i++)
+        {
+            uint32_t t;
+            if (!get_def((*routine)[i], &t))
+                continue;
+            if (def_block[t] >= 0 || t < var_count)
+                return false;
+            def_block[t] = b;
+            def_quad[t] = i;
+        }
+    }
+
+    // Temps without a definition are the values at the entry.
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        if (!cfg.reachable(b))
+            continue;
+
+        for (uint32_t i = cfg.blocks[b].start; i < cfg.blocks[b].end; i++)
+        {
+            uint32_t uses[2];
+            int use_count = get_uses((*routine)[i], uses);
+            for (int k = 0; k < use_count; k++)
+            {
+                int32_t d = def_block[uses[k]];
+                if (d < 0)
+                {
+                    if (uses[k] >= var_count)
+                        return false;
+                    continue;
+                }
+                if (d == (int32_t)b ? def_quad[uses[k]] >= (int32_t)i : !cfg.dominates(d, b))
+                    return false;
+            }
+        }
+
+        // Phi arguments are read at the end of the predecessor.
+        for (uint32_t n = 0; n < phi_count(b); n++)
+        {
+            Phi &p = phi(b, n);
+            for (uint32_t j = 0; j < cfg.pred_count(b); j++)
+            {
+                uint32_t pred = cfg.pred(b, j);
+                uint32_t a = arg(p, j);
+                if (!cfg.reachable(pred))
+                    continue;
+                if (def_block[a] < 0)
+                {
+                    if (a >= var_count)
+                        return false;
+                    continue;
+                }
+                if (!cfg.dominates(def_block[a], pred))
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
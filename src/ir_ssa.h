@@ -0,0 +1,56 @@
+#ifndef IR_SSA_H
+#define IR_SSA_H
+
+#include "ir.h"
+#include "ir_cfg.h"
+#include "list.h"
+
+/**
+ * Phi function at the start of a block. It has one argument for
+ * each predecessor of the block in the order of CFG::preds.
+ */
+struct Phi
+{
+    uint32_t block;
+    uint32_t var;    // Temp id before renaming.
+    uint32_t target;
+    uint32_t args;   // Index of the first argument in SSA::phi_args.
+};
+
+/**
+ * Static single assignment form of a routine.
+ *
+ * build() renames the temps of the routine in place so that every temp
+ * is written by one quad or phi only. The original ids are kept for the
+ * values at the entry (parameters and reads of uninitialized vars).
+ * Quads have only two operands so the phis are kept in a table beside
+ * the quads. Phis are placed only where the variable is live.
+ *
+ * destroy() turns the phis into moves on the incoming edges and the
+ * routine is ordinary IR again. Nops are dropped. Blocks that can't be
+ * reached from the entry are not renamed and they are left as they are.
+ */
+struct SSA
+{
+    CFG cfg;
+    uint32_t var_count;       // Temp count before renaming.
+    List<Phi> phis;           // Sorted by block.
+    List<uint32_t> phi_start; // Phis of block b are phis[phi_start[b]] ... phis[phi_start[b + 1] - 1].
+    List<uint32_t> phi_args;
+    List<uint32_t> var_of;    // Temp id -> temp id before renaming.
+
+    void build(Routine *routine);
+    void destroy(Routine *routine);
+
+    /**
+     * Checks that every temp is written once and that
+     * the definitions dominate the uses.
+     */
+    bool verify(Routine *routine);
+
+    uint32_t phi_count(uint32_t b) { return phi_start[b + 1] - phi_start[b]; }
+    Phi &phi(uint32_t b, uint32_t k) { return phis[phi_start[b] + k]; }
+    uint32_t &arg(Phi &phi, uint32_t k) { return phi_args[phi.args + k]; }
+};
+
+#endif // IR_SSA_H
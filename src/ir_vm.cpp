@@ -0,0 +1,744 @@
+#include "ir_vm.h"
+#include "ir.h"
+#include "assert.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// NOTE: The pairs are counted in the switch and the ops aren't fused
+// so that the counts tell which pairs would be worth fusing.
+#ifdef VM_PAIR_STATS
+#undef VM_THREADED
+#define VM_THREADED 0
+#endif
+
+#ifndef VM_THREADED
+#if defined(__GNUC__)
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+#endif
+
+void VM::init(IR ir_)
+{
+    ir = ir_;
+    jit = nullptr;
+    hot_threshold = 0;
+    fuel = UINT64_MAX;
+    error = nullptr;
+    profiling = false;
+#ifdef VM_PAIR_STATS
+    memset(pair_counts, 0, sizeof(pair_counts));
+#endif
+
+    routines.resize(0);
+    for (Routine *routine = ir.routines; routine; routine = routine->next)
+    {
+        if (routines.get_size() < routine->id + 1)
+            routines.resize(routine->id + 1);
+
+        VMRoutine &vm_routine = routines[routine->id];
+        vm_routine.routine = routine;
+        vm_routine.ops = nullptr;
+        vm_routine.op_count = 0;
+        vm_routine.frame_size = 0;
+        vm_routine.heat = 0;
+        vm_routine.native = nullptr;
+        vm_routine.no_native = false;
+        vm_routine.counters = nullptr;
+        vm_routine.counter_of = nullptr;
+    }
+}
+
+bool VM::link(DynLibs &libs)
+{
+    for (uint32_t i = 0; i < routines.get_size(); i++)
+    {
+        Routine *routine = routines[i].routine;
+        if (!routine->external)
+            continue;
+
+        if (routine->param_count > MAX_NATIVE_PARAMS)
+        {
+            fprintf(stderr, "error: external function '%s' has more than %d parameters\n",
+                    routine->name.data, MAX_NATIVE_PARAMS);
+            return false;
+        }
+
+        routines[i].native = libs.find(routine->name);
+        if (routines[i].native == nullptr)
+        {
+            fprintf(stderr, "error: external function '%s' not found\n", routine->name.data);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VM::find(Str name, uint32_t *routine_id)
+{
+    for (uint32_t i = 0; i < routines.get_size(); i++)
+    {
+        if (routines[i].routine->name == name)
+        {
+            *routine_id = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static VMOpcode get_opcode(IR::Type op)
+{
+    switch (op)
+    {
+#define PASTE_VM_OP(x) case IR::x: return VMOp_##x;
+        PASTE_VM_OP(MOV_IM)
+        PASTE_VM_OP(MOV)
+        PASTE_VM_OP(NOT)
+        PASTE_VM_OP(NEG)
+        PASTE_VM_OP(MUL)
+        PASTE_VM_OP(IMUL)
+        PASTE_VM_OP(DIV)
+        PASTE_VM_OP(IDIV)
+        PASTE_VM_OP(ADD)
+        PASTE_VM_OP(SUB)
+        PASTE_VM_OP(EQ)
+        PASTE_VM_OP(NE)
+        PASTE_VM_OP(LT)
+        PASTE_VM_OP(BELOW)
+        PASTE_VM_OP(GT)
+        PASTE_VM_OP(ABOVE)
+        PASTE_VM_OP(LE)
+        PASTE_VM_OP(BE)
+        PASTE_VM_OP(GE)
+        PASTE_VM_OP(AE)
+        PASTE_VM_OP(JMP)
+        PASTE_VM_OP(JZ)
+        PASTE_VM_OP(JNZ)
+        PASTE_VM_OP(ARG)
+        PASTE_VM_OP(CALL)
+#undef PASTE_VM_OP
+        InvalidDefaultCase;
+    }
+    return VMOp_COUNT;
+}
+
+#ifndef VM_PAIR_STATS
+/**
+ * Returns the superinstruction of the pair or VMOp_COUNT if there is none.
+ */
+static VMOpcode get_super_opcode(VMOpcode first, VMOpcode second)
+{
+#define PASTE_VM_SUPER_OP(x, y) \
+    if (first == VMOp_##x && second == VMOp_##y) return VMOp_##x##_##y;
+    PASTE_VM_SUPER_OPS
+#undef PASTE_VM_SUPER_OP
+    return VMOp_COUNT;
+}
+#endif
+
+void VM::decode(VMRoutine *vm_routine)
+{
+    Routine *routine = vm_routine->routine;
+    uint32_t quad_count = routine->external ? 0 : routine->quad_count;
+    uint32_t temp_count = routine->temp_count;
+    uint32_t max_args = 0;
+
+    // Labels and nops have no ops so the jump targets move.
+    List<VMOp> ops;
+    List<uint32_t> op_of;  // quad index -> index of the first op at or after it
+    List<bool> is_target;  // op index -> true if there is a label before the op
+    op_of.resize(quad_count + 1);
+    bool labeled = false;
+
+    // When profiling, a PROFILE op starts each block and another one
+    // follows each JZ and JNZ to count how often they don't jump.
+    // The counts of the quads are read through counter_of.
+    uint32_t *counter_of = nullptr;
+    uint32_t *counter_at = nullptr;
+    uint32_t counter_count = 0;
+    if (profiling)
+    {
+        counter_of = a.allocate_array<uint32_t>(quad_count + 1);
+        counter_at = a.allocate_array<uint32_t>(quad_count + 1);
+        counter_count = place_counters(routine, counter_of, counter_at);
+    }
+
+    VMOp profile = {};
+    profile.opcode = VMOp_PROFILE;
+
+    for (uint32_t i = 0; i <= quad_count; i++)
+    {
+        op_of[i] = ops.get_size();
+
+        // RET_VOID for falling off the end.
+        Quad quad = {};
+        quad.op = IR::RET;
+        if (i < quad_count)
+            quad = (*routine)[i];
+
+        if (quad.op == IR::LABEL)
+        {
+            labeled = true;
+            continue;
+        }
+        if (quad.op == IR::NOP)
+            continue;
+
+        if (profiling && counter_at[i] != NO_COUNTER)
+        {
+            profile.imm = counter_at[i];
+            ops.push(profile);
+            is_target.push(labeled);
+            labeled = false;
+        }
+
+        VMOp op;
+        op.target = quad.target.temp_id;
+        op.left = quad.left.temp_id;
+        op.imm = 0;
+
+        switch (quad.op)
+        {
+            case IR::MOV_IM:
+                op.opcode = VMOp_MOV_IM;
+                op.imm = quad.left.int_value;
+                break;
+            case IR::JMP:
+            case IR::JZ:
+            case IR::JNZ:
+                // The label is resolved when all ops are known.
+                op.opcode = get_opcode(quad.op);
+                op.target = quad.target.label;
+                break;
+            case IR::ARG:
+                // The argument goes to the param of the callee
+                // whose frame starts right after the temps.
+                op.opcode = VMOp_ARG;
+                op.target = temp_count + quad.target.arg_index;
+                if (quad.target.arg_index + 1 > max_args)
+                    max_args = quad.target.arg_index + 1;
+                break;
+            case IR::CALL:
+                op.opcode = VMOp_CALL;
+                op.callee = &routines[quad.left.func_id];
+                break;
+            case IR::RET:
+                op.opcode = quad.target.returns_something ? VMOp_RET : VMOp_RET_VOID;
+                break;
+            default:
+                op.opcode = get_opcode(quad.op);
+                op.right = quad.right.temp_id;
+                break;
+        }
+
+        ops.push(op);
+        is_target.push(labeled);
+        labeled = false;
+
+        if (profiling && (quad.op == IR::JZ || quad.op == IR::JNZ))
+        {
+            profile.imm = counter_of[i] + 1;
+            ops.push(profile);
+            is_target.push(false);
+        }
+    }
+
+    uint32_t op_count = ops.get_size();
+    VMOp *code = a.allocate_array<VMOp>(op_count);
+    memcpy(code, &ops[0], sizeof(VMOp) * op_count);
+
+    uint64_t *counters = nullptr;
+    if (profiling)
+    {
+        counters = a.allocate_array<uint64_t>(counter_count);
+        memset(counters, 0, sizeof(uint64_t) * counter_count);
+    }
+
+    for (uint32_t i = 0; i < op_count; i++)
+    {
+        VMOp &op = code[i];
+        switch (op.opcode)
+        {
+            case VMOp_JMP:
+            case VMOp_JZ:
+            case VMOp_JNZ:
+                op.jump = code + op_of[op.target];
+                if (op.opcode == VMOp_JMP && op.jump <= &op)
+                    op.opcode = VMOp_LOOP;
+                break;
+            case VMOp_PROFILE:
+                op.counter = counters + op.imm;
+                break;
+            default:
+                break;
+        }
+    }
+
+#ifndef VM_PAIR_STATS
+    for (uint32_t i = 0; i + 1 < op_count; i++)
+    {
+        if (is_target[i + 1])
+            continue;
+        VMOpcode super = get_super_opcode((VMOpcode)code[i].opcode, (VMOpcode)code[i + 1].opcode);
+        if (super != VMOp_COUNT)
+        {
+            code[i].opcode = super;
+            i++; // The second op can't start another pair.
+        }
+    }
+#endif
+
+    vm_routine->ops = code;
+    vm_routine->op_count = op_count;
+    vm_routine->frame_size = temp_count + max_args;
+    vm_routine->counters = counters;
+    vm_routine->counter_of = counter_of;
+}
+
+bool VM::add_profile(Profile &profile)
+{
+    for (uint32_t i = 0; i < routines.get_size(); i++)
+    {
+        VMRoutine &vm_routine = routines[i];
+        if (vm_routine.counters == nullptr)
+            continue;
+
+        Routine *routine = vm_routine.routine;
+        RoutineProfile *counts = profile.add(routine->name, routine->quad_count);
+        if (counts == nullptr)
+            return false;
+
+        counts->add_counters(routine, vm_routine.counter_of, vm_routine.counters);
+    }
+    return true;
+}
+
+void VM::compile(VMRoutine *hot)
+{
+    uint32_t routine_count = routines.get_size();
+    List<bool> selected;
+    selected.resize(routine_count);
+    for (uint32_t i = 0; i < routine_count; i++)
+        selected[i] = false;
+
+    List<uint32_t> work;
+    work.push(hot->routine->id);
+    while (work.get_size() > 0)
+    {
+        uint32_t id = work.pop();
+        Routine *routine = routines[id].routine;
+        if (selected[id] || routine->external)
+            continue;
+        if (id < jit->entries.get_size() && jit->entries[id])
+            continue;
+        if (routines[id].no_native)
+        {
+            // It didn't compile before so the hot routine won't either.
+            hot->no_native = true;
+            return;
+        }
+
+        selected[id] = true;
+        for (uint32_t i = 0; i < routine->quad_count; i++)
+        {
+            Quad &quad = (*routine)[i];
+            if (quad.op == IR::CALL)
+                work.push(quad.left.func_id);
+        }
+    }
+
+    bool ok = jit->compile(ir, &selected[0]);
+    for (uint32_t i = 0; i < routine_count; i++)
+    {
+        if (!selected[i])
+            continue;
+        if (ok && routines[i].routine->param_count <= MAX_NATIVE_PARAMS)
+            routines[i].native = jit->entries[i];
+        else
+            routines[i].no_native = true;
+    }
+}
+
+/**
+ * Calls machine code with the arguments in registers and in the stack
+ * as the calling convention of the host wants. Extra arguments are
+ * ignored by the called routine.
+ */
+static uint64_t call_native(void *native, uint64_t *params, uint32_t param_count)
+{
+    typedef uint64_t (*NativeRoutine)(uint64_t, uint64_t, uint64_t, uint64_t,
+                                      uint64_t, uint64_t, uint64_t, uint64_t,
+                                      uint64_t, uint64_t, uint64_t, uint64_t,
+                                      uint64_t, uint64_t, uint64_t, uint64_t);
+    uint64_t a[MAX_NATIVE_PARAMS] = {};
+    for (uint32_t i = 0; i < param_count; i++)
+        a[i] = params[i];
+    NativeRoutine f = (NativeRoutine)native;
+    return f(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7],
+             a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15]);
+}
+
+uint64_t VM::call(uint32_t routine_id, uint64_t *args, uint32_t arg_count)
+{
+    VMRoutine *vm_routine = &routines[routine_id];
+    if (vm_routine->native)
+        return call_native(vm_routine->native, args, vm_routine->routine->param_count);
+
+    if (stack.get_size() < arg_count)
+        stack.resize(arg_count);
+    for (uint32_t i = 0; i < arg_count; i++)
+        stack[i] = args[i];
+    returns.resize(0);
+    error = nullptr;
+    return execute(vm_routine, 0);
+}
+
+#ifdef VM_PAIR_STATS
+#define PASTE_VM_OP(x) #x,
+#define PASTE_VM_SUPER_OP(x, y) #x "_" #y,
+static const char *op_names[] =
+{
+    PASTE_VM_OPS
+    PASTE_VM_SUPER_OPS
+};
+#undef PASTE_VM_OP
+#undef PASTE_VM_SUPER_OP
+
+struct PairCount
+{
+    uint32_t first;
+    uint32_t second;
+    uint64_t count;
+};
+
+static int compare_pair_counts(const void *a, const void *b)
+{
+    uint64_t count_a = ((const PairCount *)a)->count;
+    uint64_t count_b = ((const PairCount *)b)->count;
+    return (count_a < count_b) - (count_a > count_b);
+}
+
+void VM::print_pair_stats(FILE *f)
+{
+    List<PairCount> pairs;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < VMOp_COUNT; i++)
+    {
+        for (uint32_t j = 0; j < VMOp_COUNT; j++)
+        {
+            if (pair_counts[i][j] == 0)
+                continue;
+            PairCount pair = {i, j, pair_counts[i][j]};
+            pairs.push(pair);
+            total += pair.count;
+        }
+    }
+    if (pairs.get_size() == 0)
+        return;
+
+    qsort(&pairs[0], pairs.get_size(), sizeof(PairCount), compare_pair_counts);
+
+    fprintf(f, "%-12s %-12s %12s %6s\n", "first", "second", "count", "%");
+    for (uint32_t i = 0; i < pairs.get_size() && i < 20; i++)
+    {
+        PairCount pair = pairs[i];
+        fprintf(f, "%-12s %-12s %12llu %6.2f\n", op_names[pair.first], op_names[pair.second],
+                (unsigned long long)pair.count, 100.0 * pair.count / total);
+    }
+}
+#endif
+
+// NOTE: With direct threading every handler jumps to the next one.
+// The switch version jumps back to the switch.
+// A superinstruction goes straight to the handler of its second op.
+#if VM_THREADED
+#define VM_CASE(x) vm_##x:
+#define VM_DISPATCH() goto *op->handler
+#define VM_PATCH(op, x) (op)->handler = handlers[VMOp_##x]
+#define VM_GOTO(x) goto vm_##x
+#else
+#define VM_CASE(x) case VMOp_##x:
+#define VM_DISPATCH() goto dispatch
+#define VM_PATCH(op, x) (op)->opcode = VMOp_##x
+#define VM_GOTO(x) goto dispatch
+#endif
+
+#define VM_NEXT() do { op++; VM_DISPATCH(); } while (0)
+#define VM_JUMP(to) do { op = (to); VM_DISPATCH(); } while (0)
+
+// Returns from execute() when the routine it was called with returns.
+#define VM_RETURN()                                 \
+    do                                              \
+    {                                               \
+        if (returns.get_size() == return_depth)     \
+            return result;                          \
+        VMReturn ret = returns.pop();               \
+        current = ret.routine;                      \
+        base = ret.base;                            \
+        fp = &stack[0] + base;                      \
+        fp[ret.target] = result;                    \
+        VM_JUMP(ret.op);                            \
+    } while (0)
+
+// Stops the run.
+#define VM_STOP(message)                            \
+    do                                              \
+    {                                               \
+        error = message;                            \
+        returns.resize(return_depth);               \
+        return 0;                                   \
+    } while (0)
+
+#define VM_BINARY(x, type, expr)                \
+    VM_CASE(x)                                  \
+    {                                           \
+        type l = (type)fp[op->left];            \
+        type r = (type)fp[op->right];           \
+        fp[op->target] = (uint64_t)(expr);      \
+        VM_NEXT();                              \
+    }
+
+// Division by zero and INT64_MIN / -1 trap on AMD64.
+#define VM_DIVIDE(x, type, is_signed)                                       \
+    VM_CASE(x)                                                              \
+    {                                                                       \
+        type l = (type)fp[op->left];                                        \
+        type r = (type)fp[op->right];                                       \
+        if (r == 0 || (is_signed && r == (type)-1 && l == (type)INT64_MIN)) \
+            VM_STOP("division by zero or overflow");                        \
+        fp[op->target] = (uint64_t)(l / r);                                 \
+        VM_NEXT();                                                          \
+    }
+
+// Superinstruction of MOV_IM and the op after it.
+#define VM_MOV_IM_AND(x)                        \
+    VM_CASE(MOV_IM_##x)                         \
+    {                                           \
+        fp[op->target] = op->imm;               \
+        op++;                                   \
+        VM_GOTO(x);                             \
+    }
+
+// Superinstruction of a comparison and the jump after it.
+#define VM_COMPARE_AND(x, jump, type, expr)     \
+    VM_CASE(x##_##jump)                         \
+    {                                           \
+        type l = (type)fp[op->left];            \
+        type r = (type)fp[op->right];           \
+        fp[op->target] = (uint64_t)(expr);      \
+        op++;                                   \
+        VM_GOTO(jump);                          \
+    }
+
+uint64_t VM::execute(VMRoutine *entry, uint32_t base)
+{
+#if VM_THREADED
+#define PASTE_VM_OP(x) &&vm_##x,
+#define PASTE_VM_SUPER_OP(x, y) &&vm_##x##_##y,
+    static const void *handlers[] =
+    {
+        PASTE_VM_OPS
+        PASTE_VM_SUPER_OPS
+    };
+#undef PASTE_VM_OP
+#undef PASTE_VM_SUPER_OP
+#endif
+
+    VMRoutine *current = entry;
+    uint64_t result;
+    uint32_t return_depth = returns.get_size();
+
+    // Entering a routine: decode it if needed and make room for its frame.
+#if VM_THREADED
+#define VM_ENTER(vm_routine)                                        \
+    if ((vm_routine)->ops == nullptr)                               \
+    {                                                               \
+        decode(vm_routine);                                         \
+        for (uint32_t i = 0; i < (vm_routine)->op_count; i++)       \
+            (vm_routine)->ops[i].handler = handlers[(vm_routine)->ops[i].opcode]; \
+    }                                                               \
+    if (stack.get_size() < base + (vm_routine)->frame_size)         \
+        stack.resize(base + (vm_routine)->frame_size);              \
+    fp = &stack[0] + base
+#else
+#define VM_ENTER(vm_routine)                                        \
+    if ((vm_routine)->ops == nullptr)                               \
+        decode(vm_routine);                                         \
+    if (stack.get_size() < base + (vm_routine)->frame_size)         \
+        stack.resize(base + (vm_routine)->frame_size);              \
+    fp = &stack[0] + base
+#endif
+
+    uint64_t *fp;
+    VM_ENTER(current);
+    VMOp *op = current->ops;
+
+#ifdef VM_PAIR_STATS
+    VMOp *previous = nullptr;
+#endif
+
+#if VM_THREADED
+    VM_DISPATCH();
+#else
+dispatch:
+#ifdef VM_PAIR_STATS
+    if (op == previous + 1)
+        pair_counts[previous->opcode][op->opcode]++;
+    previous = op;
+#endif
+    switch (op->opcode)
+#endif
+    {
+        VM_CASE(MOV_IM)
+        {
+            fp[op->target] = op->imm;
+            VM_NEXT();
+        }
+        VM_CASE(MOV)
+        {
+            fp[op->target] = fp[op->left];
+            VM_NEXT();
+        }
+        VM_CASE(NOT)
+        {
+            fp[op->target] = !fp[op->left];
+            VM_NEXT();
+        }
+        VM_CASE(NEG)
+        {
+            fp[op->target] = 0 - fp[op->left];
+            VM_NEXT();
+        }
+
+        VM_BINARY(MUL,   uint64_t, l * r)
+        VM_BINARY(IMUL,  uint64_t, l * r) // Same low bits as the signed product.
+        VM_DIVIDE(DIV,   uint64_t, false)
+        VM_DIVIDE(IDIV,  int64_t,  true)
+        VM_BINARY(ADD,   uint64_t, l + r)
+        VM_BINARY(SUB,   uint64_t, l - r)
+        VM_BINARY(EQ,    uint64_t, l == r)
+        VM_BINARY(NE,    uint64_t, l != r)
+        VM_BINARY(LT,    int64_t,  l < r)
+        VM_BINARY(BELOW, uint64_t, l < r)
+        VM_BINARY(GT,    int64_t,  l > r)
+        VM_BINARY(ABOVE, uint64_t, l > r)
+        VM_BINARY(LE,    int64_t,  l <= r)
+        VM_BINARY(BE,    uint64_t, l <= r)
+        VM_BINARY(GE,    int64_t,  l >= r)
+        VM_BINARY(AE,    uint64_t, l >= r)
+
+        VM_CASE(JMP)
+        {
+            VM_JUMP(op->jump);
+        }
+        VM_CASE(LOOP)
+        {
+            if (fuel-- == 0)
+                VM_STOP("out of fuel");
+            current->heat++;
+            VM_JUMP(op->jump);
+        }
+        VM_CASE(JZ)
+        {
+            if (fp[op->left] == 0)
+                VM_JUMP(op->jump);
+            VM_NEXT();
+        }
+        VM_CASE(JNZ)
+        {
+            if (fp[op->left] != 0)
+                VM_JUMP(op->jump);
+            VM_NEXT();
+        }
+        VM_CASE(ARG)
+        {
+            fp[op->target] = fp[op->left];
+            VM_NEXT();
+        }
+        VM_CASE(CALL)
+        {
+            if (fuel-- == 0)
+                VM_STOP("out of fuel");
+            VMRoutine *callee = op->callee;
+            if (jit && ++callee->heat >= hot_threshold &&
+                !callee->native && !callee->no_native && !callee->routine->external)
+            {
+                compile(callee);
+            }
+            if (callee->native)
+            {
+                VM_PATCH(op, CALL_NATIVE);
+                VM_DISPATCH();
+            }
+
+            VMReturn ret = {current, op + 1, base, op->target};
+            returns.push(ret);
+
+            // The frame of the callee starts at its params
+            // which the ARG ops have already written.
+            base += current->routine->temp_count;
+            current = op->callee;
+            VM_ENTER(current);
+            VM_JUMP(current->ops);
+        }
+        VM_CASE(CALL_NATIVE)
+        {
+            uint64_t *params = fp + current->routine->temp_count;
+            fp[op->target] = call_native(op->callee->native, params, op->callee->routine->param_count);
+            VM_NEXT();
+        }
+        VM_CASE(RET)
+        {
+            result = fp[op->left];
+            VM_RETURN();
+        }
+        VM_CASE(RET_VOID)
+        {
+            result = 0;
+            VM_RETURN();
+        }
+        VM_CASE(PROFILE)
+        {
+            (*op->counter)++;
+            VM_NEXT();
+        }
+
+        VM_MOV_IM_AND(ADD)
+        VM_MOV_IM_AND(SUB)
+        VM_MOV_IM_AND(IMUL)
+        VM_MOV_IM_AND(IDIV)
+        VM_MOV_IM_AND(EQ)
+        VM_MOV_IM_AND(NE)
+        VM_MOV_IM_AND(LT)
+        VM_MOV_IM_AND(RET)
+
+        VM_COMPARE_AND(EQ, JZ,  uint64_t, l == r)
+        VM_COMPARE_AND(EQ, JNZ, uint64_t, l == r)
+        VM_COMPARE_AND(NE, JZ,  uint64_t, l != r)
+        VM_COMPARE_AND(LT, JZ,  int64_t,  l < r)
+        VM_COMPARE_AND(LE, JZ,  int64_t,  l <= r)
+
+        VM_CASE(ARG_CALL)
+        {
+            fp[op->target] = fp[op->left];
+            op++;
+            if (op->callee->native)
+            {
+                // The CALL is (or is about to be) patched to CALL_NATIVE
+                // so the pair is split back to ARG and CALL_NATIVE.
+                VM_PATCH(op - 1, ARG);
+                VM_DISPATCH();
+            }
+            VM_GOTO(CALL);
+        }
+#if !VM_THREADED
+        InvalidDefaultCase;
+#endif
+    }
+
+    return 0;
+}
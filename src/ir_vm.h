@@ -0,0 +1,228 @@
+#ifndef IR_VM_H
+#define IR_VM_H
+
+#include "ir_gen.h"
+#include "alloc.h"
+#include "str.h"
+#include "list.h"
+#include "jit.h"
+#include "profile.h"
+
+#include <cstdint>
+#include <cstdio>
+
+// Routines with more params are always interpreted when the VM calls them
+// and external routines with more params can't be linked.
+#define MAX_NATIVE_PARAMS 16
+
+// NOTE: LABEL and NOP quads have no ops. RET is split in two
+// so that the returning op doesn't have to test for the value.
+// LOOP is a JMP backwards and CALL_NATIVE is a CALL to a routine
+// that is compiled to machine code. PROFILE adds one to a counter.
+#define PASTE_VM_OPS         \
+    PASTE_VM_OP(MOV_IM)      \
+    PASTE_VM_OP(MOV)         \
+    PASTE_VM_OP(NOT)         \
+    PASTE_VM_OP(NEG)         \
+    PASTE_VM_OP(MUL)         \
+    PASTE_VM_OP(IMUL)        \
+    PASTE_VM_OP(DIV)         \
+    PASTE_VM_OP(IDIV)        \
+    PASTE_VM_OP(ADD)         \
+    PASTE_VM_OP(SUB)         \
+    PASTE_VM_OP(EQ)          \
+    PASTE_VM_OP(NE)          \
+    PASTE_VM_OP(LT)          \
+    PASTE_VM_OP(BELOW)       \
+    PASTE_VM_OP(GT)          \
+    PASTE_VM_OP(ABOVE)       \
+    PASTE_VM_OP(LE)          \
+    PASTE_VM_OP(BE)          \
+    PASTE_VM_OP(GE)          \
+    PASTE_VM_OP(AE)          \
+    PASTE_VM_OP(JMP)         \
+    PASTE_VM_OP(LOOP)        \
+    PASTE_VM_OP(JZ)          \
+    PASTE_VM_OP(JNZ)         \
+    PASTE_VM_OP(ARG)         \
+    PASTE_VM_OP(CALL)        \
+    PASTE_VM_OP(CALL_NATIVE) \
+    PASTE_VM_OP(RET)         \
+    PASTE_VM_OP(RET_VOID)    \
+    PASTE_VM_OP(PROFILE)
+
+// Superinstructions run two ops with one dispatch. The pairs are the
+// most common ones in the bytecode of benchmark programs (build with
+// VM_PAIR_STATS to count them). A pair is fused when decoding if the
+// second op is not a jump target. The second op keeps its operands.
+#define PASTE_VM_SUPER_OPS              \
+    PASTE_VM_SUPER_OP(MOV_IM, ADD)      \
+    PASTE_VM_SUPER_OP(MOV_IM, SUB)      \
+    PASTE_VM_SUPER_OP(MOV_IM, IMUL)     \
+    PASTE_VM_SUPER_OP(MOV_IM, IDIV)     \
+    PASTE_VM_SUPER_OP(MOV_IM, EQ)       \
+    PASTE_VM_SUPER_OP(MOV_IM, NE)       \
+    PASTE_VM_SUPER_OP(MOV_IM, LT)       \
+    PASTE_VM_SUPER_OP(MOV_IM, RET)      \
+    PASTE_VM_SUPER_OP(EQ, JZ)           \
+    PASTE_VM_SUPER_OP(EQ, JNZ)          \
+    PASTE_VM_SUPER_OP(NE, JZ)           \
+    PASTE_VM_SUPER_OP(LT, JZ)           \
+    PASTE_VM_SUPER_OP(LE, JZ)           \
+    PASTE_VM_SUPER_OP(ARG, CALL)
+
+#define PASTE_VM_OP(x) VMOp_##x,
+#define PASTE_VM_SUPER_OP(x, y) VMOp_##x##_##y,
+
+enum VMOpcode
+{
+    PASTE_VM_OPS
+    PASTE_VM_SUPER_OPS
+
+    VMOp_COUNT
+};
+
+#undef PASTE_VM_OP
+#undef PASTE_VM_SUPER_OP
+
+/**
+ * One decoded quad. Temps are indices to the frame of the routine.
+ * Jumps and calls point straight to their targets.
+ */
+struct VMOp
+{
+    union
+    {
+        uintptr_t opcode;    // Until the routine is threaded.
+        const void *handler; // Address of the code that executes the op.
+    };
+    uint32_t target; // Temp or argument index.
+    uint32_t left;
+    union
+    {
+        uint32_t right;
+        uint64_t imm;
+        VMOp *jump;
+        struct VMRoutine *callee;
+        uint64_t *counter;
+    };
+};
+
+/**
+ * Bytecode of a routine. Routines are decoded when they are called
+ * the first time.
+ */
+struct VMRoutine
+{
+    Routine *routine;
+    VMOp *ops; // null until decoded
+    uint32_t op_count;
+    uint32_t frame_size; // Temps of the routine and the arguments of its calls.
+    uint32_t heat;       // Calls and backward jumps.
+    void *native;        // Machine code of the routine or null.
+    bool no_native;      // Compiling the routine failed.
+
+    // When profiling: the counters of the PROFILE ops and
+    // quad index -> counter of the block of the quad.
+    uint64_t *counters;
+    uint32_t *counter_of;
+};
+
+/**
+ * Where to continue when the called routine returns.
+ */
+struct VMReturn
+{
+    VMRoutine *routine; // The caller.
+    VMOp *op;           // The op after the CALL.
+    uint32_t base;      // Frame of the caller in the stack.
+    uint32_t target;
+};
+
+/**
+ * Interpreter that runs the IR decoded into bytecode.
+ *
+ * Each op has the address of its handler and the handlers jump
+ * straight to the handler of the next op (direct threading with the
+ * computed goto of GCC and Clang). Other compilers get a switch.
+ *
+ * Frames are in one growable stack of 64 bit values. The frame of a
+ * routine has its temps and after them room for the arguments of the
+ * calls it makes. ARG writes the argument straight to where the params
+ * of the callee will be. External routines are called with the calling
+ * convention of the host if they are linked.
+ */
+struct VM
+{
+    Alloc a;
+    IR ir;
+    List<VMRoutine> routines; // Indexed with routine ids.
+    List<uint64_t> stack;
+    List<VMReturn> returns;
+
+    // Tiered execution. If jit is not null, a routine whose heat reaches
+    // hot_threshold is compiled to machine code when it is called next.
+    // The CALL ops that reach it are patched to CALL_NATIVE.
+    Jit *jit;
+    uint32_t hot_threshold;
+
+    // Every call and backward jump uses one unit of fuel. When the fuel
+    // runs out or a division would trap, the run stops and error is set.
+    uint64_t fuel;
+    const char *error;
+
+    // If profiling is set before the first call, the routines count how
+    // many times each block runs and how many times each JZ and JNZ falls
+    // through. Routines compiled to machine code are not counted.
+    bool profiling;
+
+    void init(IR ir);
+
+    /**
+     * Resolves the external routines from the libraries so that they are
+     * called as native code. Without link() external routines return 0.
+     * Returns false and prints an error if some routine is not found.
+     */
+    bool link(DynLibs &libs);
+
+    /**
+     * Finds a routine by name. Returns false if there is no such routine.
+     */
+    bool find(Str name, uint32_t *routine_id);
+
+    /**
+     * Runs the routine with the given arguments and returns its result
+     * (0 if it doesn't return anything). Returns 0 and sets error if the
+     * run stops.
+     */
+    uint64_t call(uint32_t routine_id, uint64_t *args, uint32_t arg_count);
+
+#ifdef VM_PAIR_STATS
+    // pair_counts[a][b] is how many times op b ran right after op a
+    // that is before it in the bytecode.
+    uint64_t pair_counts[VMOp_COUNT][VMOp_COUNT];
+
+    /**
+     * Prints the most common pairs of ops.
+     */
+    void print_pair_stats(FILE *f);
+#endif
+
+    /**
+     * Adds the counts of the routines that have run to the profile.
+     * Returns false if the profile has a routine of the same name
+     * with a different number of quads.
+     */
+    bool add_profile(Profile &profile);
+
+    void decode(VMRoutine *vm_routine);
+
+    /**
+     * Compiles the routine and the routines it calls that aren't
+     * compiled yet. Machine code can't call the interpreter.
+     */
+    void compile(VMRoutine *hot);
+    uint64_t execute(VMRoutine *entry, uint32_t base);
+};
+
+#endif // IR_VM_H
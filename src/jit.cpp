@@ -0,0 +1,172 @@
+#include "jit.h"
+#include "code_gen.h"
+#include "encoder.h"
+#include "ir.h"
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#define HOST_TARGET Target_WIN64
+#else
+#include <sys/mman.h>
+#define HOST_TARGET Target_SYSV
+#endif
+
+// NOTE: Functions of the process (and code compiled earlier) are usually
+// too far away for the 32 bit displacement of a call. So those calls go
+// to a thunk that jumps to the 64 bit address after it: jmp [rip + 0]
+// and the address.
+#define THUNK_SIZE 16
+
+static uint8_t *allocate_memory(uint32_t size)
+{
+#ifdef _WIN32
+    return (uint8_t *)VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (memory == MAP_FAILED) ? nullptr : (uint8_t *)memory;
+#endif
+}
+
+static bool make_executable(uint8_t *memory, uint32_t size)
+{
+#ifdef _WIN32
+    DWORD old_protect;
+    if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &old_protect))
+        return false;
+    return FlushInstructionCache(GetCurrentProcess(), memory, size) != 0;
+#else
+    return mprotect(memory, size, PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+static void free_memory(uint8_t *memory, uint32_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, size);
+#endif
+}
+
+Jit::~Jit()
+{
+    for (uint32_t i = 0; i < blocks.get_size(); i++)
+        free_memory(blocks[i].memory, blocks[i].size);
+}
+
+bool Jit::compile(IR ir, const bool *selected)
+{
+    Encoder enc;
+    CodeGenOptions options = {};
+    options.target = HOST_TARGET;
+    options.profile = profile;
+    encode_code(ir, enc, options, selected);
+
+    uint32_t symbol_count = enc.symbols.get_size();
+    if (entries.get_size() < symbol_count)
+    {
+        uint32_t old_count = entries.get_size();
+        names.resize(symbol_count);
+        entries.resize(symbol_count);
+        for (uint32_t i = old_count; i < symbol_count; i++)
+            entries[i] = nullptr;
+    }
+
+    // The thunks are placed after the code.
+    uint32_t text_size = enc.text.get_size();
+    uint32_t code_size = (text_size + 15) & ~15u;
+    uint32_t thunk_count = 0;
+
+    List<int32_t> thunks; // Routine id -> offset of the thunk or -1.
+    thunks.resize(symbol_count);
+    for (uint32_t i = 0; i < symbol_count; i++)
+        thunks[i] = -1;
+
+    uint32_t call_count = enc.calls.get_size();
+    for (uint32_t i = 0; i < call_count; i++)
+    {
+        uint32_t target = enc.calls[i].target;
+        if (thunks[target] < 0)
+            thunks[target] = code_size + THUNK_SIZE * thunk_count++;
+    }
+
+    JitBlock block;
+    block.size = code_size + THUNK_SIZE * thunk_count;
+    if (block.size == 0)
+        block.size = THUNK_SIZE;
+    block.memory = allocate_memory(block.size);
+    if (block.memory == nullptr)
+    {
+        fprintf(stderr, "error: couldn't allocate executable memory\n");
+        return false;
+    }
+    blocks.push(block);
+
+    DynLibs process_only;
+    DynLibs *search = libs ? libs : &process_only;
+
+    uint8_t *memory = block.memory;
+    memset(memory, 0xcc, block.size); // int3
+    if (text_size > 0)
+        memcpy(memory, &enc.text[0], text_size);
+
+    for (uint32_t i = 0; i < symbol_count; i++)
+    {
+        if (thunks[i] < 0)
+            continue;
+
+        Encoder::Symbol sym = enc.symbols[i];
+        void *address = entries[i];
+        if (address == nullptr && sym.external)
+            address = search->find(sym.name);
+        if (address == nullptr)
+        {
+            fprintf(stderr, "error: %s function '%s' not found\n",
+                    sym.external ? "external" : "compiled", sym.name.data);
+            return false;
+        }
+
+        uint8_t *thunk = memory + thunks[i];
+        thunk[0] = 0xff; // jmp [rip + 0]
+        thunk[1] = 0x25;
+        memset(thunk + 2, 0, 4);
+        memcpy(thunk + 6, &address, 8);
+    }
+
+    for (uint32_t i = 0; i < call_count; i++)
+    {
+        Encoder::Fixup call = enc.calls[i];
+        int32_t displacement = thunks[call.target] - (int32_t)(call.offset + 4);
+        memcpy(memory + call.offset, &displacement, 4);
+    }
+
+    if (!make_executable(memory, block.size))
+    {
+        fprintf(stderr, "error: couldn't make the memory executable\n");
+        return false;
+    }
+
+    for (uint32_t i = 0; i < symbol_count; i++)
+    {
+        Encoder::Symbol sym = enc.symbols[i];
+        names[i] = sym.name;
+        if (sym.defined)
+            entries[i] = memory + sym.offset;
+    }
+
+    return true;
+}
+
+void *Jit::find(Str name)
+{
+    for (uint32_t i = 0; i < names.get_size(); i++)
+    {
+        if (names[i] == name)
+            return entries[i];
+    }
+    return nullptr;
+}
@@ -0,0 +1,71 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "ir_gen.h"
+#include "str.h"
+#include "list.h"
+#include "dynlib.h"
+
+#include <cstdint>
+
+/**
+ * Executable memory that has the code of one compile() call.
+ */
+struct JitBlock
+{
+    uint8_t *memory;
+    uint32_t size;
+};
+
+/**
+ * Machine code of a program in executable memory of this process.
+ *
+ * The routines are encoded with the calling convention of the host
+ * (System V, or Windows x64 on Windows) so they can be called straight
+ * from C. Calls between the routines are resolved in memory. Calls to
+ * external routines go through a small jump table to the functions of
+ * the same name in libs (or in this process if libs is null).
+ *
+ * Routines can be compiled a few at a time. Calls to routines that were
+ * compiled earlier go through the jump table too. Each compile() gets
+ * its own memory that is writable only while the code is copied into it.
+ */
+struct Jit
+{
+    List<JitBlock> blocks;
+    List<Str> names;
+    List<void *> entries; // Routine id -> address of the routine, null if not compiled.
+    DynLibs *libs;
+    struct Profile *profile; // Counts that guide the code generation or null.
+
+    Jit()
+    : libs()
+    , profile()
+    {}
+
+    ~Jit();
+
+    /**
+     * Compiles all routines.
+     */
+    bool load(IR ir)
+    {
+        return compile(ir, nullptr);
+    }
+
+    /**
+     * Compiles the selected routines (all if selected is null) into
+     * executable memory. The routines they call must be external,
+     * compiled earlier, or selected too.
+     * Returns false and prints an error if some external routine
+     * can't be found or if the memory can't be allocated.
+     */
+    bool compile(IR ir, const bool *selected);
+
+    /**
+     * Returns the address of the routine with the given name or null.
+     */
+    void *find(Str name);
+};
+
+#endif // JIT_H
@@ -0,0 +1,170 @@
+#include "liveness.h"
+#include "assert.h"
+
+void Liveness::compute(Routine *routine)
+{
+    blocks = routine->blocks;
+    block_count = routine->block_count;
+
+    temp_count = routine->temp_count;
+    words = (temp_count + 63) / 64;
+    if (words == 0)
+        words = 1;
+
+    uint32_t size = words * block_count;
+
+    List<uint64_t> use; // temps read in the block before written
+    List<uint64_t> def; // temps written in the block
+    use.resize(size);
+    def.resize(size);
+    live_in.resize(size);
+    live_out.resize(size);
+    for (uint32_t i = 0; i < size; i++)
+    {
+        use[i] = 0;
+        def[i] = 0;
+        live_in[i] = 0;
+        live_out[i] = 0;
+    }
+
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        uint64_t *u = &use[b * words];
+        uint64_t *d = &def[b * words];
+
+        for (uint32_t i = blocks[b].start; i < blocks[b].end; i++)
+        {
+            Quad quad = (*routine)[i];
+
+            uint32_t uses[2];
+            int use_count = get_uses(quad, uses);
+            for (int k = 0; k < use_count; k++)
+            {
+                uint32_t t = uses[k];
+                if (!(d[t / 64] & (1ull << (t % 64))))
+                    u[t / 64] |= 1ull << (t % 64);
+            }
+
+            uint32_t t;
+            if (get_def(quad, &t))
+                d[t / 64] |= 1ull << (t % 64);
+        }
+    }
+
+    // Iterate backwards until nothing changes.
+    // out[b] = union of in[s] for successors s
+    // in[b] = use[b] | (out[b] & ~def[b])
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int32_t b = block_count - 1; b >= 0; b--)
+        {
+            uint64_t *o = out(b);
+            uint64_t *n = in(b);
+            uint64_t *u = &use[b * words];
+            uint64_t *d = &def[b * words];
+
+            for (int k = 0; k < 2; k++)
+            {
+                int32_t s = blocks[b].succ[k];
+                if (s < 0) continue;
+                uint64_t *s_in = in(s);
+                for (uint32_t w = 0; w < words; w++)
+                    o[w] |= s_in[w];
+            }
+
+            for (uint32_t w = 0; w < words; w++)
+            {
+                uint64_t value = u[w] | (o[w] & ~d[w]);
+                if (value != n[w])
+                {
+                    n[w] = value;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+static void extend(LiveRange &range, int32_t pos)
+{
+    if (range.start < 0)
+    {
+        range.start = pos;
+        range.end = pos;
+        return;
+    }
+    if (pos < range.start) range.start = pos;
+    if (pos > range.end) range.end = pos;
+}
+
+void Liveness::compute_ranges(Routine *routine, List<LiveRange> &ranges)
+{
+    ranges.resize(temp_count);
+    for (uint32_t t = 0; t < temp_count; t++)
+    {
+        ranges[t].start = -1;
+        ranges[t].end = -1;
+        ranges[t].crosses_call = false;
+    }
+
+    // Parameters are defined at the entry.
+    for (uint32_t t = 0; t < routine->param_count; t++)
+        extend(ranges[t], ENTRY_POS);
+
+    List<uint32_t> calls; // positions of the CALL quads
+
+    for (uint32_t b = 0; b < block_count; b++)
+    {
+        BasicBlock block = blocks[b];
+
+        // Temps live at the block boundaries cover the whole boundary.
+        uint64_t *n = in(b);
+        uint64_t *o = out(b);
+        for (uint32_t t = 0; t < temp_count; t++)
+        {
+            uint64_t bit = 1ull << (t % 64);
+            if (n[t / 64] & bit)
+                extend(ranges[t], DEF_POS(block.start) - 2);
+            if (o[t / 64] & bit)
+                extend(ranges[t], DEF_POS(block.end - 1));
+        }
+
+        for (uint32_t i = block.start; i < block.end; i++)
+        {
+            Quad quad = (*routine)[i];
+
+            uint32_t uses[2];
+            int use_count = get_uses(quad, uses);
+            for (int k = 0; k < use_count; k++)
+                extend(ranges[uses[k]], USE_POS(i));
+
+            uint32_t t;
+            if (get_def(quad, &t))
+                extend(ranges[t], DEF_POS(i));
+
+            if (quad.op == IR::CALL)
+                calls.push(i);
+        }
+    }
+
+    // NOTE: The ranges are conservative so a temp crosses a call
+    // if its range contains positions before and after the call.
+    uint32_t call_count = calls.get_size();
+    for (uint32_t t = 0; t < temp_count; t++)
+    {
+        LiveRange &range = ranges[t];
+        if (range.start < 0)
+            continue;
+        for (uint32_t c = 0; c < call_count; c++)
+        {
+            int32_t pos = DEF_POS(calls[c]);
+            if (range.start < pos && range.end >= pos)
+            {
+                range.crosses_call = true;
+                break;
+            }
+        }
+    }
+}
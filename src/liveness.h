@@ -0,0 +1,57 @@
+#ifndef LIVENESS_H
+#define LIVENESS_H
+
+#include "ir_cfg.h"
+#include "list.h"
+
+/**
+ * Positions of the quads in live ranges.
+ * Every quad has two positions: one where it reads its operands and
+ * one right after that where it writes its target. This way the target
+ * of a quad can get the same register as an operand whose live range
+ * ends at that quad. Position 1 is the entry of the routine where the
+ * parameters are defined.
+ */
+#define ENTRY_POS 1
+#define USE_POS(quad_index) (2 * (int32_t)(quad_index) + 2)
+#define DEF_POS(quad_index) (2 * (int32_t)(quad_index) + 3)
+
+/**
+ * Conservative live range of a temp: the temp is live somewhere
+ * in each position between start and end (inclusive).
+ */
+struct LiveRange
+{
+    int32_t start; // -1 if the temp is never used or defined.
+    int32_t end;
+    bool crosses_call; // Temp is live before and after some CALL quad.
+};
+
+/**
+ * Whole routine liveness analysis over the quads.
+ * Live-in and live-out sets of the blocks are bit sets with
+ * one bit per temp.
+ */
+struct Liveness
+{
+    uint32_t temp_count;
+    uint32_t words; // 64 bit words per set
+    BasicBlock *blocks; // The block table of the routine.
+    uint32_t block_count;
+    List<uint64_t> live_in;  // words * block count
+    List<uint64_t> live_out; // words * block count
+
+    void compute(Routine *routine);
+
+    /**
+     * Computes the live ranges of all temps of the routine.
+     * Ranges can be indexed with temp ids.
+     * Must be called after compute().
+     */
+    void compute_ranges(Routine *routine, List<LiveRange> &ranges);
+
+    uint64_t *in(uint32_t block)  { return &live_in[block * words]; }
+    uint64_t *out(uint32_t block) { return &live_out[block * words]; }
+};
+
+#endif // LIVENESS_H
@@ -1,25 +1,55 @@
 #include "tests.h"
 #include "code_gen.h"
 #include "ir_gen.h"
+#include "ir_opt.h"
+#include "ir_vm.h"
+#include "jit.h"
+#include "dynlib.h"
+#include "profile.h"
+#include "list.h"
 #include "check.h"
 #include "parser.h"
 #include "alloc.h"
 #include "error_context.h"
 
 #include <cstdlib>
+#include <cstring>
 
 enum OutputMode
 {
     OutputMode_EXE,
     OutputMode_ASM,
     OutputMode_OBJ,
+    OutputMode_INTERPRET,
+    OutputMode_TIERED,
+    OutputMode_RUN,
 };
 
 /**
- * Generates assembly from the source file and places it into the output file.
+ * Generates assembly (or an object file) from the source file and places it into the output file.
+ * If profile_file is not null, the code is optimized with the execution counts read from it.
  * Implemented in this file after main function.
  */
-int compile(const char *source_file, const char *output_file);
+int compile(const char *source_file, const char *output_file, CodeGenOptions options, const char *profile_file);
+
+// Calls and backward jumps before --tiered compiles a routine.
+#define HOT_THRESHOLD 1000
+
+/**
+ * Runs the main function of the source file in the interpreter and returns its result.
+ * If tiered is true, hot routines are compiled to machine code.
+ * If profile_file is not null, the execution counts are written to it.
+ * External functions are looked up from the given libraries and the process.
+ * Implemented in this file after main function.
+ */
+int interpret(const char *source_file, bool tiered, const char *profile_file, List<const char *> &libs);
+
+/**
+ * Compiles the source file to machine code in memory, runs its main function and returns its result.
+ * External functions are looked up from the given libraries and the process.
+ * Implemented in this file after main function.
+ */
+int run(const char *source_file, List<const char *> &libs);
 
 int invoke(const char *command)
 {
@@ -33,10 +63,20 @@ int invoke(const char *fmt, const char *param)
     return system(command);
 }
 
+int invoke(const char *fmt, const char *param1, const char *param2)
+{
+    char command[256];
+    snprintf(command, sizeof(command), fmt, param1, param2);
+    return system(command);
+}
+
 void print_help()
 {
     fprintf(stdout,
-            "Usage: mug [-s|-c] [-o <output-file>] <source-file>\n\n"
+            "Usage: mug [-s|-c] [--direct-obj] [--target=win64|sysv] [-o <output-file>]\n"
+            "           [-fprofile-generate|-fprofile-use=<profile-file>] <source-file>\n"
+            "       mug --interpret|--tiered|--run [--lib=<library>]... <source-file>\n"
+            "       mug --interpret --profile=<profile-file> [--lib=<library>]... <source-file>\n\n"
             "By default, mug runs three phases:\n"
             "(1) <source-file> ==> mug ==> out.s\n"
             "(2) out.s ==> nasm ==> out.o\n"
@@ -45,6 +85,35 @@ void print_help()
             "If -c is given, mug stops after phase (2).\n"
             "If both -s and -c are given, only the last one is effective.\n"
             "If -o is given, the final output of mug is <output-file>.\n\n"
+            "If --direct-obj is given, mug encodes the machine code itself and\n"
+            "writes an ELF64 object file without running nasm:\n"
+            "(1) <source-file> ==> mug ==> out.o\n"
+            "(2) out.o ==> gcc ==> out.exe\n"
+            "The -c flag stops after phase (1). The -s flag turns --direct-obj off.\n\n"
+            "The --target option selects the calling convention:\n"
+            "win64 (default) is the Windows x64 convention and nasm is run with -f win64.\n"
+            "sysv is the System V AMD64 convention used on Linux and nasm is run with -f elf64.\n\n"
+            "If -fprofile-generate is given, the program counts how many times its\n"
+            "code runs and writes the counts to " PROFILE_FILE " when it exits.\n"
+            "If -fprofile-use is given, the code that ran the most gets the registers\n"
+            "and the code that never ran is moved out of the way. Larger functions\n"
+            "are inlined into the calls that ran often and nothing is inlined into\n"
+            "the calls that never ran. <profile-file> is either " PROFILE_FILE " or a file\n"
+            "written with --profile.\n\n"
+            "If --interpret is given, mug runs the main function of <source-file>\n"
+            "in its bytecode interpreter and exits with the value main returns.\n"
+            "A division by zero stops the program with an error.\n\n"
+            "If --profile is given with --interpret, mug writes to <profile-file>\n"
+            "how many times each quad of the optimized IR ran and how many times\n"
+            "each conditional jump jumped. Nothing is compiled to machine code.\n\n"
+            "If --tiered is given, mug starts like --interpret but compiles the\n"
+            "functions that are called often or loop a lot to machine code.\n"
+            "The functions they call are compiled with them.\n\n"
+            "If --run is given, mug compiles <source-file> to machine code in memory\n"
+            "and runs its main function without nasm or gcc.\n\n"
+            "With --interpret, --tiered and --run, external functions are looked up\n"
+            "from the shared libraries given with --lib and then from the mug process\n"
+            "itself (e.g. the C library). They can have at most 16 parameters.\n\n"
             "Example usage: mug -c -o banana.o banana.mug\n");
 }
 
@@ -66,6 +135,10 @@ int main(int argc, const char **argv)
     const char *source = nullptr;
     const char *output = nullptr;
     OutputMode mode = OutputMode_EXE;
+    CodeGenOptions options = {};
+    List<const char *> libs;
+    const char *profile = nullptr;
+    const char *profile_use = nullptr;
 
     for (int i = 1; i < argc; i++)
     {
@@ -80,6 +153,38 @@ int main(int argc, const char **argv)
                 case 'c':
                     mode = OutputMode_OBJ;
                     break;
+                case 'f':
+                {
+                    if (strcmp(arg, "-fprofile-generate") == 0)
+                        options.profile_generate = true;
+                    else if (strncmp(arg, "-fprofile-use=", 14) == 0)
+                        profile_use = arg + 14;
+                    else
+                        fprintf(stderr, "warning: unrecognized parameter %s\n", arg);
+                    break;
+                }
+                case '-':
+                {
+                    if (strcmp(arg, "--direct-obj") == 0)
+                        options.direct_obj = true;
+                    else if (strcmp(arg, "--interpret") == 0)
+                        mode = OutputMode_INTERPRET;
+                    else if (strcmp(arg, "--tiered") == 0)
+                        mode = OutputMode_TIERED;
+                    else if (strcmp(arg, "--run") == 0)
+                        mode = OutputMode_RUN;
+                    else if (strncmp(arg, "--lib=", 6) == 0)
+                        libs.push(arg + 6);
+                    else if (strncmp(arg, "--profile=", 10) == 0)
+                        profile = arg + 10;
+                    else if (strcmp(arg, "--target=win64") == 0)
+                        options.target = Target_WIN64;
+                    else if (strcmp(arg, "--target=sysv") == 0)
+                        options.target = Target_SYSV;
+                    else
+                        fprintf(stderr, "warning: unrecognized parameter %s\n", arg);
+                    break;
+                }
                 case 'o':
                 {
                     if (arg[2])
@@ -118,16 +223,54 @@ int main(int argc, const char **argv)
 
     // Do the job.
 
+    // The routines compiled by --tiered would stop counting.
+    if (profile && mode != OutputMode_INTERPRET)
+    {
+        fprintf(stderr, "warning: --profile is ignored without --interpret\n");
+        profile = nullptr;
+    }
+
+    bool compiles = (mode == OutputMode_EXE || mode == OutputMode_ASM || mode == OutputMode_OBJ);
+    if ((options.profile_generate || profile_use) && !compiles)
+        fprintf(stderr, "warning: -fprofile-generate and -fprofile-use are ignored without compiling\n");
+    if (options.profile_generate && profile_use)
+    {
+        fprintf(stderr, "error: -fprofile-generate and -fprofile-use can't be used together\n");
+        return 1;
+    }
+
+    if (mode == OutputMode_INTERPRET || mode == OutputMode_TIERED)
+        return interpret(source, mode == OutputMode_TIERED, profile, libs);
+
+    if (mode == OutputMode_RUN)
+        return run(source, libs);
+
     if (mode == OutputMode_ASM)
-        return compile(source, output ? output : "out.s");
+    {
+        options.direct_obj = false;
+        return compile(source, output ? output : "out.s", options, profile_use);
+    }
+
+    if (options.direct_obj)
+    {
+        if (mode == OutputMode_OBJ)
+            return compile(source, output ? output : "out.o", options, profile_use);
 
-    if (compile(source, "out.s") != 0)
+        if (compile(source, "out.o", options, profile_use) != 0)
+            return 1;
+
+        return invoke("gcc -o %s out.o", output ? output : "out");
+    }
+
+    if (compile(source, "out.s", options, profile_use) != 0)
         return 1;
 
+    const char *format = (options.target == Target_SYSV) ? "elf64" : "win64";
+
     if (mode == OutputMode_OBJ)
-        return invoke("nasm -f win64 -o %s out.s", output ? output : "out.o");
+        return invoke("nasm -f %s -o %s out.s", format, output ? output : "out.o");
 
-    if (invoke("nasm -f win64 -o out.o out.s") != 0)
+    if (invoke("nasm -f %s -o out.o out.s", format) != 0)
         return 1;
 
     return invoke("gcc -o %s out.o", output ? output : "out");
@@ -137,36 +280,67 @@ int main(int argc, const char **argv)
 //
 //
 
-int compile(const char *source_file, const char *output_file)
+/**
+ * Reads the whole source file into a zero terminated buffer.
+ * Returns null if the file can't be read.
+ */
+char *read_source(const char *source_file, Alloc &a)
 {
-    Alloc a;
-    char *buf;
-
+    FILE *f = fopen(source_file, "rb");
+    if (f == nullptr)
     {
-        FILE *f = fopen(source_file, "rb");
-        if (f == nullptr)
-        {
-            fprintf(stderr, "error: couldn't open file '%s'\n", source_file);
-            return 1;
-        }
+        fprintf(stderr, "error: couldn't open file '%s'\n", source_file);
+        return nullptr;
+    }
 
-        fseek(f, 0, SEEK_END);
-        unsigned size = ftell(f);
-        fseek(f, 0, SEEK_SET);
+    fseek(f, 0, SEEK_END);
+    unsigned size = ftell(f);
+    fseek(f, 0, SEEK_SET);
 
-        buf = a.allocate_array<char>(size + 1);
-        buf[size] = 0;
-
-        if (fread(buf, 1, size, f) != size)
-        {
-            fprintf(stderr, "error: couldn't read file '%s'\n", source_file);
-            fclose(f);
-            return 1;
-        }
+    char *buf = a.allocate_array<char>(size + 1);
+    buf[size] = 0;
 
+    if (fread(buf, 1, size, f) != size)
+    {
+        fprintf(stderr, "error: couldn't read file '%s'\n", source_file);
         fclose(f);
+        return nullptr;
     }
 
+    fclose(f);
+    return buf;
+}
+
+/**
+ * Reads a profile written by --profile or by a program compiled with -fprofile-generate.
+ * Returns false if the file can't be read or it's not a profile of the program.
+ */
+bool load_profile(const char *profile_file, IR ir, Profile &profile)
+{
+    FILE *f = fopen(profile_file, "rb");
+    if (f == nullptr)
+    {
+        fprintf(stderr, "error: couldn't open file '%s'\n", profile_file);
+        return false;
+    }
+
+    // The profiles of the interpreter are text and start with a routine.
+    char start[8] = {};
+    size_t size = fread(start, 1, sizeof(start), f);
+    fclose(f);
+
+    if (size == sizeof(start) && memcmp(start, "routine ", sizeof(start)) == 0)
+        return profile.load(profile_file, ir);
+    return profile.load_counters(profile_file, ir);
+}
+
+int compile(const char *source_file, const char *output_file, CodeGenOptions options, const char *profile_file)
+{
+    Alloc a;
+    char *buf = read_source(source_file, a);
+    if (buf == nullptr)
+        return 1;
+
     ErrorContext ec;
     Ast ast = parse(buf, a, ec);
     if (!check(ast, ec))
@@ -175,17 +349,144 @@ int compile(const char *source_file, const char *output_file)
     }
 
     IR ir = gen_ir(ast, a);
+    optimize(ir);
+
+    Profile profile;
+    if (profile_file)
+    {
+        if (!load_profile(profile_file, ir, profile))
+            return 1;
+        inline_calls(ir, &profile);
+        options.profile = &profile;
+    }
 
-    FILE *f = fopen(output_file, "w");
+    FILE *f = fopen(output_file, options.direct_obj ? "wb" : "w");
     if (f == nullptr)
     {
         fprintf(stderr, "error: couldn't open file '%s' for writing\n", output_file);
         return 1;
     }
 
-    gen_code(ir, f);
+    bool ok = gen_code(ir, f, options);
 
     fclose(f);
 
+    if (!ok)
+    {
+        fprintf(stderr, "error: couldn't write file '%s'\n", output_file);
+        return 1;
+    }
+
     return 0;
 }
+
+/**
+ * Opens the shared libraries. Returns false if some library can't be opened.
+ */
+bool open_libs(List<const char *> &paths, DynLibs &libs)
+{
+    for (uint32_t i = 0; i < paths.get_size(); i++)
+    {
+        if (!libs.open(paths[i]))
+            return false;
+    }
+    return true;
+}
+
+int interpret(const char *source_file, bool tiered, const char *profile_file, List<const char *> &libs)
+{
+    Alloc a;
+    char *buf = read_source(source_file, a);
+    if (buf == nullptr)
+        return 1;
+
+    ErrorContext ec;
+    Ast ast = parse(buf, a, ec);
+    if (!check(ast, ec))
+    {
+        return 0;
+    }
+
+    IR ir = gen_ir(ast, a);
+    optimize(ir);
+
+    DynLibs dynlibs;
+    if (!open_libs(libs, dynlibs))
+        return 1;
+
+    Jit jit;
+    jit.libs = &dynlibs;
+    VM vm;
+    vm.init(ir);
+    if (!vm.link(dynlibs))
+        return 1;
+    if (profile_file)
+        vm.profiling = true;
+    else if (tiered)
+    {
+        vm.jit = &jit;
+        vm.hot_threshold = HOT_THRESHOLD;
+    }
+
+    uint32_t main_id;
+    if (!vm.find(Str::make("main"), &main_id))
+    {
+        fprintf(stderr, "error: function main not found\n");
+        return 1;
+    }
+
+    int result = (int)vm.call(main_id, nullptr, 0);
+#ifdef VM_PAIR_STATS
+    vm.print_pair_stats(stderr);
+#endif
+    if (profile_file)
+    {
+        Profile profile;
+        if (!vm.add_profile(profile) || !profile.save(profile_file))
+            return 1;
+    }
+    if (vm.error)
+    {
+        fprintf(stderr, "error: %s\n", vm.error);
+        return 1;
+    }
+    return result;
+}
+
+int run(const char *source_file, List<const char *> &libs)
+{
+    Alloc a;
+    char *buf = read_source(source_file, a);
+    if (buf == nullptr)
+        return 1;
+
+    ErrorContext ec;
+    Ast ast = parse(buf, a, ec);
+    if (!check(ast, ec))
+    {
+        return 0;
+    }
+
+    IR ir = gen_ir(ast, a);
+    optimize(ir);
+
+    DynLibs dynlibs;
+    if (!open_libs(libs, dynlibs))
+        return 1;
+
+    Jit jit;
+    jit.libs = &dynlibs;
+    if (!jit.load(ir))
+        return 1;
+
+    void *main_address = jit.find(Str::make("main"));
+    if (main_address == nullptr)
+    {
+        fprintf(stderr, "error: function main not found\n");
+        return 1;
+    }
+
+    typedef int64_t (*MainFunc)();
+    MainFunc main_func = (MainFunc)main_address;
+    return (int)main_func();
+}
@@ -0,0 +1,241 @@
+#include "profile.h"
+
+#include <cstdio>
+#include <cstring>
+
+void RoutineProfile::add_counters(Routine *routine, const uint32_t *counter_of, const uint64_t *counters)
+{
+    for (uint32_t q = 0; q < routine->quad_count; q++)
+    {
+        uint32_t counter = counter_of[q];
+        uint64_t count = counters[counter];
+        counts[q] += count;
+
+        // The counter after the one of the block of a JZ or JNZ
+        // counts how many times it didn't jump.
+        IR::Type op = (*routine)[q].op;
+        if (op == IR::JZ || op == IR::JNZ)
+            taken[q] += count - counters[counter + 1];
+    }
+}
+
+uint32_t place_counters(Routine *routine, uint32_t *counter_of, uint32_t *counter_at)
+{
+    uint32_t quad_count = routine->external ? 0 : routine->quad_count;
+    uint32_t counter_count = 0;
+    bool block_start = true;
+
+    for (uint32_t i = 0; i <= quad_count; i++)
+    {
+        counter_at[i] = NO_COUNTER;
+
+        // RET for falling off the end.
+        IR::Type op = IR::RET;
+        if (i < quad_count)
+            op = (*routine)[i].op;
+
+        if (op == IR::LABEL)
+        {
+            block_start = true;
+            continue;
+        }
+        if (op == IR::NOP)
+            continue;
+
+        if (block_start)
+            counter_at[i] = counter_count++;
+        counter_of[i] = counter_count - 1;
+
+        block_start = (op == IR::JMP || op == IR::RET);
+        if (op == IR::JZ || op == IR::JNZ)
+            counter_count++;
+    }
+
+    // Labels and nops are counted with the quad after them.
+    for (uint32_t i = quad_count; i-- > 0;)
+    {
+        IR::Type op = (*routine)[i].op;
+        if (op == IR::LABEL || op == IR::NOP)
+            counter_of[i] = counter_of[i + 1];
+    }
+
+    return counter_count;
+}
+
+RoutineProfile *Profile::find(Str name)
+{
+    for (uint32_t i = 0; i < routines.get_size(); i++)
+    {
+        if (routines[i]->name == name)
+            return routines[i];
+    }
+    return nullptr;
+}
+
+RoutineProfile *Profile::add(Str name, uint32_t quad_count)
+{
+    RoutineProfile *routine = find(name);
+    if (routine)
+        return (routine->quad_count == quad_count) ? routine : nullptr;
+
+    char *name_data = a.allocate_array<char>(name.len + 1);
+    memcpy(name_data, name.data, name.len);
+    name_data[name.len] = 0;
+
+    routine = a.allocate<RoutineProfile>();
+    routine->name = Str::make(name_data, name.len);
+    routine->quad_count = quad_count;
+    routine->counts = a.allocate_array<uint64_t>(quad_count + 1);
+    routine->taken = a.allocate_array<uint64_t>(quad_count + 1);
+    memset(routine->counts, 0, sizeof(uint64_t) * (quad_count + 1));
+    memset(routine->taken, 0, sizeof(uint64_t) * (quad_count + 1));
+    routines.push(routine);
+    return routine;
+}
+
+RoutineProfile *Profile::reset(Str name, uint32_t quad_count)
+{
+    RoutineProfile *routine = find(name);
+    if (routine == nullptr)
+        return add(name, quad_count);
+
+    routine->quad_count = quad_count;
+    routine->counts = a.allocate_array<uint64_t>(quad_count + 1);
+    routine->taken = a.allocate_array<uint64_t>(quad_count + 1);
+    memset(routine->counts, 0, sizeof(uint64_t) * (quad_count + 1));
+    memset(routine->taken, 0, sizeof(uint64_t) * (quad_count + 1));
+    return routine;
+}
+
+bool Profile::save(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (f == nullptr)
+    {
+        fprintf(stderr, "error: couldn't open file '%s' for writing\n", path);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < routines.get_size(); i++)
+    {
+        RoutineProfile *routine = routines[i];
+        fprintf(f, "routine %s %u\n", routine->name.data, routine->quad_count);
+        for (uint32_t q = 0; q < routine->quad_count; q++)
+        {
+            if (routine->counts[q] == 0)
+                continue;
+            if (routine->taken[q])
+                fprintf(f, "%u %llu %llu\n", q, (unsigned long long)routine->counts[q],
+                        (unsigned long long)routine->taken[q]);
+            else
+                fprintf(f, "%u %llu\n", q, (unsigned long long)routine->counts[q]);
+        }
+    }
+
+    bool ok = !ferror(f);
+    fclose(f);
+    if (!ok)
+        fprintf(stderr, "error: couldn't write file '%s'\n", path);
+    return ok;
+}
+
+static Routine *find_routine(IR ir, Str name)
+{
+    for (Routine *routine = ir.routines; routine; routine = routine->next)
+    {
+        if (!routine->external && routine->name == name)
+            return routine;
+    }
+    return nullptr;
+}
+
+bool Profile::load(const char *path, IR ir)
+{
+    FILE *f = fopen(path, "r");
+    if (f == nullptr)
+    {
+        fprintf(stderr, "error: couldn't open file '%s'\n", path);
+        return false;
+    }
+
+    RoutineProfile *routine = nullptr;
+    bool ok = true;
+    char line[512];
+    while (ok && fgets(line, sizeof(line), f))
+    {
+        char name[256];
+        unsigned quad_count;
+        unsigned quad;
+        unsigned long long count;
+        unsigned long long taken = 0;
+
+        if (sscanf(line, "routine %255s %u", name, &quad_count) == 2)
+        {
+            // The counts are allocated only for routines of the program.
+            Routine *ir_routine = find_routine(ir, Str::make(name));
+            routine = nullptr;
+            if (ir_routine && ir_routine->quad_count == quad_count)
+                routine = add(ir_routine->name, quad_count);
+            ok = (routine != nullptr);
+        }
+        else if (sscanf(line, "%u %llu %llu", &quad, &count, &taken) >= 2)
+        {
+            ok = (routine != nullptr && quad < routine->quad_count);
+            if (ok)
+            {
+                routine->counts[quad] += count;
+                routine->taken[quad] += taken;
+            }
+        }
+        else
+            ok = (line[0] == '\n');
+    }
+
+    fclose(f);
+    if (!ok)
+        fprintf(stderr, "error: '%s' is not a profile of this program\n", path);
+    return ok;
+}
+
+bool Profile::load_counters(const char *path, IR ir)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr)
+    {
+        fprintf(stderr, "error: couldn't open file '%s'\n", path);
+        return false;
+    }
+
+    // The counters are in the order of the routines that have code.
+    bool ok = true;
+    List<uint32_t> counter_of;
+    List<uint32_t> counter_at;
+    List<uint64_t> counters;
+    for (Routine *routine = ir.routines->next; routine && ok; routine = routine->next)
+    {
+        if (routine->external)
+            continue;
+
+        counter_of.resize(routine->quad_count + 1);
+        counter_at.resize(routine->quad_count + 1);
+        uint32_t counter_count = place_counters(routine, &counter_of[0], &counter_at[0]);
+        counters.resize(counter_count);
+        ok = (fread(&counters[0], sizeof(uint64_t), counter_count, f) == counter_count);
+
+        RoutineProfile *counts = ok ? add(routine->name, routine->quad_count) : nullptr;
+        if (counts)
+            counts->add_counters(routine, &counter_of[0], &counters[0]);
+        else
+            ok = false;
+    }
+
+    // Nothing may be left.
+    uint8_t byte;
+    if (ok && fread(&byte, 1, 1, f) == 1)
+        ok = false;
+
+    fclose(f);
+    if (!ok)
+        fprintf(stderr, "error: '%s' is not a profile of this program\n", path);
+    return ok;
+}
@@ -0,0 +1,97 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "ir.h"
+#include "alloc.h"
+#include "str.h"
+#include "list.h"
+
+#include <cstdint>
+
+/**
+ * Execution counts of the quads of one routine.
+ */
+struct RoutineProfile
+{
+    Str name;
+    uint32_t quad_count;
+    uint64_t *counts; // Quad index -> times the quad was executed.
+    uint64_t *taken;  // Quad index -> times a JZ or JNZ jumped. 0 for other quads.
+
+    /**
+     * Adds the values of the counters placed with place_counters().
+     */
+    void add_counters(Routine *routine, const uint32_t *counter_of, const uint64_t *counters);
+};
+
+#define NO_COUNTER 0xffffffff
+
+/**
+ * Places the counters that count how many times the quads of the routine
+ * run. Each block starts with a counter and each JZ and JNZ is followed
+ * by a counter for the times it doesn't jump. Falling off the end of the
+ * routine is counted as a RET at quad_count.
+ *
+ * counter_of gets the counter of each quad and counter_at the counter
+ * that is added right before each quad or NO_COUNTER. Labels and nops
+ * get the counter of the quad after them. The counter after a JZ or JNZ
+ * is counter_of of the jump + 1. Both arrays have quad_count + 1 items.
+ * Returns the number of counters.
+ */
+uint32_t place_counters(Routine *routine, uint32_t *counter_of, uint32_t *counter_at);
+
+/**
+ * Execution counts of a program keyed by routine name and quad index.
+ * The quad indices are those of the optimized IR so a profile is valid
+ * only for the same source. Routines that never ran are not in it.
+ *
+ * The file is text. Each routine starts with a line
+ *     routine <name> <quad count>
+ * and each quad that was executed has a line
+ *     <quad index> <count>
+ * JZ and JNZ quads also have the number of times they jumped after the count.
+ */
+struct Profile
+{
+    Alloc a;
+    List<RoutineProfile *> routines;
+
+    /**
+     * Returns the counts of the routine with the given name or null.
+     */
+    RoutineProfile *find(Str name);
+
+    /**
+     * Returns the counts of the routine, adding zero counts if it has none.
+     * Returns null if the routine has counts for a different number of quads.
+     */
+    RoutineProfile *add(Str name, uint32_t quad_count);
+
+    /**
+     * Replaces the counts of the routine with zero counts for the given
+     * number of quads.
+     */
+    RoutineProfile *reset(Str name, uint32_t quad_count);
+
+    /**
+     * Writes the profile. Returns false and prints an error if it fails.
+     */
+    bool save(const char *path);
+
+    /**
+     * Reads a profile written by save() and adds its counts to this one.
+     * Each routine in it must be in the IR and have the same number of quads.
+     * Returns false and prints an error if it fails.
+     */
+    bool load(const char *path, IR ir);
+
+    /**
+     * Reads the counters written by a program compiled with
+     * CodeGenOptions::profile_generate and adds their counts.
+     * The routines of the IR must be the ones that were compiled.
+     * Returns false and prints an error if it fails.
+     */
+    bool load_counters(const char *path, IR ir);
+};
+
+#endif // PROFILE_H
@@ -1,8 +1,14 @@
 #ifndef REGISTER_ALLOC_H
 #define REGISTER_ALLOC_H
 
+#include "code_gen.h"
+#include "list.h"
 #include "assert.h"
 
+#include <cstdlib>
+
+// NOTE: rbx and r12-r15 are callee save on both targets.
+// rsi and rdi are callee save on Windows and volatile on System V.
 #define PASTE_REGS  \
     PASTE_REG(rax)  \
     PASTE_REG(rcx)  \
@@ -10,7 +16,14 @@
     PASTE_REG(r8)   \
     PASTE_REG(r9)   \
     PASTE_REG(r10)  \
-    PASTE_REG(r11)
+    PASTE_REG(r11)  \
+    PASTE_REG(rsi)  \
+    PASTE_REG(rdi)  \
+    PASTE_REG(rbx)  \
+    PASTE_REG(r12)  \
+    PASTE_REG(r13)  \
+    PASTE_REG(r14)  \
+    PASTE_REG(r15)
 
 #define PASTE_REG(r) Reg_##r,
 
@@ -28,7 +41,13 @@ enum RegID
 struct Register
 {
     RegID id; // Actually just an index.
-    int32_t temp_id; // Temp currently in the register or -1 if none.
+
+    static Register make(RegID reg_id)
+    {
+        Register reg;
+        reg.id = reg_id;
+        return reg;
+    }
 
 #define PASTE_REG(r) #r,
 
@@ -45,94 +64,224 @@ struct Register
 #undef PASTE_REG
 };
 
-#define PARAM_REG_COUNT 4
+#define MAX_PARAM_REG_COUNT 6
 
-struct RegisterAlloc
+/**
+ * Live range of a temp and the register allocated for it.
+ */
+struct Interval
 {
-    RegID param_registers[PARAM_REG_COUNT];
-    RegID register_queue[Reg_COUNT]; // Used for least recently used allocation.
-    Register registers[Reg_COUNT];
-
-#define PASTE_REG(r) registers[Reg_##r] = (Register){ Reg_##r, -1 };
+    uint32_t temp_id;
+    int32_t start;
+    int32_t end;
+    bool crosses_call;
+    int32_t hint; // Index of the interval whose register this one should get if it's free or -1.
+    uint64_t weight; // How many times the temp is read and written when profiled or 0.
+    RegID reg_id; // Reg_NONE if the temp lives in its stack slot.
+};
 
-    void reset()
+/**
+ * Linear scan register allocator (Poletto & Sarkar).
+ * Every temp gets one register or a stack slot for its whole live range.
+ *
+ * rax, rdx and r11 are never allocated. They are scratch registers
+ * for the code generator: rax and rdx for multiplication, division,
+ * and return values, r11 and rax for loading spilled temps.
+ * Volatile registers are clobbered by calls so temps that are live
+ * across a call can only get a callee save register. Other temps
+ * prefer volatile registers because callee save registers have to be
+ * saved and restored by the routine that uses them.
+ *
+ * An interval can have a hint: the interval of the temp it is computed
+ * from. If the hinted register is free when the interval starts, the
+ * code generator doesn't have to move the value between registers.
+ *
+ * When there are no free registers, the interval with the least weight
+ * is spilled. Of the intervals with the same weight the one that ends
+ * last is spilled.
+ */
+struct RegisterAlloc
+{
+    int param_reg_count;
+    RegID param_registers[MAX_PARAM_REG_COUNT];
+    int pool_count;
+    RegID pool[Reg_COUNT]; // Allocatable registers, volatile ones first.
+    bool callee_save[Reg_COUNT];
+
+    /**
+     * Sets up the parameter registers and the allocatable registers
+     * according to the calling convention of the target.
+     */
+    void init(Target target)
     {
-        param_registers[0] = Reg_rcx;
-        param_registers[1] = Reg_rdx;
-        param_registers[2] = Reg_r8;
-        param_registers[3] = Reg_r9;
-
         for (int i = 0; i < Reg_COUNT; i++)
-            register_queue[i] = (RegID)i;
-
-        PASTE_REGS
-    }
+            callee_save[i] = false;
 
-#undef PASTE_REG
-
-    void move_back_in_queue(int queue_index)
-    {
-        RegID reg_id = register_queue[queue_index];
-        for (int i = queue_index + 1; i < Reg_COUNT; i++)
-            register_queue[i - 1] = register_queue[i];
-        register_queue[Reg_COUNT - 1] = reg_id;
-    }
+        pool_count = 0;
+        pool[pool_count++] = Reg_rcx;
+        pool[pool_count++] = Reg_r8;
+        pool[pool_count++] = Reg_r9;
+        pool[pool_count++] = Reg_r10;
 
-    Register alloc_register(RegID reg_id, int32_t temp_id)
-    {
-        assert(reg_id != Reg_NONE);
-        assert(reg_id < Reg_COUNT);
-
-        for (int i = 0; i < Reg_COUNT; i++)
+        switch (target)
         {
-            if (register_queue[i] == reg_id)
-            {
-                move_back_in_queue(i);
+            case Target_WIN64:
+                param_reg_count = 4;
+                param_registers[0] = Reg_rcx;
+                param_registers[1] = Reg_rdx;
+                param_registers[2] = Reg_r8;
+                param_registers[3] = Reg_r9;
+                add_callee_save(Reg_rsi);
+                add_callee_save(Reg_rdi);
+                break;
+            case Target_SYSV:
+                param_reg_count = 6;
+                param_registers[0] = Reg_rdi;
+                param_registers[1] = Reg_rsi;
+                param_registers[2] = Reg_rdx;
+                param_registers[3] = Reg_rcx;
+                param_registers[4] = Reg_r8;
+                param_registers[5] = Reg_r9;
+                pool[pool_count++] = Reg_rsi;
+                pool[pool_count++] = Reg_rdi;
                 break;
-            }
         }
 
-        Register reg = registers[reg_id];
-        registers[reg_id].temp_id = temp_id;
-        return reg;
+        add_callee_save(Reg_rbx);
+        add_callee_save(Reg_r12);
+        add_callee_save(Reg_r13);
+        add_callee_save(Reg_r14);
+        add_callee_save(Reg_r15);
     }
 
-    Register alloc_any_register(int32_t temp_id)
+    void add_callee_save(RegID reg_id)
     {
-        RegID reg_id = register_queue[0];
-
-        move_back_in_queue(0);
+        pool[pool_count++] = reg_id;
+        callee_save[reg_id] = true;
+    }
 
-        Register reg = registers[reg_id];
-        registers[reg_id].temp_id = temp_id;
-        return reg;
+    /**
+     * Temps that are live across a call can't be in volatile registers.
+     */
+    bool can_use(Interval *interval, RegID reg_id)
+    {
+        return !interval->crosses_call || callee_save[reg_id];
     }
 
     bool get_param_register(int param_index, Register *reg)
     {
-        if(param_index >= PARAM_REG_COUNT)
+        if(param_index >= param_reg_count)
             return false;
 
-        RegID reg_id = param_registers[param_index];
-        *reg = registers[reg_id];
+        *reg = Register::make(param_registers[param_index]);
         return true;
     }
 
-    void dealloc_register(RegID reg_id)
+    static int compare_start(const void *a, const void *b)
     {
-        assert(reg_id != Reg_NONE);
-        assert(reg_id < Reg_COUNT);
-        assert(registers[reg_id].temp_id >= 0);
-
-        registers[reg_id].temp_id = -1;
+        const Interval *x = *(const Interval **)a;
+        const Interval *y = *(const Interval **)b;
+        if (x->start != y->start)
+            return (x->start < y->start) ? -1 : 1;
+        return (x->temp_id < y->temp_id) ? -1 : (x->temp_id > y->temp_id);
     }
 
-    Register get_register_by_id(RegID reg_id)
+    /**
+     * Assigns registers to the intervals. Intervals that don't get
+     * a register have reg_id Reg_NONE.
+     */
+    void allocate(List<Interval> &intervals)
     {
-        assert(reg_id != Reg_NONE);
-        assert(reg_id < Reg_COUNT);
+        uint32_t count = intervals.get_size();
+
+        List<Interval *> sorted;
+        sorted.resize(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            sorted[i] = &intervals[i];
+            sorted[i]->reg_id = Reg_NONE;
+        }
+        if (count > 1)
+            qsort(&sorted[0], count, sizeof(Interval *), compare_start);
+
+        bool is_free[Reg_COUNT] = {};
+        for (int i = 0; i < pool_count; i++)
+            is_free[pool[i]] = true;
+
+        List<Interval *> active; // sorted by increasing end
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            Interval *current = sorted[i];
+
+            // Expire the intervals that ended before this one starts.
+            uint32_t kept = 0;
+            for (uint32_t a = 0; a < active.get_size(); a++)
+            {
+                if (active[a]->end < current->start)
+                    is_free[active[a]->reg_id] = true;
+                else
+                    active[kept++] = active[a];
+            }
+            active.resize(kept);
 
-        return registers[reg_id];
+            RegID reg_id = Reg_NONE;
+            if (current->hint >= 0)
+            {
+                RegID hint = intervals[current->hint].reg_id;
+                if (hint != Reg_NONE && is_free[hint] && can_use(current, hint))
+                    reg_id = hint;
+            }
+            for (int r = 0; r < pool_count && reg_id == Reg_NONE; r++)
+            {
+                if (is_free[pool[r]] && can_use(current, pool[r]))
+                {
+                    reg_id = pool[r];
+                    break;
+                }
+            }
+
+            if (reg_id == Reg_NONE)
+            {
+                // Spill the current interval or an active one that has
+                // a register the current one can use.
+                int32_t spill = -1;
+                Interval *victim = current;
+                for (int32_t a = active.get_size() - 1; a >= 0; a--)
+                {
+                    Interval *other = active[a];
+                    if (!can_use(current, other->reg_id))
+                        continue;
+                    if (other->weight < victim->weight ||
+                        (other->weight == victim->weight && other->end > victim->end))
+                    {
+                        spill = a;
+                        victim = other;
+                    }
+                }
+                if (spill < 0)
+                    continue;
+                reg_id = victim->reg_id;
+                victim->reg_id = Reg_NONE;
+                for (uint32_t a = spill + 1; a < active.get_size(); a++)
+                    active[a - 1] = active[a];
+                active.resize(active.get_size() - 1);
+            }
+
+            is_free[reg_id] = false;
+            current->reg_id = reg_id;
+
+            // Insert into active keeping it sorted by end.
+            active.push(current);
+            for (uint32_t a = active.get_size() - 1; a > 0; a--)
+            {
+                if (active[a - 1]->end <= active[a]->end)
+                    break;
+                Interval *tmp = active[a - 1];
+                active[a - 1] = active[a];
+                active[a] = tmp;
+            }
+        }
     }
 };
 
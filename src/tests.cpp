@@ -1,5 +1,11 @@
 #include "ir_eval.h"
-#include "ir_gen.h"
+#include "ir_opt.h"
+#include "ir_ssa.h"
+#include "ir_vm.h"
+#include "jit.h"
+#include "dynlib.h"
+#include "profile.h"
+#include "ir.h"
 #include "check.h"
 #include "parser.h"
 #include "lexer.h"
@@ -7,6 +13,7 @@
 #include "error_context.h"
 
 #include <cstdio>
+#include <cstring>
 
 //
 // IR gen tests
@@ -38,6 +45,7 @@ void run_ir_gen_tests()
     TEST("int x = 5 + 5;", 10)
     TEST("int x = 5 + 5; int y = x * 10;", 100)
     TEST("int x; int y = 10; x = 5 + y;", 15)
+    TEST("int x = 1; int y = x; x = 2; int z = y + 0;", 1)
     TEST("int x = -5;", -5)
     TEST("int x = 10 - 5;", 5)
     TEST("bool result = (5 < 6);", true)
@@ -53,6 +61,8 @@ void run_ir_gen_tests()
     TEST("function f(int x) -> int { return x + 1; }"
          "int x = 0; while (x < 5) x = f(x);", false)
     TEST("function f() -> bool { return false; } f();", false)
+    TEST("function f(int a, int b) -> int { return a - b; }"
+         "f(f(5, 1), f(3, 1));", 2)
     TEST("function f() -> int { return 1*2*3*4*-5+8; } f();", -112)
     TEST("function g(int i) -> int { int x = 5; return i*i + x; }"
          "function f() -> int {"
@@ -105,12 +115,934 @@ void run_ir_gen_tests()
     TEST("uint x = 10u / 5u;", 2);
     TEST("uint x = 9u / 5u;", 1);
 
+    // long routine
+#define INC4 "x = x + 1; x = x + 1; x = x + 1; x = x + 1; "
+#define INC40 INC4 INC4 INC4 INC4 INC4 INC4 INC4 INC4 INC4 INC4
+#define INC400 INC40 INC40 INC40 INC40 INC40 INC40 INC40 INC40 INC40 INC40
+    TEST("int x = 0; " INC40, 40)
+    TEST("function f(int x) -> int { " INC40 " return x; } f(1);", 41)
+    TEST("function f(int x) -> int { " INC400 " return x; } f(1) + f(2);", 803)
+#undef INC400
+#undef INC40
+#undef INC4
+
+    // deep recursion
+    TEST("function fibo(int n) -> int {"
+         "  if (n == 1 || n == 2) return 1;"
+         "  return fibo(n - 1) + fibo(n - 2);"
+         "} fibo(30);", 832040)
+    TEST("function depth(int n) -> int { if (n == 0) return 0; return depth(n - 1) + 1; } depth(1000);", 1000)
+
     fprintf(stdout, "------------------------------\n");
     fprintf(stdout, "ran %d ir gen tests: %d succeeded, %d failed.\n\n\n", tests, tests - failed, failed);
 }
 
 #undef TEST
 
+//
+// IR optimization tests
+//
+
+static int count_quads(IR ir, IR::Type op)
+{
+    int count = 0;
+    Routine *routine = ir.routines;
+    while (routine)
+    {
+        for (Quad quad : *routine)
+        {
+            if (quad.op == op)
+                count += 1;
+        }
+        routine = routine->next;
+    }
+    return count;
+}
+
+/**
+ * Counts the quads of the given type that are between a label and
+ * a jump back to it.
+ */
+static int count_quads_in_loops(IR ir, IR::Type op)
+{
+    int count = 0;
+    List<bool> in_loop;
+    for (Routine *routine = ir.routines; routine; routine = routine->next)
+    {
+        uint32_t quad_count = routine->quad_count;
+        in_loop.resize(quad_count);
+        for (uint32_t i = 0; i < quad_count; i++)
+            in_loop[i] = false;
+
+        // Labels are the indices of their quads.
+        for (uint32_t i = 0; i < quad_count; i++)
+        {
+            Quad quad = (*routine)[i];
+            if ((quad.op == IR::JMP || quad.op == IR::JZ || quad.op == IR::JNZ) && quad.target.label < i)
+            {
+                for (uint32_t k = quad.target.label; k <= i; k++)
+                    in_loop[k] = true;
+            }
+        }
+
+        for (uint32_t i = 0; i < quad_count; i++)
+        {
+            if (in_loop[i] && (*routine)[i].op == op)
+                count += 1;
+        }
+    }
+    return count;
+}
+
+// Optimized IR must evaluate to the same value as the original and
+// have op_count quads of the given type left (in loops if in_loops).
+#define TEST_OPS_IN(input, value, op, op_count, in_loops) { \
+    tests += 1; \
+    Alloc a; \
+    ErrorContext ec(1); \
+    Ast ast = parse(input, a, ec); \
+    check(ast, ec); \
+    IR ir = gen_ir(ast, a); \
+    uint64_t expected = eval(ir); \
+    optimize(ir); \
+    int count = in_loops ? count_quads_in_loops(ir, op) : count_quads(ir, op); \
+    if (expected != (uint64_t)value || eval(ir) != expected || count != op_count) { \
+        fprintf(stderr, "ir opt test #%d failed.\n\n", tests); \
+        failed += 1; \
+    } \
+}
+
+#define TEST_OPS(input, value, op, op_count) TEST_OPS_IN(input, value, op, op_count, false)
+#define TEST_LOOP_OPS(input, value, op, op_count) TEST_OPS_IN(input, value, op, op_count, true)
+
+#define TEST(input, value) TEST_OPS(input, value, IR::NOP, count_quads(ir, IR::NOP))
+
+void run_ir_opt_tests()
+{
+    int tests = 0;
+    int failed = 0;
+
+    fprintf(stdout, "running ir opt tests...\n\n");
+
+    // NOTE: Optimizations change which values are set last in the
+    // top level, so the tests call a function and use its return value.
+
+    // constant folding
+    TEST_OPS("function f() -> int { return 1*2*3*4*-5+8; } f();", -112, IR::IMUL, 0)
+    TEST_OPS("function f() -> int { return 1*2*3*4*-5+8; } f();", -112, IR::ADD, 0)
+    TEST_OPS("function f() -> uint { return 7u / 2u - 1u; } f();", 2, IR::DIV, 0)
+    TEST_OPS("function f() -> int { return -7 / 2; } f();", -3, IR::IDIV, 0)
+    TEST_OPS("function f() -> bool { return 5u > 3u && !(2 != 2); } f();", true, IR::ABOVE, 0)
+    TEST_OPS("function f() -> bool { return 0u - 1u < 1u; } f();", false, IR::BELOW, 0)
+    TEST_OPS("function f() -> bool { return 0 - 1 < 1; } f();", true, IR::LT, 0)
+
+    // constant propagation
+    TEST_OPS("function f() -> int { int x = 5; int y = x * 2; return y - 3; } f();", 7, IR::SUB, 0)
+    TEST_OPS("function f() -> int {"
+             "  int x = 5;"
+             "  if (x < 10) x = x + 1; else x = x - 1;"
+             "  return x * 2;"
+             "} f();", 12, IR::JZ, 0)
+    TEST_OPS("function f(bool c) -> int {"
+             "  int x;"
+             "  if (c) x = 3; else x = 3;"
+             "  return x * 2;"
+             "} f(true);", 6, IR::IMUL, 0)
+    TEST_OPS("function f() -> int {"
+             "  int k = 3; int s = 0; int i = 0;"
+             "  while (i < 4) { s = s + k * 2; i = i + 1; }"
+             "  return s;"
+             "} f();", 24, IR::IMUL, 0)
+    TEST_OPS("function f() -> int { while (false) { } return 1; } f();", 1, IR::JZ, 0)
+
+    // values that are not constants
+    TEST_OPS("function f(int a) -> int { int x = 2; return a * x; } f(21);", 42, IR::IMUL, 1)
+    TEST_OPS("function f(bool c) -> int {"
+             "  int x;"
+             "  if (c) x = 3; else x = 4;"
+             "  return x * 2;"
+             "} f(false);", 8, IR::IMUL, 1)
+    TEST("function f() -> int {"
+         "  int i = 0; int s = 0;"
+         "  while (i < 10) { s = s + i; i = i + 1; }"
+         "  return s;"
+         "} f();", 45)
+    TEST_OPS("function f(bool c) -> int {"
+             "  int z = 0;"
+             "  if (c) return 10 / z;"
+             "  return 1;"
+             "} f(false);", 1, IR::IDIV, 1)
+    TEST_OPS("function f(int x) -> int { return x; }"
+             "function g(int a) -> int { return f(a) * 3; } g(2);", 6, IR::IMUL, 1)
+
+    // dead code
+    TEST_OPS("function f() -> int { 5; return 1; } f();", 1, IR::MOV_IM, 1)
+    TEST_OPS("function f(int a) -> int { int x = a * 7; return a; } f(3);", 3, IR::IMUL, 0)
+    TEST_OPS("function f(int a) -> int { return a; a = a * 3; return a; } f(3);", 3, IR::IMUL, 0)
+    TEST_OPS("function f(int n) -> int {"
+             "  int s = 1; int i = 0;"
+             "  while (i < n) { s = s * 3; i = i + 1; }"
+             "  return i;"
+             "} f(4);", 4, IR::IMUL, 0)
+    TEST_OPS("function f() -> int { int x; int y = 3; return 2; } f();", 2, IR::MOV_IM, 1)
+    TEST_OPS("function g(int a) -> int { if (a > 0) return g(a - 1) + 1; return a; }"
+             "function f(int b) -> int { g(b); return 1; } f(3);", 1, IR::CALL, 3)
+    TEST_OPS("function f(int a) -> int { int x = 7 / a; return 1; } f(1);", 1, IR::IDIV, 1)
+
+    // pure calls
+    TEST_OPS("function f(int x) -> int { return x; }"
+             "function g() -> int { return f(2) * 3; } g();", 6, IR::IMUL, 0)
+    TEST_OPS("function fibo(int n) -> int {"
+             "  if (n == 1 || n == 2) return 1;"
+             "  return fibo(n - 1) + fibo(n - 2);"
+             "}"
+             "function f() -> int { return fibo(20); } f();", 6765, IR::CALL, 3)
+    TEST_OPS("function g(int a) -> int { return a; }"
+             "function f() -> int { g(3); return 1; } f();", 1, IR::CALL, 1)
+    TEST_OPS("extern function h() -> int;"
+             "function g(int a) -> int { h(); return a; }"
+             "function f() -> int { return g(3); } f();", 3, IR::CALL, 3)
+    TEST_OPS("function g(int a) -> int { if (a > 9) return g(a - 1) + 1; return 7 / a; }"
+             "function f(bool b) -> int { if (b) return g(0); return 1; } f(false);", 1, IR::CALL, 3)
+    TEST_OPS("function g(int a) -> int { if (a < 0) return g(a) + 1; while (true) a = a + 1; return a; }"
+             "function f(bool b) -> int { if (b) return g(0); return 1; } f(false);", 1, IR::CALL, 3)
+    TEST_OPS("function c(int n) -> int { if (n <= 0) return 0; return n + c(n - 1); }"
+             "function f(int x) -> int {"
+             "  if (x <= 2) return x + 1000;"
+             "  int y = x * 3 + 1; int z = y * y - x; int w = z + y * 7 - 2;"
+             "  return f(2) + c(x) + w * 100000;"
+             "}"
+             "function g() -> int { return f(7); } g();", 62901030, IR::CALL, 3)
+
+    // copies
+    TEST_OPS("function f(int a) -> int { int x = a; int y = x; return y + x; } f(4);", 8, IR::MOV, 0)
+    TEST_OPS("function f(int a, int b) -> int {"
+             "  if (a < b && b < 10) return 1;"
+             "  return 2;"
+             "} f(1, 2);", 1, IR::MOV, 0)
+    TEST_OPS("function f(int n) -> int {"
+             "  int i = 0; int s = 0;"
+             "  while (i < n) { s = s + i; i = i + 1; }"
+             "  return s;"
+             "} f(10);", 45, IR::MOV, 0)
+    TEST_OPS("function f(bool c, int a, int b) -> int {"
+             "  int x = a;"
+             "  if (c) x = b;"
+             "  return x;"
+             "}"
+             "function g() -> int { return f(true, 1, 2) * 10 + f(false, 1, 2); } g();", 21, IR::MOV, 1)
+    TEST_OPS("function f(int n) -> int {"
+             "  int a = 1; int b = 2;"
+             "  while (n > 0) { int t = a; a = b; b = t; n = n - 1; }"
+             "  return a * 10 + b;"
+             "} f(3);", 21, IR::IMUL, 1)
+
+    // tail recursion
+    TEST_OPS("function f(int n, int s) -> int {"
+             "  if (n == 0) return s;"
+             "  return f(n - 1, s + n);"
+             "} f(10, 0);", 55, IR::CALL, 1)
+    TEST_OPS("function gcd(int a, int b) -> int {"
+             "  if (b == 0) return a;"
+             "  return gcd(b, a - a / b * b);"
+             "} gcd(1071, 462);", 21, IR::CALL, 1)
+
+    // loop invariants
+    TEST_LOOP_OPS("function f(int n, int k) -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i < n) { s = s + k * 3; i = i + 1; }"
+                  "  return s;"
+                  "} f(4, 5);", 60, IR::IMUL, 0)
+    TEST_LOOP_OPS("function f(int n) -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i < n) { s = s + i; i = i + 1; }"
+                  "  return s;"
+                  "} f(10);", 45, IR::MOV_IM, 0)
+    TEST_LOOP_OPS("function f(int n, int k) -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i < n) {"
+                  "    int j = 0;"
+                  "    while (j < n) { s = s + k * 3; j = j + 1; }"
+                  "    i = i + 1;"
+                  "  }"
+                  "  return s;"
+                  "} f(3, 5);", 135, IR::IMUL, 0)
+    TEST_LOOP_OPS("function f(int n, int k) -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i < n) { if (k != 0) s = s + 100 / k; i = i + 1; }"
+                  "  return s;"
+                  "} f(4, 0);", 0, IR::IDIV, 1)
+    TEST_LOOP_OPS("function f(int n, int k) -> int {"
+                  "  int i = 0; int s = 0; int x = 1;"
+                  "  while (i < n) { s = s + x * 5; x = k + 1; i = i + 1; }"
+                  "  return s;"
+                  "} f(3, 7);", 85, IR::IMUL, 1)
+
+    // induction variables
+    TEST_LOOP_OPS("function f(int n) -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i < n) { s = s + i * 8; i = i + 1; }"
+                  "  return s;"
+                  "} f(4);", 48, IR::IMUL, 0)
+    TEST_LOOP_OPS("function f(int n, int b, int k) -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i < n) { s = s + b + i * k; i = i + 1; }"
+                  "  return s;"
+                  "} f(4, 10, 3);", 58, IR::IMUL, 0)
+    TEST_LOOP_OPS("function f(int n) -> int {"
+                  "  int i = n; int s = 0;"
+                  "  while (i > 0) { s = s + i * 3; i = i - 1; }"
+                  "  return s;"
+                  "} f(4);", 30, IR::IMUL, 0)
+    TEST_LOOP_OPS("function f(int n) -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i < n) {"
+                  "    int j = 0;"
+                  "    while (j < n) { s = s + i * 10 + j; j = j + 1; }"
+                  "    i = i + 1;"
+                  "  }"
+                  "  return s;"
+                  "} f(3);", 99, IR::IMUL, 0)
+    TEST_LOOP_OPS("function f(int n) -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i != n) { s = s + i * 3; i = i + 1; }"
+                  "  return s;"
+                  "} f(5);", 30, IR::ADD, 2)
+    TEST_LOOP_OPS("function f() -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i < 100) { s = s + i * 4; i = i + 1; }"
+                  "  return s;"
+                  "} f();", 19800, IR::ADD, 2)
+    TEST_LOOP_OPS("function f(int n) -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i != n) { s = s + i * 4; i = i + 1; }"
+                  "  return s;"
+                  "} f(5);", 40, IR::ADD, 3)
+    TEST_LOOP_OPS("function f(int n) -> int {"
+                  "  int i = 0; int s = 0;"
+                  "  while (i < n) { s = s + i * 4; i = i + 1; }"
+                  "  return s + i;"
+                  "} f(3);", 15, IR::ADD, 3)
+
+    // inlining
+    TEST_OPS("function f(int x) -> int { return x + 1; }"
+             "function g(int n) -> int {"
+             "  int i = 0; int s = 0;"
+             "  while (i < n) { s = s + f(i); i = i + 1; }"
+             "  return s;"
+             "} g(4);", 10, IR::CALL, 1)
+    TEST_OPS("function f(bool c) -> int { if (c) return 3; return 4; }"
+             "function g(bool c) -> int { return f(c) * 10 + f(!c); } g(true);", 34, IR::CALL, 1)
+    TEST_OPS("function f(int n) -> int { if (n == 0) return 0; return f(n - 1) + 1; }"
+             "function g(int n) -> int { return f(n) + f(n); } g(3);", 6, IR::CALL, 4)
+    TEST_OPS("function h(int a) -> int {"
+             "  int b = a * 3 + 1; int c = b * 5 - a; int d = c * 7 + b; int e = d * 11 - c;"
+             "  return e * 13 + d;"
+             "}"
+             "function g(int x) -> int { return h(x); } g(2);", 33843, IR::CALL, 2)
+    TEST_OPS("function h(int a) -> int {"
+             "  int b = a * 3 + 1; int c = b * 5 - a; int d = c * 7 + b; int e = d * 11 - c;"
+             "  return e * 13 + d;"
+             "}"
+             "function g(int n) -> int {"
+             "  int i = 0; int s = 0;"
+             "  while (i < n) { s = s + h(i); i = i + 1; }"
+             "  return s;"
+             "} g(2);", 24600, IR::CALL, 1)
+
+    fprintf(stdout, "------------------------------\n");
+    fprintf(stdout, "ran %d ir opt tests: %d succeeded, %d failed.\n\n\n", tests, tests - failed, failed);
+}
+
+#undef TEST
+#undef TEST_OPS
+#undef TEST_LOOP_OPS
+#undef TEST_OPS_IN
+
+//
+// IR SSA tests
+//
+
+/**
+ * Puts all routines to SSA form and back. Returns false if
+ * some routine is not valid in the SSA form.
+ */
+static bool ssa_round_trip(IR ir)
+{
+    bool valid = true;
+    Routine *routine = ir.routines;
+    while (routine)
+    {
+        if (!routine->external)
+        {
+            SSA ssa;
+            ssa.build(routine);
+            if (!ssa.verify(routine))
+                valid = false;
+            ssa.destroy(routine);
+        }
+        routine = routine->next;
+    }
+    return valid;
+}
+
+// Routines must be valid in the SSA form and evaluate
+// to the same value after the SSA form is destroyed.
+#define TEST(input, value) { \
+    tests += 1; \
+    Alloc a; \
+    ErrorContext ec(1); \
+    Ast ast = parse(input, a, ec); \
+    check(ast, ec); \
+    IR ir = gen_ir(ast, a); \
+    uint64_t expected = eval(ir); \
+    if (!ssa_round_trip(ir) || expected != (uint64_t)value || eval(ir) != expected) { \
+        fprintf(stderr, "ir ssa test #%d failed.\n\n", tests); \
+        failed += 1; \
+    } \
+}
+
+void run_ir_ssa_tests()
+{
+    int tests = 0;
+    int failed = 0;
+
+    fprintf(stdout, "running ir ssa tests...\n\n");
+
+    // straight code and branches
+    TEST("function f(int a) -> int { int x = a; x = x + 1; x = x * 2; return x; } f(4);", 10)
+    TEST("function f(bool c) -> int {"
+         "  int x = 1;"
+         "  if (c) x = 2;"
+         "  return x;"
+         "} f(true) * 10 + f(false);", 21)
+    TEST("function f(bool c) -> int {"
+         "  int x = 1;"
+         "  if (c) { } else x = 3;"
+         "  return x;"
+         "} f(true) * 10 + f(false);", 13)
+    TEST("function f(int a, int b) -> bool { return a < b && b < 10 || a == 7; }"
+         "function g() -> int {"
+         "  int n = 0;"
+         "  if (f(1, 2)) n = n + 1;"
+         "  if (f(1, 20)) n = n + 10;"
+         "  if (f(7, 1)) n = n + 100;"
+         "  return n;"
+         "} g();", 101)
+    TEST("function f(int a) -> int { if (a < 0) return -a; return a; } f(-3) + f(4);", 7)
+
+    // loops
+    TEST("function f(int n) -> int {"
+         "  int i = 0; int s = 0;"
+         "  while (i < n) { s = s + i; i = i + 1; }"
+         "  return s;"
+         "} f(10);", 45)
+    TEST("function f(int n) -> int {"
+         "  while (n > 10) n = n - 3;"
+         "  return n;"
+         "} f(20);", 8)
+    TEST("function f(int n) -> int {"
+         "  int s = 0; int i = 0;"
+         "  while (i < n) {"
+         "    int j = 0;"
+         "    while (j < i) { if (j < 3) s = s + j; else s = s + 1; j = j + 1; }"
+         "    i = i + 1;"
+         "  }"
+         "  return s;"
+         "} f(6);", 13)
+
+    // phis that read each other (swap and rotate)
+    TEST("function f(int n) -> int {"
+         "  int a = 1; int b = 2;"
+         "  while (n > 0) { int t = a; a = b; b = t; n = n - 1; }"
+         "  return a * 10 + b;"
+         "} f(3);", 21)
+    TEST("function f(int n) -> int {"
+         "  int a = 1; int b = 2; int c = 3;"
+         "  while (n > 0) { int t = a; a = b; b = c; c = t; n = n - 1; }"
+         "  return a * 100 + b * 10 + c;"
+         "} f(4);", 231)
+    TEST("function f(int n) -> int {"
+         "  int a = 0; int b = 1;"
+         "  while (n > 0) { int t = a + b; a = b; b = t; n = n - 1; }"
+         "  return a;"
+         "} f(12);", 144)
+
+    // values used after the loop that exits in the middle
+    TEST("function f(int n) -> int {"
+         "  int x = 0;"
+         "  while (true) { x = x + 2; if (x > n) return x; x = x + 1; }"
+         "  return -1;"
+         "} f(10);", 11)
+
+    fprintf(stdout, "------------------------------\n");
+    fprintf(stdout, "ran %d ir ssa tests: %d succeeded, %d failed.\n\n\n", tests, tests - failed, failed);
+}
+
+#undef TEST
+
+//
+// IR VM tests
+//
+
+/**
+ * Runs the main function of the program in the interpreter.
+ */
+static uint64_t run_main(IR ir)
+{
+    VM vm;
+    vm.init(ir);
+    uint32_t main_id;
+    if (!vm.find(Str::make("main"), &main_id))
+        return (uint64_t)-1;
+    return vm.call(main_id, nullptr, 0);
+}
+
+// The interpreter must give the same result before and after optimization.
+#define TEST(input, value) { \
+    tests += 1; \
+    Alloc a; \
+    ErrorContext ec(1); \
+    Ast ast = parse(input, a, ec); \
+    check(ast, ec); \
+    IR ir = gen_ir(ast, a); \
+    uint64_t result = run_main(ir); \
+    optimize(ir); \
+    if (result != (uint64_t)value || run_main(ir) != result) { \
+        fprintf(stderr, "ir vm test #%d failed.\n\n", tests); \
+        failed += 1; \
+    } \
+}
+
+void run_ir_vm_tests()
+{
+    int tests = 0;
+    int failed = 0;
+
+    fprintf(stdout, "running ir vm tests...\n\n");
+
+    // arithmetic and comparisons
+    TEST("function main() -> int { return 1 + 2 * 3; }", 7)
+    TEST("function main() -> int { int a = 7; return -a / 2; }", -3)
+    TEST("function main() -> int { int a = 0; a = a - 1; return a * a; }", 1)
+    TEST("function main() -> int { int a = -5; if (a < 3 && !(a >= 0)) return 1; return 0; }", 1)
+    TEST("function main() -> int { int a = 3; if (a == 3 || a != 4) return 10; return 20; }", 10)
+
+    // no return value
+    TEST("function main() { int a = 1; }", 0)
+    TEST("function main() -> int { int a = 1; if (a > 0) { a = 5; } }", 0)
+
+    // loops
+    TEST("function main() -> int {"
+         "  int i = 0; int s = 0;"
+         "  while (i < 100) { s = s + i; i = i + 1; }"
+         "  return s;"
+         "}", 4950)
+    TEST("function main() -> int {"
+         "  int a = 1; int b = 2; int n = 5;"
+         "  while (n > 0) { int t = a; a = b; b = t; n = n - 1; }"
+         "  return a * 10 + b;"
+         "}", 21)
+
+    // calls, arguments and recursion
+    TEST("function f(int a, int b, int c, int d, int e, int f, int g, int h) -> int {"
+         "  return a - b + c - d + e - f + g - h * 10;"
+         "}"
+         "function main() -> int { return f(1, 2, 3, 4, 5, 6, 7, 8); }", -76)
+    TEST("function f(int a, int b) -> int { return a * 10 + b; }"
+         "function main() -> int { return f(f(1, 2), f(3, 4)); }", 154)
+    TEST("function fibo(int n) -> int {"
+         "  if (n == 1 || n == 2) return 1;"
+         "  return fibo(n - 1) + fibo(n - 2);"
+         "}"
+         "function main() -> int { return fibo(25); }", 75025)
+    TEST("function depth(int n) -> int { if (n == 0) return 0; return depth(n - 1) + 1; }"
+         "function main() -> int { return depth(100000); }", 100000)
+    TEST("function f(int n) -> int {"
+         "  int i = 0; int s = 0;"
+         "  while (i < n) { s = s + f(i) + 1; i = i + 1; }"
+         "  return s;"
+         "}"
+         "function main() -> int { return f(10); }", 1023)
+
+    // external routines return 0 if they aren't linked
+    TEST("extern function ext(int a) -> int;"
+         "function main() -> int { return ext(5) + 3; }", 3)
+
+#undef TEST
+
+    // Linked external routines are called as native code.
+#define TEST(input, value) { \
+    tests += 1; \
+    Alloc a; \
+    ErrorContext ec(1); \
+    Ast ast = parse(input, a, ec); \
+    check(ast, ec); \
+    IR ir = gen_ir(ast, a); \
+    optimize(ir); \
+    DynLibs libs; \
+    VM vm; \
+    vm.init(ir); \
+    uint32_t main_id; \
+    if (!vm.link(libs) || !vm.find(Str::make("main"), &main_id) || \
+        vm.call(main_id, nullptr, 0) != (uint64_t)value) { \
+        fprintf(stderr, "ir vm test #%d failed.\n\n", tests); \
+        failed += 1; \
+    } \
+}
+
+    TEST("extern function labs(int a) -> int;"
+         "function main() -> int { return labs(-5) + 3; }", 8)
+    TEST("extern function labs(int a) -> int;"
+         "function main() -> int {"
+         "  int i = -10; int s = 0;"
+         "  while (i < 10) { s = s + labs(i); i = i + 1; }"
+         "  return s;"
+         "}", 100)
+
+#undef TEST
+
+    // The run stops on a division that would trap and when the fuel runs
+    // out. The VM can be used again after that.
+#define TEST(input, arg, fuel_left, message) { \
+    tests += 1; \
+    Alloc a; \
+    ErrorContext ec(1); \
+    Ast ast = parse(input, a, ec); \
+    check(ast, ec); \
+    IR ir = gen_ir(ast, a); \
+    optimize(ir); \
+    VM vm; \
+    vm.init(ir); \
+    vm.fuel = fuel_left; \
+    uint32_t main_id; \
+    vm.find(Str::make("main"), &main_id); \
+    uint64_t args[1] = { (uint64_t)arg }; \
+    uint64_t result = vm.call(main_id, args, 1); \
+    if (result != 0 || !vm.error || strcmp(vm.error, message) != 0 || vm.returns.get_size() != 0) { \
+        fprintf(stderr, "ir vm test #%d failed.\n\n", tests); \
+        failed += 1; \
+    } \
+    vm.fuel = UINT64_MAX; \
+    args[0] = 7; \
+    if (vm.call(main_id, args, 1) != 1 || vm.error) { \
+        fprintf(stderr, "ir vm test #%d failed.\n\n", tests); \
+        failed += 1; \
+    } \
+}
+
+    TEST("function main(int n) -> int { return 7 / n; }", 0, UINT64_MAX, "division by zero or overflow")
+    TEST("function f(int n) -> int { return 7 / n; }"
+         "function main(int n) -> int { return f(n) * 2 - 1; }", 0, UINT64_MAX, "division by zero or overflow")
+    TEST("function main(int n) -> int { while (n != 7) n = n + 1; return 1; }", 0, 3, "out of fuel")
+    TEST("function f(int n) -> int { if (n == 7) return 1; return f(n + 1); }"
+         "function main(int n) -> int { return f(n); }", 0, 5, "out of fuel")
+
+
+    // Profiling counts how many times each quad runs and each JZ jumps.
+    {
+        tests += 1;
+        Alloc a;
+        ErrorContext ec(1);
+        Ast ast = parse("function main(int n) -> int {"
+                        "  int i = 0; int s = 0;"
+                        "  while (i < n) { if (i < 3) s = s + 1; i = i + 1; }"
+                        "  return s;"
+                        "}", a, ec);
+        check(ast, ec);
+        IR ir = gen_ir(ast, a);
+        optimize(ir);
+        VM vm;
+        vm.init(ir);
+        vm.profiling = true;
+        uint32_t main_id;
+        vm.find(Str::make("main"), &main_id);
+        uint64_t args[1] = { 10 };
+        Profile profile;
+        bool ok = vm.call(main_id, args, 1) == 3 && vm.add_profile(profile);
+        RoutineProfile *counts = profile.find(Str::make("main"));
+        Routine *routine = vm.routines[main_id].routine;
+        ok = ok && counts && counts->quad_count == routine->quad_count && counts->counts[0] == 1;
+        uint64_t expected[] = { 11, 1, 10, 7 }; // count and taken of each JZ
+        uint32_t jumps = 0;
+        for (uint32_t i = 0; ok && i < routine->quad_count; i++)
+        {
+            Quad quad = (*routine)[i];
+            if (quad.op == IR::JZ && jumps < 2)
+            {
+                ok = counts->counts[i] == expected[2 * jumps] && counts->taken[i] == expected[2 * jumps + 1];
+                jumps++;
+            }
+            if (quad.op == IR::RET)
+                ok = counts->counts[i] == 1;
+        }
+        if (!ok || jumps != 2) {
+            fprintf(stderr, "ir vm test #%d failed.\n\n", tests);
+            failed += 1;
+        }
+    }
+
+    // Common pairs of ops are fused unless the second op is a jump target.
+    {
+        tests += 1;
+        Alloc a;
+        ErrorContext ec(1);
+        Ast ast = parse("function main(int n) -> int {"
+                        "  int i = 0;"
+                        "  while (i < n) i = i + 1;"
+                        "  if (i == 5) return 1;"
+                        "  return i;"
+                        "}", a, ec);
+        check(ast, ec);
+        IR ir = gen_ir(ast, a);
+        optimize(ir);
+        VM vm;
+        vm.init(ir);
+        uint32_t main_id;
+        vm.find(Str::make("main"), &main_id);
+        VMRoutine *main_routine = &vm.routines[main_id];
+        vm.decode(main_routine);
+        VMOpcode expected[] = {
+            VMOp_MOV_IM, VMOp_MOV_IM, VMOp_LT_JZ, VMOp_JZ, VMOp_ADD, VMOp_LOOP,
+            VMOp_MOV_IM_EQ, VMOp_EQ, VMOp_JZ, VMOp_MOV_IM_RET, VMOp_RET, VMOp_RET, VMOp_RET_VOID
+        };
+        bool ok = main_routine->op_count == sizeof(expected) / sizeof(expected[0]);
+        for (uint32_t i = 0; ok && i < main_routine->op_count; i++)
+            ok = main_routine->ops[i].opcode == (uintptr_t)expected[i];
+        main_routine->ops = nullptr;
+        uint64_t args[1] = { 3 };
+        ok = ok && vm.call(main_id, args, 1) == 3;
+        args[0] = 5;
+        ok = ok && vm.call(main_id, args, 1) == 1;
+        if (!ok) {
+            fprintf(stderr, "ir vm test #%d failed.\n\n", tests);
+            failed += 1;
+        }
+    }
+
+    fprintf(stdout, "------------------------------\n");
+    fprintf(stdout, "ran %d ir vm tests: %d succeeded, %d failed.\n\n\n", tests, tests - failed, failed);
+}
+
+#undef TEST
+
+//
+// JIT tests
+//
+
+/**
+ * Runs the main function of the program as machine code.
+ */
+static uint64_t run_main_jit(IR ir)
+{
+    Jit jit;
+    if (!jit.load(ir))
+        return (uint64_t)-1;
+    void *main_address = jit.find(Str::make("main"));
+    if (main_address == nullptr)
+        return (uint64_t)-1;
+    typedef uint64_t (*MainFunc)();
+    return ((MainFunc)main_address)();
+}
+
+// The machine code must give the same result as the interpreter.
+#define TEST(input, value) { \
+    tests += 1; \
+    Alloc a; \
+    ErrorContext ec(1); \
+    Ast ast = parse(input, a, ec); \
+    check(ast, ec); \
+    IR ir = gen_ir(ast, a); \
+    optimize(ir); \
+    uint64_t result = run_main_jit(ir); \
+    if (result != (uint64_t)value || run_main(ir) != result) { \
+        fprintf(stderr, "jit test #%d failed.\n\n", tests); \
+        failed += 1; \
+    } \
+}
+
+void run_jit_tests()
+{
+    int tests = 0;
+    int failed = 0;
+
+    fprintf(stdout, "running jit tests...\n\n");
+
+    TEST("function main() -> int { return 1 + 2 * 3; }", 7)
+    TEST("function main() -> int { int a = 7; return -a / 2; }", -3)
+    TEST("function main() -> int {"
+         "  int i = 0; int s = 0;"
+         "  while (i < 100) { s = s + i; i = i + 1; }"
+         "  return s;"
+         "}", 4950)
+    TEST("function f(int a, int b, int c, int d, int e, int f, int g, int h) -> int {"
+         "  return a - b + c - d + e - f + g - h * 10;"
+         "}"
+         "function main() -> int { return f(1, 2, 3, 4, 5, 6, 7, 8); }", -76)
+    TEST("function fibo(int n) -> int {"
+         "  if (n == 1 || n == 2) return 1;"
+         "  return fibo(n - 1) + fibo(n - 2);"
+         "}"
+         "function main() -> int { return fibo(25); }", 75025)
+    TEST("function fibo(int n) -> int {"
+         "  if (n == 1 || n == 2) return 1;"
+         "  return fibo(n - 1) + fibo(n - 2);"
+         "}"
+         "function g(int a, int b) -> int { return fibo(b - a); }"
+         "function main() -> int { return g(5, 30); }", 75025)
+    TEST("function main() -> int {"
+         "  int i = -1000; int s = 0;"
+         "  while (i <= 2000) { s = s + i / 7 + i / -8 * 3 + i / 1000 - i * 9; i = i + 1; }"
+         "  return s;"
+         "}", -13850945)
+
+    // tail recursion that would run out of stack as calls
+    TEST("function count(int n, int s) -> int {"
+         "  if (n == 0) return s;"
+         "  return count(n - 1, s + 1);"
+         "}"
+         "function main() -> int { return count(10000000, 0); }", 10000000)
+
+#undef TEST
+
+    // Tiered execution must give the same result as the interpreter
+    // and the hot routine must end up compiled. The argument of main
+    // comes from the host so the calls can't be evaluated at compile time.
+#define TEST(input, arg, value, hot) { \
+    tests += 1; \
+    Alloc a; \
+    ErrorContext ec(1); \
+    Ast ast = parse(input, a, ec); \
+    check(ast, ec); \
+    IR ir = gen_ir(ast, a); \
+    optimize(ir); \
+    uint64_t args[1] = { (uint64_t)arg }; \
+    VM plain; \
+    plain.init(ir); \
+    Jit jit; \
+    VM vm; \
+    vm.init(ir); \
+    vm.jit = &jit; \
+    vm.hot_threshold = 3; \
+    uint32_t main_id, hot_id; \
+    vm.find(Str::make("main"), &main_id); \
+    vm.find(Str::make(hot), &hot_id); \
+    uint64_t result = vm.call(main_id, args, 1); \
+    if (result != (uint64_t)value || plain.call(main_id, args, 1) != result || \
+        !vm.routines[hot_id].native) { \
+        fprintf(stderr, "jit test #%d failed.\n\n", tests); \
+        failed += 1; \
+    } \
+}
+
+    TEST("function sq(int a) -> int { if (a < 0) a = sq(0 - a); return a * a; }"
+         "function main(int n) -> int {"
+         "  int i = 0; int s = 0;"
+         "  while (i < n) { s = s + sq(i); i = i + 1; }"
+         "  return s;"
+         "}", 10, 285, "sq")
+    TEST("function fibo(int n) -> int {"
+         "  if (n == 1 || n == 2) return 1;"
+         "  return fibo(n - 1) + fibo(n - 2);"
+         "}"
+         "function main(int n) -> int { return fibo(n); }", 20, 6765, "fibo")
+    TEST("function add(int a, int b) -> int { if (b < 0) b = add(0, 0 - b); return a + b; }"
+         "function f(int n) -> int {"
+         "  int i = 0; int s = 0;"
+         "  while (i < n) { s = add(s, i); i = i + 1; }"
+         "  return s;"
+         "}"
+         "function main(int n) -> int { return f(n) + f(2 * n) + f(3 * n) + f(4 * n); }", 10, 1450, "add")
+    TEST("function many(int a, int b, int c, int d, int e, int f, int g, int h, int i,"
+         "              int j, int k, int l, int m, int n, int o, int p, int q) -> int {"
+         "  if (a < 0) a = many(0 - a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, q);"
+         "  return a + q;"
+         "}"
+         "function g(int x) -> int { return many(x, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, x); }"
+         "function main(int n) -> int { return g(n) + g(n + 1) + g(n + 2) + g(n + 3) + g(n + 4); }", 1, 30, "g")
+
+#undef TEST
+
+    // Code laid out and allocated with a profile must give the same result
+    // as the interpreter also when it runs the code that didn't run before.
+#define TEST(input, profile_arg, arg, value) { \
+    tests += 1; \
+    Alloc a; \
+    ErrorContext ec(1); \
+    Ast ast = parse(input, a, ec); \
+    check(ast, ec); \
+    IR ir = gen_ir(ast, a); \
+    optimize(ir); \
+    uint64_t args[1] = { (uint64_t)profile_arg }; \
+    VM vm; \
+    vm.init(ir); \
+    vm.profiling = true; \
+    uint32_t main_id; \
+    vm.find(Str::make("main"), &main_id); \
+    vm.call(main_id, args, 1); \
+    Profile profile; \
+    vm.add_profile(profile); \
+    Jit jit; \
+    jit.profile = &profile; \
+    typedef uint64_t (*MainFunc)(uint64_t); \
+    MainFunc main_func = jit.load(ir) ? (MainFunc)jit.find(Str::make("main")) : nullptr; \
+    uint64_t result = main_func ? main_func((uint64_t)arg) : (uint64_t)-1; \
+    VM plain; \
+    plain.init(ir); \
+    args[0] = (uint64_t)arg; \
+    if (result != (uint64_t)value || plain.call(main_id, args, 1) != result) { \
+        fprintf(stderr, "jit test #%d failed.\n\n", tests); \
+        failed += 1; \
+    } \
+}
+
+    // blocks that never ran are moved to the end
+    TEST("function f(int n) -> int {"
+         "  int s = 0; int i = 0;"
+         "  while (i < n) {"
+         "    if (i > 1000) s = s - i * 3;"
+         "    else s = s + i;"
+         "    i = i + 1;"
+         "  }"
+         "  if (s < 0) return 0 - s;"
+         "  return s;"
+         "}"
+         "function main(int n) -> int { return f(n); }", 10, 1200, 156200)
+    TEST("function main(int n) -> int {"
+         "  int r = 1;"
+         "  if (n == 7) r = 2;"
+         "  else if (n == 9) r = 3;"
+         "  return r + n;"
+         "}", 1, 7, 9)
+    TEST("function main(int n) -> int {"
+         "  int r = 1;"
+         "  if (n == 7) r = 2;"
+         "  else if (n == 9) r = 3;"
+         "  return r + n;"
+         "}", 1, 9, 12)
+    TEST("function g(int n) -> int {"
+         "  if (n < 3) { int i = 0; while (i < n) i = i + 1; return i; }"
+         "  return n * 2;"
+         "}"
+         "function main(int n) -> int { return g(n) + g(n + 1); }", 5, 1, 3)
+
+    // the temps used in the loop keep their registers
+    TEST("function f(int n) -> int {"
+         "  int a = n + 1; int b = n + 2; int c = n + 3; int d = n + 4;"
+         "  int e = n + 5; int f = n + 6; int g = n + 7; int h = n + 8;"
+         "  int j = n + 9; int k = n + 10; int l = n + 11; int m = n + 12;"
+         "  int i = 0; int s = 0;"
+         "  while (i < n) { s = s + i * 2 + a; i = i + 1; }"
+         "  return s + a + b + c + d + e + f + g + h + j + k + l + m;"
+         "}"
+         "function main(int n) -> int { return f(n); }", 100, 50, 5678)
+
+    fprintf(stdout, "------------------------------\n");
+    fprintf(stdout, "ran %d jit tests: %d succeeded, %d failed.\n\n\n", tests, tests - failed, failed);
+}
+
+#undef TEST
+
 //
 // Static check tests
 //
@@ -406,4 +1338,8 @@ void run_tests()
     run_parser_tests();
     run_static_check_tests();
     run_ir_gen_tests();
+    run_ir_opt_tests();
+    run_ir_ssa_tests();
+    run_ir_vm_tests();
+    run_jit_tests();
 }
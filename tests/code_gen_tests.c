@@ -24,6 +24,15 @@ i64 imultiply(i64 a, i64 b);
 u64 divide(u64 a, u64 b);
 i64 idivide(i64 a, i64 b);
 
+u64 divide10(u64 a);
+u64 divide7(u64 a);
+u64 divide16(u64 a);
+i64 idivide7(i64 a);
+i64 idivide_minus10(i64 a);
+i64 idivide8(i64 a);
+i64 idivide_minus2(i64 a);
+i64 imultiply_consts(i64 a);
+
 i64 negate(i64 x);
 
 bool and_(bool a, bool b);
@@ -47,6 +56,8 @@ i64 call_test9();
 
 i64 basic_block_test(bool b);
 
+i64 branch_test(u64 a, u64 b);
+
 #define TEST(x, y) { i64 z = x; printf(#x " -> %lld \t\t%s\n", z, (z == y) ? "OK" : "ERROR"); }
 
 int main()
@@ -100,6 +111,20 @@ int main()
     TEST(divide(10ull, 5ull), 2ull)
     TEST(idivide(-10, 5), -2)
 
+    TEST(divide10(12345678901234567890ull), 1234567890123456789ull)
+    TEST(divide7(18446744073709551615ull), 2635249153387078802ull)
+    TEST(divide16(18446744073709551615ull), 1152921504606846975ull)
+    TEST(idivide7(100), 14)
+    TEST(idivide7(-100), -14)
+    TEST(idivide7(-9223372036854775807ll - 1), -1317624576693539401ll)
+    TEST(idivide_minus10(99), -9)
+    TEST(idivide_minus10(-99), 9)
+    TEST(idivide8(-17), -2)
+    TEST(idivide8(17), 2)
+    TEST(idivide_minus2(-7), 3)
+    TEST(idivide_minus2(7), -3)
+    TEST(imultiply_consts(-3), -3036)
+
     TEST(negate(-10), 10)
     TEST(negate(5), -5)
 
@@ -137,5 +162,11 @@ int main()
     TEST(basic_block_test(true), 170);
     TEST(basic_block_test(false), 150);
 
+    TEST(branch_test(1, 2), 35);
+    TEST(branch_test(2, 1), 44);
+    TEST(branch_test(3, 3), 26);
+    TEST(branch_test(18446744073709551615ull, 1), 44);
+    TEST(branch_test(1, 18446744073709551615ull), 35);
+
     return 0;
 }